@@ -0,0 +1,154 @@
+/*
+ * anewkirk
+ *
+ * The memory an instruction accesses; see access.h.
+ */
+
+#include "access.h"
+#include "mem.h"
+#include "reflect.h"
+#include <stdint.h>
+
+static inline uint16_t pair(RVM *rvm, uint8_t xy) {
+  return rvm->reg[xy >> 4] << 8 | rvm->reg[xy & 0xF];
+}
+
+// The byte count rE:rF of the bulk memory sys calls
+static inline uint32_t bulk_len(RVM *rvm) {
+  return rvm->reg[0xE] << 8 | rvm->reg[0xF];
+}
+
+uint32_t insn_reads(RVM *rvm, const uint8_t *b, uint16_t *at, uint32_t *len) {
+  uint16_t sp = rvm->sp;
+  switch(b[0]) {
+  case 0x04:
+    at[0] = b[2] << 8 | b[3];
+    len[0] = 1;
+    return 1;
+  case 0x08:
+  case 0x2C:
+    at[0] = pair(rvm, b[1]);
+    len[0] = 1;
+    return 1;
+  case 0x2B:
+    at[0] = pair(rvm, b[1]) + b[3];
+    len[0] = 1;
+    return 1;
+  case 0x18:
+    at[0] = sp + 1;
+    len[0] = 2;
+    return 1;
+  case 0x1A:
+    at[0] = sp + 1;
+    len[0] = 1;
+    return 1;
+  case 0x20:
+    break;
+  default:
+    return 0;
+  }
+
+  uint16_t addr = pair(rvm, b[1]);
+  if(rvm->sys && rvm->sys[b[2]]) {
+    return 0;
+  }
+  switch(b[2]) {
+  case 0x00:
+  case 0x04:
+  case 0x09:
+  case 0x0A:
+    at[0] = sp + 1;
+    len[0] = 1;
+    return 1;
+  case 0x02:
+  case 0x06:
+    at[0] = addr;
+    len[0] = 1;
+    return 1;
+  case 0x08:
+    // The count is popped, then that many bytes printed
+    at[0] = sp + 1;
+    len[0] = 1;
+    at[1] = addr;
+    len[1] = vm_load(rvm, sp + 1);
+    return len[1] ? 2 : 1;
+  case 0x0B:
+    at[0] = rvm->reg[0xC] << 8 | rvm->reg[0xD];
+    len[0] = bulk_len(rvm);
+    return len[0] ? 1 : 0;
+  case 0x0D:
+    at[0] = addr;
+    at[1] = rvm->reg[0xC] << 8 | rvm->reg[0xD];
+    len[0] = len[1] = bulk_len(rvm);
+    return len[0] ? 2 : 0;
+  case 0x0E:
+  case 0x0F:
+    at[0] = addr;
+    len[0] = bulk_len(rvm);
+    return len[0] ? 1 : 0;
+  }
+  return 0;
+}
+
+uint32_t insn_writes(RVM *rvm, const uint8_t *b, uint16_t *at, uint32_t *len) {
+  uint16_t sp = rvm->sp;
+  switch(b[0]) {
+  case 0x03:
+    at[0] = b[2] << 8 | b[3];
+    len[0] = 1;
+    return 1;
+  case 0x06:
+  case 0x07:
+  case 0x2D:
+    at[0] = pair(rvm, b[1]);
+    len[0] = 1;
+    return 1;
+  case 0x16:
+  case 0x17:
+    at[0] = sp - 1;
+    len[0] = 2;
+    return 1;
+  case 0x19:
+  case 0x1B:
+    at[0] = sp;
+    len[0] = 1;
+    return 1;
+  case 0x20:
+    break;
+  default:
+    return 0;
+  }
+
+  uint16_t addr = pair(rvm, b[1]);
+  if(rvm->sys && rvm->sys[b[2]]) {
+    return 0;
+  }
+  switch(b[2]) {
+  case 0x01:
+  case 0x05:
+  case 0x0D:
+  case 0x0E:
+    at[0] = sp;
+    len[0] = 1;
+    return 1;
+  case 0x03:
+  case 0x07:
+    at[0] = addr;
+    len[0] = 1;
+    return 1;
+  case 0x09:
+  case 0x0A:
+    // The count is popped and the bytes read pushed in its place
+    at[0] = sp + 1;
+    len[0] = 1;
+    at[1] = addr;
+    len[1] = vm_load(rvm, sp + 1);
+    return len[1] ? 2 : 1;
+  case 0x0B:
+  case 0x0C:
+    at[0] = addr;
+    len[0] = bulk_len(rvm);
+    return len[0] ? 1 : 0;
+  }
+  return 0;
+}
@@ -0,0 +1,19 @@
+/* anewkirk */
+
+#pragma once
+
+#include "reflect.h"
+#include <stdint.h>
+
+// The most ranges one instruction reads or writes
+#define ACCESS_MAX 2
+
+/*
+ * The memory the instruction in b is about to read or write, worked
+ * out from its bytes and the state of rvm before it runs, as ranges
+ * at[i], len[i]. Each returns how many, up to ACCESS_MAX. Fetching
+ * the instruction itself is not a read, and sys calls with a host
+ * handler (see rvm.h) access nothing as far as these know.
+ */
+uint32_t insn_reads(RVM *rvm, const uint8_t *b, uint16_t *at, uint32_t *len);
+uint32_t insn_writes(RVM *rvm, const uint8_t *b, uint16_t *at, uint32_t *len);
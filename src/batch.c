@@ -0,0 +1,397 @@
+/*
+ * anewkirk
+ *
+ * The batch engine: many instances of one image in lockstep.
+ *
+ * Every step takes the lowest pc among the running lanes and runs the
+ * instruction there on all lanes sitting at it. Moves, ALU operations
+ * and branches work on whole rows of the register file with GCC vector
+ * types, LANE_CHUNK lanes at a time; the engine is built both for AVX2
+ * and for baseline SSE2 and picks one when the program starts. Memory
+ * operations, register-pair arithmetic, calls and returns run the
+ * shared OP() semantics one lane at a time, and sys calls, hlt and
+ * illegal opcodes go through the switch interpreter on the lane's own
+ * RVM.
+ *
+ * All lanes share one predecode cache, filled from the image before
+ * the run. A store into predecoded code drops the entries it covers,
+ * and those addresses run lane by lane from then on, since the lanes
+ * may no longer agree on what the code there is.
+ */
+
+#include "batch.h"
+#include "bool.h"
+#include "icache.h"
+#include "mem.h"
+#include "op.h"
+#include "reflect.h"
+#include "snapshot.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t v32b __attribute__((vector_size(32)));
+typedef int8_t v16sb __attribute__((vector_size(16)));
+typedef uint16_t v16h __attribute__((vector_size(32)));
+typedef int16_t v16sh __attribute__((vector_size(32)));
+
+#define V8(p, i) (*(v32b *)((p) + (i)))
+#define V16(p, i) (*(v16h *)((p) + (i)))
+#define BLEND(old, new, m) (((new) & (m)) | ((old) & ~(m)))
+
+#define INLINE static inline __attribute__((always_inline))
+
+#if defined(__x86_64__)
+#define VECTOR_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define VECTOR_TARGETS
+#endif
+
+// Steps between moving the per-lane counts into each lane's icount
+#define COUNT_FLUSH 0x8000
+
+// Per-lane instruction counts since the last flush, one per lane
+static uint16_t *counts_of(Batch *b) {
+  return (uint16_t *)(b->mask + b->width);
+}
+
+static void *lane_array(uint32_t width, size_t size) {
+  void *p;
+  if(posix_memalign(&p, 32, width * size)) {
+    printf("Out of memory\n");
+    exit(1);
+  }
+  memset(p, 0, width * size);
+  return p;
+}
+
+Batch *new_batch(uint8_t *filename, uint32_t n) {
+  Batch *b = malloc(sizeof(Batch));
+  b->n = n;
+  b->width = (n + LANE_CHUNK - 1) / LANE_CHUNK * LANE_CHUNK;
+  if(!b->width) {
+    b->width = LANE_CHUNK;
+  }
+  b->lanes = malloc(n * sizeof(RVM *));
+  for(uint32_t r = 0; r < 0x10; r++) {
+    b->reg[r] = lane_array(b->width, 1);
+  }
+  b->pc = lane_array(b->width, 2);
+  b->sp = lane_array(b->width, 2);
+  b->z = lane_array(b->width, 1);
+  b->active = lane_array(b->width, 1);
+  // The mask is followed by the 16-bit lane counts
+  b->mask = lane_array(b->width, 3);
+  b->live = n;
+  b->icount = 0;
+  b->vector = 0;
+  b->steps = 0;
+
+  // Lanes are copy-on-write clones of the first
+  RVM *first = new_rvm();
+  load_code(first, filename);
+  first->fuse = false;
+  Snapshot *image = rvm_snapshot(first);
+  icache_init(first);
+  icache_prepare(first, first->pc);
+
+  for(uint32_t i = 0; i < n; i++) {
+    RVM *rvm = first;
+    if(i) {
+      rvm = rvm_clone(image);
+      rvm->icache = first->icache;
+      rvm->code_map = first->code_map;
+    }
+    rvm->r_flag = true;
+    b->lanes[i] = rvm;
+    b->active[i] = 0xFF;
+    // Every lane starts where the image put the first
+    b->pc[i] = first->pc;
+    b->sp[i] = first->sp;
+    b->z[i] = first->z_flag;
+    for(uint32_t r = 0; r < 0x10; r++) {
+      b->reg[r][i] = first->reg[r];
+    }
+  }
+  free_snapshot(image);
+  return b;
+}
+
+void free_batch(Batch *b) {
+  for(uint32_t i = 0; i < b->n; i++) {
+    if(i) {
+      b->lanes[i]->icache = NULL;
+      b->lanes[i]->code_map = NULL;
+    }
+    free_rvm(b->lanes[i]);
+  }
+  for(uint32_t r = 0; r < 0x10; r++) {
+    free(b->reg[r]);
+  }
+  free(b->pc);
+  free(b->sp);
+  free(b->z);
+  free(b->active);
+  free(b->mask);
+  free(b->lanes);
+  free(b);
+}
+
+// Mask bytes of 16 lanes from i, widened to 16 bits
+#define MASK16(m, i)							\
+  ((v16h)__builtin_convertvector(*(const v16sb *)((m) + (i)), v16sh))
+
+INLINE uint16_t min_pc(Batch *b) {
+  v16h best = (v16h){} + 0xFFFF;
+  for(uint32_t i = 0; i < b->width; i += 16) {
+    // Halted lanes read as $FFFF
+    v16h p = V16(b->pc, i) | ~MASK16(b->active, i);
+    best = BLEND(best, p, (v16h)(p < best));
+  }
+  uint16_t m = best[0];
+  for(uint32_t k = 1; k < 16; k++) {
+    m = best[k] < m ? best[k] : m;
+  }
+  return m;
+}
+
+// Selects the running lanes at pc cur and returns how many there are
+INLINE uint32_t make_mask(Batch *b, uint16_t cur) {
+  uint32_t count = 0;
+  for(uint32_t i = 0; i < b->width; i += 16) {
+    v16sb m = __builtin_convertvector(V16(b->pc, i) == cur, v16sb);
+    m &= *(v16sb *)(b->active + i);
+    *(v16sb *)(b->mask + i) = m;
+
+    uint64_t w[2];
+    memcpy(w, &m, sizeof(w));
+    count += (__builtin_popcountll(w[0]) + __builtin_popcountll(w[1])) / 8;
+  }
+  return count;
+}
+
+/*
+ * Moves the selected lanes to next, or to target where the zero
+ * flag equals want_z if branch is set, and counts the instruction.
+ */
+INLINE void advance(Batch *b, uint16_t next, uint16_t target, bool branch,
+		    bool want_z) {
+  uint16_t *counts = counts_of(b);
+  for(uint32_t i = 0; i < b->width; i += 16) {
+    v16h m = MASK16(b->mask, i);
+    v16h to = (v16h){} + next;
+    if(branch) {
+      v16h z = (v16h)(MASK16(b->z, i) != 0);
+      v16h taken = want_z ? z : ~z;
+      to = BLEND(to, (v16h){} + target, taken);
+    }
+    V16(b->pc, i) = BLEND(V16(b->pc, i), to, m);
+    // The mask is all ones (-1) in selected lanes
+    V16(counts, i) -= m;
+  }
+}
+
+/*
+ * Applies EXPR, a function of x = reg[d] and y, to the selected
+ * lanes. WRITE stores the result in reg[d]; SET_Z sets the zero
+ * flag from it. With SAFE_Y, unselected lanes divide by one.
+ */
+#define ALU(Y, EXPR, WRITE, SET_Z, SAFE_Y) do {				\
+    for(uint32_t i = 0; i < b->width; i += LANE_CHUNK) {		\
+      v32b m = V8(b->mask, i);						\
+      v32b x = V8(b->reg[d], i);					\
+      v32b y = (Y);							\
+      if(SAFE_Y) {							\
+	y = BLEND((v32b){} + 1, y, m);					\
+      }									\
+      v32b r = (EXPR);							\
+      if(WRITE) {							\
+	V8(b->reg[d], i) = BLEND(x, r, m);				\
+      }									\
+      if(SET_Z) {							\
+	V8(b->z, i) = BLEND(V8(b->z, i), (v32b)(r == 0) & 1, m);	\
+      }									\
+    }									\
+  } while(0)
+
+#define RR V8(b->reg[s], i)
+#define RI ((v32b){} + e->imm8)
+
+// Runs the instruction with OP() on each selected lane in turn
+#define REG(r) b->reg[r][i]
+#define STORE(addr, val) vm_store(rvm, (addr), (val))
+#define LANES(OPC) do {						\
+    uint16_t *counts = counts_of(b);				\
+    for(uint32_t i = 0; i < b->width; i++) {			\
+      if(!b->mask[i]) {						\
+	continue;						\
+      }								\
+      RVM *rvm = b->lanes[i];					\
+      MemBase mem = MEM_BASE(rvm);				\
+      uint16_t pc = cur;					\
+      uint16_t sp = b->sp[i];					\
+      bool z = b->z[i];						\
+      bool carry = rvm->c_flag;					\
+      bool neg = rvm->n_flag;					\
+      OP(OPC, e, next);						\
+      b->pc[i] = pc;						\
+      b->sp[i] = sp;						\
+      b->z[i] = z;						\
+      rvm->c_flag = carry;					\
+      rvm->n_flag = neg;					\
+      counts[i]++;						\
+    }								\
+  } while(0)
+
+// Runs the instruction at lane i's pc on its RVM with execute()
+static void lane_step(Batch *b, uint32_t i) {
+  RVM *rvm = b->lanes[i];
+  for(uint32_t r = 0; r < 0x10; r++) {
+    rvm->reg[r] = b->reg[r][i];
+  }
+  rvm->pc = b->pc[i];
+  rvm->sp = b->sp[i];
+  rvm->z_flag = b->z[i];
+
+  fetch(rvm);
+  decode(rvm);
+  execute(rvm);
+
+  for(uint32_t r = 0; r < 0x10; r++) {
+    b->reg[r][i] = rvm->reg[r];
+  }
+  b->pc[i] = rvm->pc;
+  b->sp[i] = rvm->sp;
+  b->z[i] = rvm->z_flag;
+  counts_of(b)[i]++;
+  if(!rvm->r_flag) {
+    b->active[i] = 0;
+    b->live--;
+  }
+}
+
+static void flush_counts(Batch *b) {
+  uint16_t *counts = counts_of(b);
+  for(uint32_t i = 0; i < b->n; i++) {
+    b->lanes[i]->icount += counts[i];
+    counts[i] = 0;
+  }
+}
+
+VECTOR_TARGETS
+static void run_lanes(Batch *b) {
+  Insn *icache = b->lanes[0]->icache;
+
+  while(b->live) {
+    uint16_t cur = min_pc(b);
+    uint32_t count = make_mask(b, cur);
+    Insn *e = &icache[cur];
+    uint8_t d = e->reg_d;
+    uint8_t s = e->reg_s;
+    uint16_t next = cur + e->len;
+    bool vector = true;
+
+    switch(e->handler) {
+    case H_NOP: break;
+    case H_MOV_RR: ALU(RR, y, true, false, false); break;
+    case H_MOV_RI: ALU(RI, y, true, false, false); break;
+    case H_MOV_PI: {
+      uint8_t hi = e->imm16 >> 8;
+      uint8_t lo = e->imm16 & 0xFF;
+      d = e->reg_s;
+      ALU((v32b){} + lo, y, true, false, false);
+      d = e->reg_d;
+      ALU((v32b){} + hi, y, true, false, false);
+      break;
+    }
+    case H_ADD: ALU(RR, x + y, true, true, false); break;
+    case H_SUB: ALU(RR, x - y, true, true, false); break;
+    case H_INC: ALU(RI, x + 1, true, true, false); break;
+    case H_DEC: ALU(RI, x - 1, true, true, false); break;
+    case H_CMP_RR: ALU(RR, x - y, false, true, false); break;
+    case H_CMP_RI: ALU(RI, x - y, false, true, false); break;
+    case H_AND: ALU(RR, x & y, true, false, false); break;
+    case H_OR: ALU(RR, x | y, true, false, false); break;
+    case H_XOR: ALU(RR, x ^ y, true, false, false); break;
+    case H_MUL_RR: ALU(RR, x * y, true, false, false); break;
+    case H_MUL_RI: ALU(RI, x * y, true, false, false); break;
+    case H_DIV_RR: ALU(RR, x / y, true, false, true); break;
+    case H_DIV_RI: ALU(RI, x / y, true, false, true); break;
+    case H_MOD_RR: ALU(RR, x % y, false, true, true); break;
+    case H_MOD_RI: ALU(RI, x % y, false, true, true); break;
+    case H_JMP_I:
+      advance(b, e->imm16, 0, false, false);
+      break;
+    case H_JZ_I:
+      advance(b, next, e->imm16, true, true);
+      break;
+    case H_JNZ_I:
+      advance(b, next, e->imm16, true, false);
+      break;
+    case H_DJNZ:
+      ALU(RI, x - 1, true, true, false);
+      advance(b, next, e->imm16, true, false);
+      break;
+
+    case H_MOV_AR: LANES(0x03); vector = false; break;
+    case H_MOV_RA: LANES(0x04); vector = false; break;
+    case H_MOV_MI: LANES(0x06); vector = false; break;
+    case H_MOV_MR: LANES(0x07); vector = false; break;
+    case H_MOV_RM: LANES(0x08); vector = false; break;
+    case H_JMP_P: LANES(0x13); vector = false; break;
+    case H_JZ_P: LANES(0x14); vector = false; break;
+    case H_JNZ_P: LANES(0x15); vector = false; break;
+    case H_CALL_I: LANES(0x16); vector = false; break;
+    case H_CALL_P: LANES(0x17); vector = false; break;
+    case H_RET: LANES(0x18); vector = false; break;
+    case H_PUSH_R: LANES(0x19); vector = false; break;
+    case H_POP: LANES(0x1A); vector = false; break;
+    case H_PUSH_I: LANES(0x1B); vector = false; break;
+    case H_ADD_P: LANES(0x26); vector = false; break;
+    case H_SUB_P: LANES(0x27); vector = false; break;
+    case H_INC_P: LANES(0x28); vector = false; break;
+    case H_DEC_P: LANES(0x29); vector = false; break;
+    case H_CMP_P: LANES(0x2A); vector = false; break;
+    case H_MOV_RO: LANES(0x2B); vector = false; break;
+    case H_MOV_RMI: LANES(0x2C); vector = false; break;
+    case H_MOV_MRI: LANES(0x2D); vector = false; break;
+    case H_JC_I: LANES(0x2F); vector = false; break;
+    case H_JN_I: LANES(0x30); vector = false; break;
+
+    default:
+      // Sys calls, hlt, illegal opcodes and code that was written to
+      for(uint32_t i = 0; i < b->width; i++) {
+	if(b->mask[i]) {
+	  lane_step(b, i);
+	}
+      }
+      vector = false;
+      break;
+    }
+
+    if(vector) {
+      switch(e->handler) {
+      case H_JMP_I:
+      case H_JZ_I:
+      case H_JNZ_I:
+      case H_DJNZ:
+	break;
+      default:
+	advance(b, next, 0, false, false);
+	break;
+      }
+      b->vector += count;
+    }
+    b->icount += count;
+
+    if(++b->steps % COUNT_FLUSH == 0) {
+      flush_counts(b);
+    }
+  }
+}
+
+void run_batch(Batch *b) {
+  run_lanes(b);
+  flush_counts(b);
+}
@@ -0,0 +1,62 @@
+/* anewkirk */
+
+#pragma once
+
+#include "reflect.h"
+#include <stdint.h>
+
+// Lanes processed by one vector operation of the batch engine
+#define LANE_CHUNK 32
+
+/*
+ * Many instances of one image, run in lockstep. Registers, pc, sp
+ * and flags are kept in struct-of-arrays form so lanes that share a
+ * pc execute together with vector instructions; each lane's memory
+ * and console I/O stay in its own RVM.
+ */
+typedef struct _batch {
+  // Lanes, and the lane count rounded up to LANE_CHUNK
+  uint32_t n;
+  uint32_t width;
+  RVM **lanes;
+
+  // reg[r][lane], and the rest of the per-lane state
+  uint8_t *reg[0x10];
+  uint16_t *pc;
+  uint16_t *sp;
+  uint8_t *z;
+
+  // 0xFF for lanes still running, 0 for halted and padding lanes
+  uint8_t *active;
+  uint32_t live;
+
+  // 0xFF for lanes taking part in the current step
+  uint8_t *mask;
+
+  // Lane instructions retired, and how many of them ran in vector
+  // kernels rather than one lane at a time
+  uint64_t icount;
+  uint64_t vector;
+
+  // Steps taken, each running one instruction on every lane at a pc
+  uint64_t steps;
+} Batch;
+
+/*
+ * Creates a batch of n lanes running the image in filename. Each
+ * lane is an ordinary RVM whose input and output can be set up
+ * before run_batch().
+ */
+Batch *new_batch(uint8_t *filename, uint32_t n);
+
+/*
+ * Frees a batch and all of its lanes.
+ */
+void free_batch(Batch *b);
+
+/*
+ * Runs every lane to hlt. Each step picks the lowest pc among the
+ * running lanes, so lanes that split at a branch tend to meet again
+ * at the join, and runs that instruction on every lane at it.
+ */
+void run_batch(Batch *b);
@@ -7,19 +7,24 @@
 #include "bool.h"
 #include "disasm.h"
 #include "disasm_backend.h"
+#include "image.h"
 #include "queue.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
-uint16_t pgm_len;
+Image *img;
+
+// The 64 KiB the image loads into, and which of its bytes it sets
 uint8_t *pgm;
+uint8_t *loaded;
 
 /* Bytes marked as 0xFF in shadow have been
    disassembled */
 uint8_t *shadow;
 
-/* disassembly contains the disassembled program*/
+/* disassembly contains the disassembled program, by address */
 uint8_t **disassembly;
 
 int main(int argc, char *argv[]) {
@@ -30,7 +35,7 @@ int main(int argc, char *argv[]) {
 
   init(argv[1]);
   Queue *analysis_queue = new_queue();
-  enqueue(analysis_queue, 0x0000);
+  seed(analysis_queue);
   disassemble_pgm(analysis_queue);
 
 
@@ -41,8 +46,15 @@ int main(int argc, char *argv[]) {
     printf("Failed to open file: %s\n", argv[2]);
     exit(1);
   }
-  
-  for(uint16_t i = 0; i < pgm_len; i++) {
+
+  // Addresses are those the bytes load at, not file offsets
+  for(uint32_t i = 0; i < 0x10000; i++) {
+    if(!loaded[i]) {
+      continue;
+    }
+    if(img->header && (!i || !loaded[i - 1])) {
+      fprintf(f, ";; Segment at 0x%04X\n\n", i);
+    }
     if(disassembly[i] != NULL) {
       fprintf(f, ";; 0x%04X:\n", i);
       fprintf(f, "%s\n\n", disassembly[i]);
@@ -50,15 +62,19 @@ int main(int argc, char *argv[]) {
       fprintf(f, ";; 0x%04X:\n", i);
       fprintf(f, "db %02X\n\n", pgm[i]);
     }
-    free(disassembly[i]);
   }
 
   // clean up
   fclose(f);
+  for(uint32_t i = 0; i < 0x10000; i++) {
+    free(disassembly[i]);
+  }
   free(shadow);
+  free(loaded);
   free(pgm);
   free(disassembly);
   destroy_queue(analysis_queue);
+  close_image(img);
 }
 
 void disassemble_pgm(Queue *q) {
@@ -66,19 +82,22 @@ void disassemble_pgm(Queue *q) {
   while(q->size) {
     pc = dequeue(q);
     bool running = true;
-    while(running) {
+    while(running && loaded[pc]) {
       uint8_t adv = 0;
       uint8_t bytes[4];
-      bytes[0] = pgm[pc];
-      bytes[1] = pgm[pc + 1];
-      bytes[2] = pc < pgm_len - 2 ? pgm[pc + 2] : 0x00;
-      bytes[3] = pc < pgm_len - 3 ? pgm[pc + 3] : 0x00;
+      for(uint8_t i = 0; i < 4; i++) {
+	bytes[i] = pgm[(uint16_t)(pc + i)];
+      }
 
       if(!disassembly[pc]) {
 	disassembly[pc] = disassemble(bytes, &adv);
       } else {
 	break;
       }
+      // Not an instruction; leave it as data
+      if(!disassembly[pc]) {
+	break;
+      }
       
       uint16_t dest = bytes[2] << 8 | bytes[3];
       switch(bytes[0]) {
@@ -95,6 +114,9 @@ void disassemble_pgm(Queue *q) {
       case 0x11:
       case 0x12:
       case 0x16:
+      case 0x2E:
+      case 0x2F:
+      case 0x30:
 	if(!disassembly[dest]) {
 	  enqueue(q, dest);
 	}
@@ -102,9 +124,7 @@ void disassemble_pgm(Queue *q) {
       }
 
       for(uint8_t i = 0; i < adv; i++) {
-	if(pc + i < pgm_len) {
-	  shadow[pc + i] = 0xFF;
-	}
+	shadow[(uint16_t)(pc + i)] = 0xFF;
       }
       
       pc += adv;
@@ -112,24 +132,38 @@ void disassemble_pgm(Queue *q) {
   }
 }
 
+void seed(Queue *q) {
+  const ImageHeader *h = img->header;
+  enqueue(q, h ? h->entry : 0x0000);
 
-
-void init(uint8_t *filename) {
-  FILE *fp;
-  uint32_t len;
-  fp = fopen(filename, "rb");
-  fseek(fp, 0, SEEK_END);
-  len = ftell(fp);
-  if(len > 0xFFFF) {
-    printf("File size too large.\n");
-    exit(1);
+  // Code only reached through a pointer is found from the boundaries
+  if(h && h->boundaries) {
+    const uint8_t *bits = img->data + h->boundaries;
+    for(uint32_t a = 0; a < 0x10000; a++) {
+      if(bits[a >> 3] & 1 << (a & 7)) {
+	enqueue(q, a);
+      }
+    }
   }
+}
 
-  pgm_len = len;
-  pgm = malloc(len);
-  shadow = calloc(1, len);
-  disassembly = calloc(len, sizeof(uint8_t *));  
-  rewind(fp);
-  fread(pgm, len, 1, fp);
-  fclose(fp);
+void init(const char *filename) {
+  img = open_image(filename);
+  pgm = calloc(0x10000, 1);
+  loaded = calloc(0x10000, 1);
+  shadow = calloc(0x10000, 1);
+  disassembly = calloc(0x10000, sizeof(uint8_t *));
+
+  // A legacy image is one segment at $0000
+  const ImageHeader *h = img->header;
+  if(!h) {
+    memcpy(pgm, img->data, img->size);
+    memset(loaded, 1, img->size);
+    return;
+  }
+  const ImageSegment *seg = (const ImageSegment *)(h + 1);
+  for(uint32_t i = 0; i < h->num_segments; i++) {
+    memcpy(pgm + seg[i].addr, img->data + seg[i].offset, seg[i].len);
+    memset(loaded + seg[i].addr, 1, seg[i].len);
+  }
 }
@@ -5,6 +5,16 @@
 #include "queue.h"
 #include <stdint.h>
 
-void init(uint8_t *filename);
+/*
+ * Opens the image at filename, a container or a legacy raw image,
+ * and lays its segments out at their load addresses.
+ */
+void init(const char *filename);
+
+/*
+ * Queues the entry point and, when the image has them, the
+ * instruction boundaries.
+ */
+void seed(Queue *q);
 
 void disassemble_pgm(Queue *q);
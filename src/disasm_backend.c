@@ -239,9 +239,25 @@ uint8_t *disassemble(uint8_t *bytes, uint8_t *num_bytes_advanced) {
     case 0x03:
     case 0x06:
     case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0A:
       snprintf(r, MAXLEN, "sys r%X:r%X, $%02X", reg_d, reg_s, bytes[2]);
       *num_bytes_advanced = 3;
       break;
+    case 0x0B:
+    case 0x0C:
+    case 0x0D:
+    case 0x0E:
+    case 0x0F: {
+      // Bulk memory calls; name the operation
+      static const char *bulk[] = {"move", "fill", "compare", "find",
+				   "checksum"};
+      snprintf(r, MAXLEN, "sys r%X:r%X, $%02X ; %s", reg_d, reg_s, bytes[2],
+	       bulk[bytes[2] - 0x0B]);
+      *num_bytes_advanced = 3;
+      break;
+    }
     }
     break;
   }
@@ -275,6 +291,68 @@ uint8_t *disassemble(uint8_t *bytes, uint8_t *num_bytes_advanced) {
     *num_bytes_advanced = 3;
     break;
   }
+  case 0x26:
+  case 0x27:
+  case 0x2A: {
+    // add/sub/cmp rx:ry, ru:rv
+    const char *name = opcode == 0x26 ? "add" : opcode == 0x27 ? "sub" : "cmp";
+    snprintf(r, MAXLEN, "%s r%X:r%X, r%X:r%X", name, reg_d, reg_s,
+	     bytes[2] >> 4, bytes[2] & 0xF);
+    *num_bytes_advanced = 3;
+    break;
+  }
+  case 0x28: {
+    // inc rx:ry
+    snprintf(r, MAXLEN, "inc r%X:r%X", reg_d, reg_s);
+    *num_bytes_advanced = 2;
+    break;
+  }
+  case 0x29: {
+    // dec rx:ry
+    snprintf(r, MAXLEN, "dec r%X:r%X", reg_d, reg_s);
+    *num_bytes_advanced = 2;
+    break;
+  }
+  case 0x2B: {
+    // mov rc, [rx:ry+$imm8]
+    snprintf(r, MAXLEN, "mov r%X, [r%X:r%X+$%02X]", bytes[2] & 0xF, reg_d,
+	     reg_s, bytes[3]);
+    *num_bytes_advanced = 4;
+    break;
+  }
+  case 0x2C: {
+    // mov rc, [rx:ry+]
+    snprintf(r, MAXLEN, "mov r%X, [r%X:r%X+]", bytes[2] & 0xF, reg_d, reg_s);
+    *num_bytes_advanced = 3;
+    break;
+  }
+  case 0x2D: {
+    // mov [rx:ry+], rc
+    snprintf(r, MAXLEN, "mov [r%X:r%X+], r%X", reg_d, reg_s, bytes[2] & 0xF);
+    *num_bytes_advanced = 3;
+    break;
+  }
+  case 0x2E: {
+    // djnz rx, $imm16
+    uint16_t addr = bytes[2] << 8 | bytes[3];
+    snprintf(r, MAXLEN, "djnz r%X, $%04X", reg_d, addr);
+    *num_bytes_advanced = 4;
+    break;
+  }
+  case 0x2F: {
+    // jc $imm16
+    uint16_t addr = bytes[2] << 8 | bytes[3];
+    snprintf(r, MAXLEN, "jc $%04X", addr);
+    *num_bytes_advanced = 4;
+    break;
+  }
+  case 0x30: {
+    // jn $imm16
+    uint16_t addr = bytes[2] << 8 | bytes[3];
+    snprintf(r, MAXLEN, "jn $%04X", addr);
+    *num_bytes_advanced = 4;
+    break;
+  }
   default: {
     free(r);
     return NULL;
@@ -0,0 +1,388 @@
+/*
+ * anewkirk
+ *
+ * The predecoded instruction cache. Each of the 64 KiB addresses has
+ * an entry holding the handler, operands and length of the instruction
+ * that starts there, so engines built on it never re-split register
+ * nibbles or re-read immediates in their hot loop. A bitmap of the
+ * bytes covered by decoded entries lets memory writes find out in one
+ * test whether they touched code.
+ *
+ * The decoder also fuses common instruction sequences, listed in
+ * fusion.def, into superinstructions that run as a single handler.
+ */
+
+#include "bool.h"
+#include "icache.h"
+#include "jit.h"
+#include "mem.h"
+#include "queue.h"
+#include "reflect.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint8_t handlers[0x100] = {
+  [0x00 ... 0xFF] = H_ILLEGAL,
+  [0x00] = H_NOP,
+  [0x01] = H_MOV_RR,
+  [0x02] = H_MOV_RI,
+  [0x03] = H_MOV_AR,
+  [0x04] = H_MOV_RA,
+  [0x05] = H_MOV_PI,
+  [0x06] = H_MOV_MI,
+  [0x07] = H_MOV_MR,
+  [0x08] = H_MOV_RM,
+  [0x09] = H_HLT,
+  [0x0A] = H_ADD,
+  [0x0B] = H_SUB,
+  [0x0C] = H_INC,
+  [0x0D] = H_DEC,
+  [0x0E] = H_CMP_RR,
+  [0x0F] = H_CMP_RI,
+  [0x10] = H_JMP_I,
+  [0x11] = H_JZ_I,
+  [0x12] = H_JNZ_I,
+  [0x13] = H_JMP_P,
+  [0x14] = H_JZ_P,
+  [0x15] = H_JNZ_P,
+  [0x16] = H_CALL_I,
+  [0x17] = H_CALL_P,
+  [0x18] = H_RET,
+  [0x19] = H_PUSH_R,
+  [0x1A] = H_POP,
+  [0x1B] = H_PUSH_I,
+  [0x1C] = H_AND,
+  [0x1D] = H_OR,
+  [0x1E] = H_XOR,
+  [0x1F] = H_MUL_RR,
+  [0x20] = H_SYS,
+  [0x21] = H_DIV_RR,
+  [0x22] = H_MUL_RI,
+  [0x23] = H_DIV_RI,
+  [0x24] = H_MOD_RR,
+  [0x25] = H_MOD_RI,
+  [0x26] = H_ADD_P,
+  [0x27] = H_SUB_P,
+  [0x28] = H_INC_P,
+  [0x29] = H_DEC_P,
+  [0x2A] = H_CMP_P,
+  [0x2B] = H_MOV_RO,
+  [0x2C] = H_MOV_RMI,
+  [0x2D] = H_MOV_MRI,
+  [0x2E] = H_DJNZ,
+  [0x2F] = H_JC_I,
+  [0x30] = H_JN_I,
+};
+
+static const uint8_t lengths[0x100] = {
+  [0x00 ... 0xFF] = 2,
+  [0x02] = 3,
+  [0x03] = 4,
+  [0x04] = 4,
+  [0x05] = 4,
+  [0x06] = 3,
+  [0x07] = 3,
+  [0x08] = 3,
+  [0x0F] = 3,
+  [0x10] = 4,
+  [0x11] = 4,
+  [0x12] = 4,
+  [0x16] = 4,
+  [0x1B] = 3,
+  [0x20] = 3,
+  [0x22] = 3,
+  [0x23] = 3,
+  [0x25] = 3,
+  [0x26] = 3,
+  [0x27] = 3,
+  [0x2A] = 3,
+  [0x2B] = 4,
+  [0x2C] = 3,
+  [0x2D] = 3,
+  [0x2E] = 4,
+  [0x2F] = 4,
+  [0x30] = 4,
+};
+
+typedef struct _fusion {
+  uint8_t handler;
+  uint8_t n;
+  uint8_t ops[MAX_FUSE];
+} Fusion;
+
+static const Fusion fusions[] = {
+#define FUSE2(h, a, b) { h, 2, { a, b } },
+#define FUSE3(h, a, b, c) { h, 3, { a, b, c } },
+#define FUSE4(h, a, b, c, d) { h, 4, { a, b, c, d } },
+#include "fusion.def"
+#undef FUSE2
+#undef FUSE3
+#undef FUSE4
+};
+
+#define NUM_FUSIONS (sizeof(fusions) / sizeof(fusions[0]))
+
+uint8_t plain_handler(uint8_t opcode) {
+  return handlers[opcode];
+}
+
+uint8_t insn_length(uint8_t opcode) {
+  return lengths[opcode];
+}
+
+uint8_t handler_width(uint8_t handler) {
+  for(uint32_t i = 0; i < NUM_FUSIONS; i++) {
+    if(fusions[i].handler == handler) {
+      return fusions[i].n;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Whether an instruction may come before the last one in a
+ * superinstruction: it must fall through and must not write
+ * memory, so nothing it does can change the code that follows.
+ */
+static bool fusable_head(uint8_t opcode) {
+  uint8_t h = handlers[opcode];
+  switch(h) {
+  case H_MOV_AR:
+  case H_MOV_MI:
+  case H_MOV_MR:
+  case H_MOV_MRI:
+  case H_HLT:
+  case H_JMP_I:
+  case H_JZ_I:
+  case H_JNZ_I:
+  case H_JC_I:
+  case H_JN_I:
+  case H_DJNZ:
+  case H_JMP_P:
+  case H_JZ_P:
+  case H_JNZ_P:
+  case H_CALL_I:
+  case H_CALL_P:
+  case H_RET:
+  case H_PUSH_R:
+  case H_PUSH_I:
+  case H_SYS:
+  case H_ILLEGAL:
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Whether the instruction at addr may end a superinstruction. Of the
+ * sys calls, those reading input are left out because the engine
+ * checks before each one whether it would block.
+ */
+static bool fusable_tail(RVM *rvm, uint16_t addr) {
+  uint8_t h = handlers[vm_load(rvm, addr)];
+  if(h == H_SYS) {
+    switch(vm_load(rvm, addr + 2)) {
+    case 0x01:
+    case 0x03:
+    case 0x05:
+    case 0x07:
+    case 0x09:
+    case 0x0A:
+      return false;
+    }
+    return true;
+  }
+  return h != H_HLT && h != H_ILLEGAL;
+}
+
+static bool is_break(RVM *rvm, uint16_t addr) {
+  return rvm->breaks && rvm->breaks[addr >> 3] & 1 << (addr & 7);
+}
+
+void icache_init(RVM *rvm) {
+  if(rvm->icache) {
+    return;
+  }
+  rvm->icache = calloc(0x10000, sizeof(Insn));
+  if(!rvm->code_map) {
+    rvm->code_map = calloc(0x10000 / 8, 1);
+  }
+}
+
+static void mark_code(RVM *rvm, uint16_t addr, uint8_t n) {
+  for(uint8_t i = 0; i < n; i++) {
+    uint16_t a = addr + i;
+    rvm->code_map[a >> 3] |= 1 << (a & 7);
+  }
+}
+
+// Decodes the single instruction at addr
+static void decode_plain(RVM *rvm, uint16_t addr) {
+  Insn *e = &rvm->icache[addr];
+  uint8_t b[MAX_INSN_LEN];
+  for(uint8_t i = 0; i < MAX_INSN_LEN; i++) {
+    b[i] = vm_load(rvm, (uint16_t)(addr + i));
+  }
+
+  e->handler = handlers[b[0]];
+  e->len = lengths[b[0]];
+  e->span = e->len;
+  e->reg_d = b[1] >> 4;
+  e->reg_s = b[1] & 0xF;
+  e->imm8 = b[2];
+  e->imm16 = b[2] << 8 | b[3];
+  mark_code(rvm, addr, e->len);
+}
+
+/*
+ * Returns the longest entry of fusion.def matching the code at
+ * addr, or NULL.
+ */
+static const Fusion *match_fusion(RVM *rvm, uint16_t addr) {
+  const Fusion *best = NULL;
+  for(uint32_t i = 0; i < NUM_FUSIONS; i++) {
+    const Fusion *f = &fusions[i];
+    uint16_t a = addr;
+    uint8_t k;
+    for(k = 0; k < f->n; k++) {
+      uint8_t op = vm_load(rvm, a);
+      bool last = k == f->n - 1;
+      if(op != f->ops[k] || !(last ? fusable_tail(rvm, a) : fusable_head(op))) {
+	break;
+      }
+      if(k && is_break(rvm, a)) {
+	break;
+      }
+      a += lengths[op];
+    }
+    if(k == f->n && (!best || f->n > best->n)) {
+      best = f;
+    }
+  }
+  return best;
+}
+
+void icache_decode(RVM *rvm, uint16_t addr) {
+  decode_plain(rvm, addr);
+  if(is_break(rvm, addr)) {
+    rvm->icache[addr].handler = H_BREAK;
+    return;
+  }
+  if(!rvm->fuse) {
+    return;
+  }
+
+  const Fusion *f = match_fusion(rvm, addr);
+  if(!f) {
+    return;
+  }
+
+  // The superinstruction reads the operands of the instructions after
+  // the first from their own entries, so make sure they are decoded
+  Insn *e = &rvm->icache[addr];
+  uint16_t a = addr + e->len;
+  uint8_t span = e->len;
+  for(uint8_t k = 1; k < f->n; k++) {
+    if(!rvm->icache[a].len) {
+      decode_plain(rvm, a);
+    }
+    span += rvm->icache[a].len;
+    a += rvm->icache[a].len;
+  }
+  e->handler = f->handler;
+  e->span = span;
+}
+
+void icache_prepare(RVM *rvm, uint16_t entry) {
+  // The image already says where the instructions are
+  if(rvm->boundaries) {
+    for(uint32_t a = 0; a < 0x10000; a++) {
+      if(rvm->boundaries[a >> 3] & 1 << (a & 7)) {
+	icache_decode(rvm, a);
+      }
+    }
+    return;
+  }
+
+  uint8_t *seen = calloc(0x10000 / 8, 1);
+  Queue *q = new_queue();
+  enqueue(q, entry);
+
+  while(q->size) {
+    uint16_t pc = dequeue(q);
+    bool running = true;
+    while(running && !(seen[pc >> 3] & 1 << (pc & 7))) {
+      seen[pc >> 3] |= 1 << (pc & 7);
+      icache_decode(rvm, pc);
+
+      Insn *e = &rvm->icache[pc];
+      switch(handlers[vm_load(rvm, pc)]) {
+      case H_JMP_I:
+	enqueue(q, e->imm16);
+	running = false;
+	break;
+      case H_JZ_I:
+      case H_JNZ_I:
+      case H_JC_I:
+      case H_JN_I:
+      case H_DJNZ:
+      case H_CALL_I:
+	enqueue(q, e->imm16);
+	break;
+      case H_HLT:
+      case H_JMP_P:
+      case H_RET:
+	running = false;
+	break;
+      }
+      pc += e->len;
+    }
+  }
+
+  destroy_queue(q);
+  free(seen);
+}
+
+void icache_invalidate(RVM *rvm, uint16_t addr) {
+  if(rvm->jit) {
+    jit_invalidate(rvm, addr);
+  }
+  if(!rvm->icache) {
+    return;
+  }
+
+  // Only entries starting up to MAX_SPAN - 1 bytes back can cover addr
+  for(uint8_t k = 0; k < MAX_SPAN; k++) {
+    Insn *e = &rvm->icache[(uint16_t)(addr - k)];
+    if(e->len && e->span > k) {
+      e->handler = H_DECODE;
+      e->len = 0;
+      e->span = 0;
+    }
+  }
+}
+
+void icache_set_break(RVM *rvm, uint16_t addr) {
+  if(!rvm->breaks) {
+    rvm->breaks = calloc(0x10000 / 8, 1);
+  }
+  rvm->breaks[addr >> 3] |= 1 << (addr & 7);
+  icache_invalidate(rvm, addr);
+}
+
+void icache_clear_break(RVM *rvm, uint16_t addr) {
+  if(rvm->breaks) {
+    rvm->breaks[addr >> 3] &= ~(1 << (addr & 7));
+    icache_invalidate(rvm, addr);
+  }
+}
+
+void icache_flush(RVM *rvm) {
+  if(rvm->icache) {
+    memset(rvm->icache, 0, 0x10000 * sizeof(Insn));
+  }
+  if(rvm->code_map) {
+    memset(rvm->code_map, 0, 0x10000 / 8);
+  }
+}
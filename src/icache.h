@@ -0,0 +1,171 @@
+/* anewkirk */
+
+#pragma once
+
+#include "reflect.h"
+#include <stdint.h>
+
+/*
+ * Handlers a predecoded instruction can dispatch to. H_DECODE is
+ * zero so that a freshly allocated (or invalidated) entry sends the
+ * engine back through the decoder.
+ */
+typedef enum _handler {
+  H_DECODE = 0,
+  H_NOP,
+  H_MOV_RR,
+  H_MOV_RI,
+  H_MOV_AR,
+  H_MOV_RA,
+  H_MOV_PI,
+  H_MOV_MI,
+  H_MOV_MR,
+  H_MOV_RM,
+  H_HLT,
+  H_ADD,
+  H_SUB,
+  H_INC,
+  H_DEC,
+  H_CMP_RR,
+  H_CMP_RI,
+  H_JMP_I,
+  H_JZ_I,
+  H_JNZ_I,
+  H_JMP_P,
+  H_JZ_P,
+  H_JNZ_P,
+  H_CALL_I,
+  H_CALL_P,
+  H_RET,
+  H_PUSH_R,
+  H_POP,
+  H_PUSH_I,
+  H_AND,
+  H_OR,
+  H_XOR,
+  H_MUL_RR,
+  H_SYS,
+  H_DIV_RR,
+  H_MUL_RI,
+  H_DIV_RI,
+  H_MOD_RR,
+  H_MOD_RI,
+  H_ADD_P,
+  H_SUB_P,
+  H_INC_P,
+  H_DEC_P,
+  H_CMP_P,
+  H_MOV_RO,
+  H_MOV_RMI,
+  H_MOV_MRI,
+  H_DJNZ,
+  H_JC_I,
+  H_JN_I,
+  H_ILLEGAL,
+
+  // Breakpoint in front of the instruction decoded into the entry
+  H_BREAK,
+
+  // Superinstructions, all numbered above H_BREAK
+#define FUSE2(h, a, b) h,
+#define FUSE3(h, a, b, c) h,
+#define FUSE4(h, a, b, c, d) h,
+#include "fusion.def"
+#undef FUSE2
+#undef FUSE3
+#undef FUSE4
+
+  H_COUNT
+} Handler;
+
+// A predecoded instruction; the cache holds one per address
+typedef struct _insn {
+  // Handler to dispatch to (a Handler value)
+  uint8_t handler;
+
+  // Instruction length in bytes, 0 while undecoded
+  uint8_t len;
+
+  // Bytes the handler depends on; longer than len for superinstructions
+  uint8_t span;
+
+  // Registers from the high and low nibble of the second byte
+  uint8_t reg_d;
+  uint8_t reg_s;
+
+  // Third byte (8-bit immediate, register or sys call number)
+  uint8_t imm8;
+
+  // Third and fourth bytes as a big-endian 16-bit immediate
+  uint16_t imm16;
+} Insn;
+
+// Longest instruction, in bytes
+#define MAX_INSN_LEN 4
+
+// Most instructions fused into one handler
+#define MAX_FUSE 4
+
+// Longest span of a cache entry, in bytes
+#define MAX_SPAN (MAX_INSN_LEN * MAX_FUSE)
+
+/*
+ * Allocates the predecode cache and its code map for rvm, if
+ * they have not been allocated yet. Every entry starts out
+ * undecoded.
+ */
+void icache_init(RVM *rvm);
+
+/*
+ * Decodes the instruction at addr into its cache entry and marks
+ * the bytes it covers in the code map. Unless rvm->fuse is off,
+ * a run of instructions matching fusion.def is decoded into one
+ * superinstruction; the entries of the instructions after the
+ * first are decoded as well, since its handler reads them.
+ */
+void icache_decode(RVM *rvm, uint16_t addr);
+
+/*
+ * Predecodes all code reachable from entry, following jumps and
+ * calls the way rdsm does, so that a run starts with a warm cache
+ * and its superinstructions already in place. If the image loaded
+ * came with an instruction-boundary bitmap, the instructions it
+ * marks are decoded instead.
+ */
+void icache_prepare(RVM *rvm, uint16_t entry);
+
+/*
+ * Returns the number of instructions the handler executes at
+ * once: 1 for plain instructions, more for superinstructions.
+ */
+uint8_t handler_width(uint8_t handler);
+
+/*
+ * Returns the handler of the plain instruction with the given
+ * opcode, ignoring fusion and breakpoints.
+ */
+uint8_t plain_handler(uint8_t opcode);
+
+/*
+ * Sets or clears a breakpoint at addr. The entry there decodes to
+ * H_BREAK and no superinstruction reaches across it.
+ */
+void icache_set_break(RVM *rvm, uint16_t addr);
+void icache_clear_break(RVM *rvm, uint16_t addr);
+
+/*
+ * Drops every cache entry whose span covers addr, and any JIT
+ * translation of it.
+ */
+void icache_invalidate(RVM *rvm, uint16_t addr);
+
+/*
+ * Drops every cache entry, e.g. after a new image was loaded.
+ */
+void icache_flush(RVM *rvm);
+
+/*
+ * Returns the length in bytes of an instruction with the given
+ * opcode. Illegal opcodes are 2 bytes long, like a nop.
+ */
+uint8_t insn_length(uint8_t opcode);
@@ -0,0 +1,219 @@
+/*
+ * anewkirk
+ *
+ * Loading of .rvm images; see image.h for the format.
+ *
+ * The file is mapped rather than read, and segments are copied
+ * straight from the mapping into VM memory, so starting a VM costs
+ * one open, one mmap and a copy of the bytes it actually loads.
+ */
+
+#include "image.h"
+#include "bool.h"
+#include "icache.h"
+#include "jit.h"
+#include "mem.h"
+#include "reflect.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+uint32_t image_hash(uint32_t hash, const uint8_t *p, uint32_t n) {
+  for(uint32_t i = 0; i < n; i++) {
+    hash = (hash ^ p[i]) * 0x01000193u;
+  }
+  return hash;
+}
+
+// Whether n items of size bytes at offset lie inside the file
+static bool in_file(Image *img, uint32_t offset, uint64_t n, uint32_t size) {
+  return offset <= img->size && n * size <= img->size - offset;
+}
+
+// What is wrong with the container img, or NULL
+static const char *validate(Image *img) {
+  const ImageHeader *h = img->header;
+  if(img->size < sizeof(ImageHeader)) {
+    return "truncated header";
+  }
+  if(h->version != IMAGE_VERSION) {
+    return "unsupported version";
+  }
+
+  const uint8_t zero[sizeof(h->checksum)] = {0};
+  const uint32_t at = offsetof(ImageHeader, checksum);
+  uint32_t hash = image_hash(IMAGE_FNV_BASIS, img->data, at);
+  hash = image_hash(hash, zero, sizeof(zero));
+  hash = image_hash(hash, img->data + at + sizeof(zero),
+		    img->size - at - sizeof(zero));
+  if(hash != h->checksum) {
+    return "checksum mismatch";
+  }
+
+  if(!in_file(img, sizeof(ImageHeader), h->num_segments,
+	      sizeof(ImageSegment))) {
+    return "truncated segment table";
+  }
+  const ImageSegment *seg = (const ImageSegment *)(h + 1);
+  for(uint32_t i = 0; i < h->num_segments; i++) {
+    if(!in_file(img, seg[i].offset, seg[i].len, 1)
+       || seg[i].addr + seg[i].len > 0x10000) {
+      return "segment out of range";
+    }
+  }
+
+  if(h->symbols) {
+    if(!in_file(img, h->symbols, h->num_symbols, sizeof(ImageSymbol))
+       || !in_file(img, h->strings, h->strings_len, 1)
+       || !h->strings_len || img->data[h->strings + h->strings_len - 1]) {
+      return "bad symbol table";
+    }
+    const ImageSymbol *sym = (const ImageSymbol *)(img->data + h->symbols);
+    for(uint32_t i = 0; i < h->num_symbols; i++) {
+      if(sym[i].name >= h->strings_len) {
+	return "bad symbol table";
+      }
+    }
+  }
+  if(h->lines && !in_file(img, h->lines, h->num_lines, sizeof(ImageLine))) {
+    return "bad line map";
+  }
+  if(h->boundaries && !in_file(img, h->boundaries, IMAGE_BOUNDARIES, 1)) {
+    return "bad boundary bitmap";
+  }
+  return NULL;
+}
+
+// Recognizes a container; what is wrong with it, or NULL
+static const char *parse(Image *img) {
+  if(img->size >= 4 && !memcmp(img->data, IMAGE_MAGIC, 4)) {
+    img->header = (const ImageHeader *)img->data;
+    return validate(img);
+  }
+  if(img->size > 0xFFFF) {
+    return "program size too large";
+  }
+  return NULL;
+}
+
+Image *open_image(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0) {
+    printf("Failed to open file: %s\n", filename);
+    exit(1);
+  }
+  struct stat st;
+  if(fstat(fd, &st)) {
+    printf("Failed to open file: %s\n", filename);
+    exit(1);
+  }
+
+  Image *img = calloc(1, sizeof(Image));
+  img->size = st.st_size;
+  if(img->size) {
+    img->data = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(img->data == MAP_FAILED) {
+      printf("Failed to map file: %s\n", filename);
+      exit(1);
+    }
+  }
+  close(fd);
+  img->mapped = true;
+
+  const char *err = parse(img);
+  if(err) {
+    printf("Invalid image %s: %s\n", filename, err);
+    exit(1);
+  }
+  return img;
+}
+
+Image *image_from_buffer(const uint8_t *data, uint32_t size,
+			 const char **err) {
+  Image *img = calloc(1, sizeof(Image));
+  img->data = data;
+  img->size = size;
+  *err = parse(img);
+  if(*err) {
+    free(img);
+    return NULL;
+  }
+  return img;
+}
+
+// Forgets code decoded or translated from what was loaded before
+static void drop_code(RVM *rvm) {
+  icache_flush(rvm);
+  if(rvm->jit) {
+    jit_free(rvm);
+  }
+}
+
+void image_load(Image *img, RVM *rvm) {
+  const ImageHeader *h = img->header;
+  free(rvm->boundaries);
+  rvm->boundaries = NULL;
+  if(!h) {
+    vm_write(rvm, 0, img->data, img->size);
+    drop_code(rvm);
+    return;
+  }
+
+  const ImageSegment *seg = (const ImageSegment *)(h + 1);
+  for(uint32_t i = 0; i < h->num_segments; i++) {
+    vm_write(rvm, seg[i].addr, img->data + seg[i].offset, seg[i].len);
+  }
+  rvm->pc = h->entry;
+  rvm->sp = h->sp;
+
+  if(h->boundaries) {
+    rvm->boundaries = malloc(IMAGE_BOUNDARIES);
+    memcpy(rvm->boundaries, img->data + h->boundaries, IMAGE_BOUNDARIES);
+  }
+  drop_code(rvm);
+}
+
+const char *image_symbol(Image *img, uint16_t addr) {
+  const ImageHeader *h = img->header;
+  if(!h || !h->symbols) {
+    return NULL;
+  }
+  const ImageSymbol *sym = (const ImageSymbol *)(img->data + h->symbols);
+  for(uint32_t i = 0; i < h->num_symbols; i++) {
+    if(sym[i].addr == addr) {
+      return (const char *)img->data + h->strings + sym[i].name;
+    }
+  }
+  return NULL;
+}
+
+uint32_t image_line(Image *img, uint16_t addr) {
+  const ImageHeader *h = img->header;
+  if(!h || !h->lines) {
+    return 0;
+  }
+  const ImageLine *line = (const ImageLine *)(img->data + h->lines);
+  uint32_t lo = 0, hi = h->num_lines;
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(line[mid].addr < addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < h->num_lines && line[lo].addr == addr ? line[lo].line : 0;
+}
+
+void close_image(Image *img) {
+  if(img->mapped && img->size) {
+    munmap((void *)img->data, img->size);
+  }
+  free(img);
+}
@@ -0,0 +1,132 @@
+/* anewkirk */
+
+#pragma once
+
+#include "bool.h"
+#include "reflect.h"
+#include <stdint.h>
+
+/*
+ * The .rvm container format. A file that does not start with
+ * IMAGE_MAGIC is a legacy raw image: its bytes are loaded at $0000
+ * and run from there with sp at $0000.
+ *
+ * A container is laid out as
+ *
+ *   ImageHeader
+ *   ImageSegment[num_segments]
+ *   segment data, symbols, strings, lines and boundaries, at the
+ *   offsets the header and segments give
+ *
+ * All fields are little-endian. checksum is the FNV-1a hash of the
+ * whole file with the checksum field taken as zero, and is checked
+ * before anything is loaded. rpack builds containers from raw images.
+ */
+
+#define IMAGE_MAGIC "\x7FRVM"
+#define IMAGE_VERSION 1
+
+// Size of the instruction-boundary bitmap, one bit per address
+#define IMAGE_BOUNDARIES (0x10000 / 8)
+
+typedef struct _image_header {
+  uint8_t magic[4];
+  uint16_t version;
+  uint16_t flags;
+
+  // Initial pc and sp
+  uint16_t entry;
+  uint16_t sp;
+
+  uint16_t num_segments;
+  uint16_t num_symbols;
+  uint32_t num_lines;
+
+  // File offsets of the optional sections, 0 when absent
+  uint32_t symbols;
+  uint32_t strings;
+  uint32_t strings_len;
+  uint32_t lines;
+  uint32_t boundaries;
+
+  uint32_t checksum;
+} ImageHeader;
+
+// len bytes at offset in the file are loaded at addr
+typedef struct _image_segment {
+  uint16_t addr;
+  uint16_t pad;
+  uint32_t len;
+  uint32_t offset;
+} ImageSegment;
+
+// name is an offset into the string table of a NUL-terminated name
+typedef struct _image_symbol {
+  uint16_t addr;
+  uint16_t pad;
+  uint32_t name;
+} ImageSymbol;
+
+// The source line the instruction at addr came from, sorted by addr
+typedef struct _image_line {
+  uint16_t addr;
+  uint16_t pad;
+  uint32_t line;
+} ImageLine;
+
+/*
+ * An image in memory, usually a mapping of its file. For a legacy
+ * image header is NULL and data holds the program.
+ */
+typedef struct _image {
+  const uint8_t *data;
+  uint32_t size;
+  const ImageHeader *header;
+
+  // data is a mapping of the file, owned by the Image
+  bool mapped;
+} Image;
+
+/*
+ * Maps the file at filename and validates it. Exits with a message
+ * if it cannot be read or is not a well-formed image.
+ */
+Image *open_image(const char *filename);
+
+/*
+ * Like open_image(), for an image of size bytes at data, which must
+ * outlive the Image. Returns NULL and points err at the reason if it
+ * is not well-formed.
+ */
+Image *image_from_buffer(const uint8_t *data, uint32_t size,
+			 const char **err);
+
+/*
+ * Copies the segments of img into the memory of rvm and sets its
+ * pc and sp, and drops code decoded or translated before. The
+ * boundary bitmap, if any, is kept in rvm->boundaries for
+ * icache_prepare().
+ */
+void image_load(Image *img, RVM *rvm);
+
+/*
+ * The name of the symbol at addr, or NULL.
+ */
+const char *image_symbol(Image *img, uint16_t addr);
+
+/*
+ * The source line of the instruction at addr, or 0.
+ */
+uint32_t image_line(Image *img, uint16_t addr);
+
+/*
+ * FNV-1a of n bytes, continuing from hash (start with
+ * IMAGE_FNV_BASIS).
+ */
+#define IMAGE_FNV_BASIS 0x811C9DC5u
+uint32_t image_hash(uint32_t hash, const uint8_t *p, uint32_t n);
+
+/*
+ * Unmaps (or just frees) img. Memory loaded from it is unaffected.
+ */
+void close_image(Image *img);
@@ -0,0 +1,405 @@
+/*
+ * anewkirk
+ *
+ * Console I/O for sys calls. Output is collected in a per-VM
+ * buffer and handed to write(2) in large chunks instead of going
+ * through stdio one character at a time, and input is read ahead
+ * (or mapped) the same way.
+ */
+
+#include "bool.h"
+#include "io.h"
+#include "mem.h"
+#include "reflect.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void output_init(Output *o) {
+  o->fd = STDOUT_FILENO;
+  o->capture = NULL;
+  o->mode = isatty(STDOUT_FILENO) ? OUT_LINE : OUT_FULL;
+  o->used = 0;
+}
+
+Output *new_output() {
+  Output *o = malloc(sizeof(Output));
+  o->buf = NULL;
+  o->size = 0;
+  output_init(o);
+  return o;
+}
+
+void free_output(Output *o) {
+  free(o->buf);
+  free(o);
+}
+
+void out_grow(RVM *rvm) {
+  Output *o = rvm->out;
+  if(o->size == OUT_SIZE) {
+    out_flush(rvm);
+    return;
+  }
+  o->size = o->size ? o->size * 4 : OUT_MIN;
+  if(o->size > OUT_SIZE) {
+    o->size = OUT_SIZE;
+  }
+  o->buf = realloc(o->buf, o->size);
+}
+
+void out_flush(RVM *rvm) {
+  Output *o = rvm->out;
+  if(!o->used) {
+    return;
+  }
+  if(o->capture) {
+    fwrite(o->buf, 1, o->used, o->capture);
+    o->used = 0;
+    return;
+  }
+
+  // Keep the order of anything printed through stdio in the meantime
+  if(o->fd == STDOUT_FILENO) {
+    fflush(stdout);
+  }
+
+  uint32_t done = 0;
+  while(done < o->used) {
+    ssize_t n = write(o->fd, o->buf + done, o->used - done);
+    if(n < 0) {
+      if(errno == EINTR) {
+	continue;
+      }
+      break;
+    }
+    done += n;
+  }
+  o->used = 0;
+}
+
+void out_write(RVM *rvm, const uint8_t *bytes, uint32_t n) {
+  Output *o = rvm->out;
+  bool newline = o->mode == OUT_LINE && memchr(bytes, '\n', n);
+  while(n) {
+    if(o->used == o->size) {
+      out_grow(rvm);
+    }
+    uint32_t chunk = o->size - o->used;
+    if(chunk > n) {
+      chunk = n;
+    }
+    memcpy(o->buf + o->used, bytes, chunk);
+    o->used += chunk;
+    bytes += chunk;
+    n -= chunk;
+  }
+
+  if(newline) {
+    out_flush(rvm);
+  }
+}
+
+void out_int(RVM *rvm, uint8_t i) {
+  uint8_t digits[3];
+  uint8_t n = 0;
+  if(i >= 100) {
+    digits[n++] = '0' + i / 100;
+  }
+  if(i >= 10) {
+    digits[n++] = '0' + i / 10 % 10;
+  }
+  digits[n++] = '0' + i % 10;
+  out_write(rvm, digits, n);
+}
+
+static void input_init(Input *in) {
+  in->fd = STDIN_FILENO;
+  in->data = NULL;
+  in->pos = 0;
+  in->len = 0;
+  in->map = NULL;
+  in->map_len = 0;
+  in->started = false;
+  in->shared = false;
+  in->nonblock = false;
+  in->eof = false;
+  in->preset = false;
+}
+
+Input *new_input() {
+  Input *in = malloc(sizeof(Input));
+  in->buf = NULL;
+  input_init(in);
+  return in;
+}
+
+void free_input(Input *in) {
+  if(in->map) {
+    munmap(in->map, in->map_len);
+  }
+  free(in->buf);
+  free(in);
+}
+
+void io_reset(RVM *rvm) {
+  out_flush(rvm);
+  output_init(rvm->out);
+  if(rvm->in->map) {
+    munmap(rvm->in->map, rvm->in->map_len);
+  }
+  input_init(rvm->in);
+}
+
+// Maps the rest of the input if it is a non-empty regular file
+static bool map_input(Input *in) {
+  struct stat st;
+  if(fstat(in->fd, &st) || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  off_t off = lseek(in->fd, 0, SEEK_CUR);
+  if(off < 0 || off >= st.st_size) {
+    return false;
+  }
+
+  in->map_len = st.st_size;
+  in->map = mmap(NULL, in->map_len, PROT_READ, MAP_PRIVATE, in->fd, 0);
+  if(in->map == MAP_FAILED) {
+    in->map = NULL;
+    return false;
+  }
+  in->data = in->map;
+  in->pos = off;
+  in->len = in->map_len;
+  return true;
+}
+
+void in_set_data(Input *in, const uint8_t *data, size_t len) {
+  in->data = data;
+  in->pos = 0;
+  in->len = len;
+  in->started = true;
+  in->preset = true;
+}
+
+static void in_start(Input *in) {
+  in->started = true;
+  if(!in->shared) {
+    map_input(in);
+  }
+}
+
+bool in_fill(RVM *rvm) {
+  Input *in = rvm->in;
+  if(!in->started) {
+    in_start(in);
+    if(in->map) {
+      return in->pos < in->len;
+    }
+  }
+  if(in->map || in->preset) {
+    return false;
+  }
+
+  // Whatever the program printed may be a prompt for this input
+  out_flush(rvm);
+  if(!in->buf) {
+    in->buf = malloc(IN_SIZE);
+  }
+  in->data = in->buf;
+  in->pos = 0;
+  in->len = 0;
+
+  if(in->shared) {
+    int c = fgetc(stdin);
+    if(c == EOF) {
+      in->eof = true;
+      return false;
+    }
+    in->buf[0] = c;
+    in->len = 1;
+    return true;
+  }
+
+  for(;;) {
+    ssize_t n = read(in->fd, in->buf, IN_SIZE);
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+    if(n <= 0) {
+      in->eof = true;
+      return false;
+    }
+    in->len = n;
+    return true;
+  }
+}
+
+/*
+ * Appends whatever can be read from fd right now to the read-ahead
+ * buffer. Returns false if nothing was added.
+ */
+static bool in_top_up(Input *in) {
+  if(!in->buf) {
+    in->buf = malloc(IN_SIZE);
+  }
+  if(in->data != in->buf) {
+    in->data = in->buf;
+    in->pos = 0;
+    in->len = 0;
+  }
+  if(in->pos) {
+    memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+    in->len -= in->pos;
+    in->pos = 0;
+  }
+  if(in->len == IN_SIZE) {
+    return false;
+  }
+
+  struct pollfd p = { in->fd, POLLIN, 0 };
+  if(poll(&p, 1, 0) <= 0) {
+    return false;
+  }
+  ssize_t n = read(in->fd, in->buf + in->len, IN_SIZE - in->len);
+  if(n == 0) {
+    in->eof = true;
+  }
+  if(n <= 0) {
+    return false;
+  }
+  in->len += n;
+  return true;
+}
+
+// Whether the buffered input is enough for the sys call to finish
+static bool in_complete(Input *in, uint8_t syscall, uint8_t n) {
+  const uint8_t *d = in->data + in->pos;
+  size_t avail = in->len - in->pos;
+  if(avail == IN_SIZE) {
+    return true;
+  }
+
+  switch(syscall) {
+  case 0x01:
+  case 0x03:
+    return avail > 0;
+  case 0x05:
+  case 0x07: {
+    // A number is only complete once something follows it
+    size_t k = 0;
+    while(k < avail && (d[k] == ' ' || (d[k] >= '\t' && d[k] <= '\r'))) {
+      k++;
+    }
+    if(k < avail && (d[k] == '-' || d[k] == '+')) {
+      k++;
+    }
+    while(k < avail && d[k] >= '0' && d[k] <= '9') {
+      k++;
+    }
+    return k < avail;
+  }
+  case 0x09:
+    return avail >= n || memchr(d, '\n', avail);
+  case 0x0A:
+    return avail >= n;
+  }
+  return true;
+}
+
+bool in_poll_ready(RVM *rvm, uint8_t syscall, uint8_t n) {
+  Input *in = rvm->in;
+  // Host handlers never wait on this input
+  if(rvm->sys && rvm->sys[syscall]) {
+    return true;
+  }
+  if(!in->started) {
+    in_start(in);
+  }
+  if(in->map || in->shared || in->preset) {
+    return true;
+  }
+  while(!in_complete(in, syscall, n)) {
+    if(in->eof) {
+      return true;
+    }
+    if(!in_top_up(in)) {
+      return in->eof;
+    }
+  }
+  return true;
+}
+
+void in_wait(RVM *rvm) {
+  struct pollfd p = { rvm->in->fd, POLLIN, 0 };
+  out_flush(rvm);
+  while(poll(&p, 1, -1) < 0 && errno == EINTR) {
+  }
+}
+
+// Returns the next byte of input without consuming it, or EOF
+static int in_peek(RVM *rvm) {
+  Input *in = rvm->in;
+  if(in->pos == in->len && !in_fill(rvm)) {
+    return EOF;
+  }
+  return in->data[in->pos];
+}
+
+int in_int(RVM *rvm) {
+  int c = in_peek(rvm);
+  while(c == ' ' || (c >= '\t' && c <= '\r')) {
+    rvm->in->pos++;
+    c = in_peek(rvm);
+  }
+
+  bool negative = false;
+  if(c == '-' || c == '+') {
+    negative = c == '-';
+    rvm->in->pos++;
+    c = in_peek(rvm);
+  }
+
+  uint32_t i = 0;
+  while(c >= '0' && c <= '9') {
+    i = i * 10 + (c - '0');
+    rvm->in->pos++;
+    c = in_peek(rvm);
+  }
+  return negative ? -i : i;
+}
+
+uint8_t in_read(RVM *rvm, uint16_t addr, uint8_t n, bool line) {
+  Input *in = rvm->in;
+  uint8_t count = 0;
+  while(count < n) {
+    if(in->pos == in->len && !in_fill(rvm)) {
+      break;
+    }
+
+    // Copy straight out of the read-ahead buffer
+    size_t avail = in->len - in->pos;
+    size_t chunk = n - count < avail ? n - count : avail;
+    const uint8_t *src = in->data + in->pos;
+    if(line) {
+      const uint8_t *nl = memchr(src, '\n', chunk);
+      if(nl) {
+	chunk = nl - src + 1;
+      }
+    }
+    vm_write(rvm, addr, src, chunk);
+    addr += chunk;
+    in->pos += chunk;
+    count += chunk;
+    if(line && src[chunk - 1] == '\n') {
+      break;
+    }
+  }
+  return count;
+}
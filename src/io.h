@@ -0,0 +1,199 @@
+/* anewkirk */
+
+#pragma once
+
+#include "bool.h"
+#include "reflect.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Output buffers start at OUT_MIN bytes and grow to OUT_SIZE
+#define OUT_MIN 0x100
+#define OUT_SIZE 0x10000
+#define IN_SIZE 0x10000
+
+// When console output written by sys calls reaches stdout
+typedef enum {
+  // When the buffer fills, before stdin is read and on hlt
+  OUT_FULL,
+  // As OUT_FULL, and after every newline
+  OUT_LINE,
+  // After every sys call
+  OUT_NONE
+} OutMode;
+
+// Console output of an RVM, written to stdout in large chunks
+typedef struct _output {
+  // Descriptor output is written to, stdout by default
+  int fd;
+
+  // When set, output is appended here instead of going to fd
+  FILE *capture;
+
+  OutMode mode;
+
+  // The buffer, allocated by the first write, and its fill level
+  uint8_t *buf;
+  uint32_t size;
+  uint32_t used;
+} Output;
+
+/*
+ * Console input of an RVM. The input file is mapped whole when it
+ * is a regular file and read ahead in large chunks otherwise.
+ */
+typedef struct _input {
+  // Descriptor input is read from, stdin by default
+  int fd;
+
+  // Unconsumed input is data[pos] up to data[len]
+  const uint8_t *data;
+  size_t pos;
+  size_t len;
+
+  // Mapping of a regular file on stdin, if any
+  uint8_t *map;
+  size_t map_len;
+
+  // fd has been looked at (mapped or not)
+  bool started;
+
+  // stdin is also read through stdio (rdbg), so never read ahead
+  bool shared;
+
+  // run_for() returns RUN_BLOCKED instead of waiting for input
+  bool nonblock;
+
+  // A read of fd returned end of file
+  bool eof;
+
+  // Input was handed over with in_set_data(); fd is never read
+  bool preset;
+
+  // Read-ahead buffer of IN_SIZE bytes, allocated by the first read
+  uint8_t *buf;
+} Input;
+
+/*
+ * Allocates an output buffer, line buffered if stdout is a
+ * terminal and fully buffered otherwise.
+ */
+Output *new_output();
+
+/*
+ * Frees an output buffer, without flushing it.
+ */
+void free_output(Output *o);
+
+/*
+ * Writes everything buffered for rvm to its descriptor, after
+ * anything stdio still holds for stdout.
+ */
+void out_flush(RVM *rvm);
+
+/*
+ * Buffers n bytes of output.
+ */
+void out_write(RVM *rvm, const uint8_t *bytes, uint32_t n);
+
+/*
+ * Buffers the decimal digits of i.
+ */
+void out_int(RVM *rvm, uint8_t i);
+
+/*
+ * Makes room in a full output buffer, by growing it while it is
+ * smaller than OUT_SIZE and by flushing it after that.
+ */
+void out_grow(RVM *rvm);
+
+/*
+ * Buffers a single character.
+ */
+static inline void out_putc(RVM *rvm, uint8_t c) {
+  Output *o = rvm->out;
+  if(o->used == o->size) {
+    out_grow(rvm);
+  }
+  o->buf[o->used++] = c;
+  if(c == '\n' && o->mode == OUT_LINE) {
+    out_flush(rvm);
+  }
+}
+
+/*
+ * Called at the end of every sys call that prints.
+ */
+static inline void out_done(RVM *rvm) {
+  if(rvm->out->mode == OUT_NONE) {
+    out_flush(rvm);
+  }
+}
+
+/*
+ * Allocates an input reader for stdin.
+ */
+Input *new_input();
+
+/*
+ * Releases an input reader and any mapping it holds.
+ */
+void free_input(Input *in);
+
+/*
+ * Flushes the output of rvm, then returns its output and input to
+ * stdout and stdin as new_output() and new_input() set them up.
+ */
+void io_reset(RVM *rvm);
+
+/*
+ * Makes data, which must outlive in, the whole of the input.
+ */
+void in_set_data(Input *in, const uint8_t *data, size_t len);
+
+/*
+ * Refills the input of rvm, flushing its output first if that
+ * may block. Returns false at end of input.
+ */
+bool in_fill(RVM *rvm);
+
+bool in_poll_ready(RVM *rvm, uint8_t syscall, uint8_t n);
+
+/*
+ * Whether the input sys call numbered syscall can complete without
+ * waiting for input; n is the byte count argument of $09 and $0A.
+ * Always true unless the input is nonblocking.
+ */
+static inline bool in_ready(RVM *rvm, uint8_t syscall, uint8_t n) {
+  return !rvm->in->nonblock || in_poll_ready(rvm, syscall, n);
+}
+
+/*
+ * Waits until more input arrives or the input ends.
+ */
+void in_wait(RVM *rvm);
+
+/*
+ * Reads one byte of input, or EOF.
+ */
+static inline int in_getc(RVM *rvm) {
+  Input *in = rvm->in;
+  if(in->pos == in->len && !in_fill(rvm)) {
+    return EOF;
+  }
+  return in->data[in->pos++];
+}
+
+/*
+ * Reads a decimal integer the way scanf("%d") does, returning
+ * 0 if the input does not start with one.
+ */
+int in_int(RVM *rvm);
+
+/*
+ * Copies up to n bytes of input to memory at addr, wrapping at
+ * $FFFF. With line set it stops after the first newline.
+ * Returns the number of bytes copied.
+ */
+uint8_t in_read(RVM *rvm, uint16_t addr, uint8_t n, bool line);
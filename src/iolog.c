@@ -0,0 +1,163 @@
+/*
+ * anewkirk
+ *
+ * Record and replay of console input; see iolog.h.
+ */
+
+#include "iolog.h"
+#include "bool.h"
+#include "io.h"
+#include "mem.h"
+#include "reflect.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+IoLog *open_iolog(const char *filename, bool replay) {
+  IoLog *log = calloc(1, sizeof(IoLog));
+  log->replay = replay;
+  uint16_t version = IOLOG_VERSION;
+
+  if(!replay) {
+    log->f = fopen(filename, "wb");
+    if(!log->f) {
+      printf("Failed to open file: %s\n", filename);
+      exit(1);
+    }
+    fwrite(IOLOG_MAGIC, 1, 4, log->f);
+    fwrite(&version, 2, 1, log->f);
+    return log;
+  }
+
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st)) {
+    printf("Failed to open file: %s\n", filename);
+    exit(1);
+  }
+  log->len = st.st_size;
+  if(log->len < 6) {
+    printf("Not an input log: %s\n", filename);
+    exit(1);
+  }
+  log->data = mmap(NULL, log->len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(log->data == MAP_FAILED) {
+    printf("Failed to map file: %s\n", filename);
+    exit(1);
+  }
+  close(fd);
+  if(memcmp(log->data, IOLOG_MAGIC, 4) || memcmp(log->data + 4, &version, 2)) {
+    printf("Not an input log: %s\n", filename);
+    exit(1);
+  }
+  log->pos = 6;
+  return log;
+}
+
+void close_iolog(IoLog *log) {
+  if(log->replay) {
+    munmap((void *)log->data, log->len);
+  } else {
+    fclose(log->f);
+  }
+  free(log);
+}
+
+static void diverged(RVM *rvm, const char *why) {
+  out_flush(rvm);
+  printf("Replay diverged at instruction %" PRIu64 ": %s\n", rvm->icount,
+	 why);
+  exit(1);
+}
+
+// Writes the start of the entry for the call being made
+static void begin(IoLog *log, RVM *rvm, uint8_t syscall) {
+  uint64_t delta = rvm->icount - log->last;
+  log->last = rvm->icount;
+  while(delta >= 0x80) {
+    fputc(delta | 0x80, log->f);
+    delta >>= 7;
+  }
+  fputc(delta, log->f);
+  fputc(syscall, log->f);
+}
+
+// The next logged byte, or divergence if the log ends
+static uint8_t next(IoLog *log, RVM *rvm) {
+  if(log->pos == log->len) {
+    diverged(rvm, "the log has ended");
+  }
+  return log->data[log->pos++];
+}
+
+// Reads the start of the next entry and checks it is for this call
+static void expect(IoLog *log, RVM *rvm, uint8_t syscall) {
+  uint64_t delta = 0;
+  uint8_t b;
+  uint32_t shift = 0;
+  do {
+    b = next(log, rvm);
+    delta |= (uint64_t)(b & 0x7F) << shift;
+    shift += 7;
+  } while(b & 0x80 && shift < 64);
+
+  if(log->last + delta != rvm->icount) {
+    diverged(rvm, "input was logged at a different instruction");
+  }
+  if(next(log, rvm) != syscall) {
+    diverged(rvm, "input was logged for a different sys call");
+  }
+  log->last = rvm->icount;
+}
+
+uint8_t iolog_getc(RVM *rvm, uint8_t syscall) {
+  IoLog *log = rvm->iolog;
+  if(log->replay) {
+    expect(log, rvm, syscall);
+    return next(log, rvm);
+  }
+  uint8_t c = in_getc(rvm);
+  begin(log, rvm, syscall);
+  fputc(c, log->f);
+  return c;
+}
+
+uint8_t iolog_int(RVM *rvm, uint8_t syscall) {
+  IoLog *log = rvm->iolog;
+  if(log->replay) {
+    expect(log, rvm, syscall);
+    return next(log, rvm);
+  }
+  uint8_t i = in_int(rvm);
+  begin(log, rvm, syscall);
+  fputc(i, log->f);
+  return i;
+}
+
+uint8_t iolog_read(RVM *rvm, uint8_t syscall, uint16_t addr, uint8_t n,
+		   bool line) {
+  IoLog *log = rvm->iolog;
+  if(log->replay) {
+    expect(log, rvm, syscall);
+    uint8_t count = next(log, rvm);
+    if(count > n || log->len - log->pos < count) {
+      diverged(rvm, "the log does not match the read");
+    }
+    vm_write(rvm, addr, log->data + log->pos, count);
+    log->pos += count;
+    return count;
+  }
+  uint8_t count = in_read(rvm, addr, n, line);
+  begin(log, rvm, syscall);
+  fputc(count, log->f);
+  uint8_t bytes[0x100];
+  vm_read(rvm, addr, bytes, count);
+  fwrite(bytes, 1, count, log->f);
+  return count;
+}
@@ -0,0 +1,67 @@
+/* anewkirk */
+
+#pragma once
+
+#include "bool.h"
+#include "reflect.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Record and replay of console input. Input read by sys calls $01,
+ * $03, $05, $07, $09 and $0A is all that makes a run differ from the
+ * next, so a log of it lets any engine repeat a run exactly, without
+ * stdin.
+ *
+ * A log is IOLOG_MAGIC and a uint16_t IOLOG_VERSION followed by one
+ * entry per input sys call:
+ *
+ *   varint    instructions retired since the previous entry's call
+ *   uint8_t   the sys call number
+ *   uint8_t   the byte it stored; for $09 and $0A the count of
+ *             bytes read, then the bytes
+ *
+ * A varint is 7 bits a byte, low bits first, with the top bit set
+ * on all but the last byte.
+ */
+
+#define IOLOG_MAGIC "\x7FRIO"
+#define IOLOG_VERSION 1
+
+typedef struct _iolog {
+  bool replay;
+
+  // Recording: the log being written
+  FILE *f;
+
+  // Replaying: the log, and the next entry in it
+  const uint8_t *data;
+  size_t len;
+  size_t pos;
+
+  // Instruction count of the last entry's call
+  uint64_t last;
+} IoLog;
+
+/*
+ * Creates filename to record into, or opens it to replay. Exits with
+ * a message if that fails or it is not a log.
+ */
+IoLog *open_iolog(const char *filename, bool replay);
+
+/*
+ * Writes out a recorded log, and closes either kind.
+ */
+void close_iolog(IoLog *log);
+
+/*
+ * The input sys calls of sys_call(), for a VM with a log: each reads
+ * its input as in_getc(), in_int() or in_read() would and records
+ * it, or takes it from the log being replayed. Replay exits with a
+ * message when the program asks for input other than that logged.
+ */
+uint8_t iolog_getc(RVM *rvm, uint8_t syscall);
+uint8_t iolog_int(RVM *rvm, uint8_t syscall);
+uint8_t iolog_read(RVM *rvm, uint8_t syscall, uint16_t addr, uint8_t n,
+		   bool line);
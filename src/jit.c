@@ -0,0 +1,819 @@
+/*
+ * anewkirk
+ *
+ * An x86-64 basic-block JIT for ReflectVM. The dispatcher interprets
+ * cold code with the switch engine and translates a block once its
+ * start address has been visited often enough. Blocks end at jumps,
+ * call/ret, sys and hlt; sys and hlt themselves are always left to the
+ * interpreter. Exits to known targets are patched into direct jumps so
+ * hot loops chain from block to block without coming back to C.
+ *
+ * While native code runs the VM state lives in callee-saved registers:
+ *
+ *   rbx  rvm->reg          r12  VM memory
+ *   rbp  rvm               r13  covered map (translated guest bytes)
+ *   r14w sp                r15b zero flag
+ *
+ * The carry and negative flags, which only the register-pair
+ * instructions use, stay in the RVM struct.
+ *
+ * Stores check the covered map and leave the block when they hit
+ * translated code; the dispatcher then drops every block, so guest
+ * code is never run from a stale translation.
+ */
+
+#include "bool.h"
+#include "icache.h"
+#include "io.h"
+#include "jit.h"
+#include "reflect.h"
+#include "threaded.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_JIT
+
+#include <sys/mman.h>
+
+#define JIT_BUF_SIZE (4 << 20)
+
+// Visits before a block is translated
+#define JIT_THRESHOLD 8
+
+// Guest instructions per block at most
+#define MAX_BLOCK_INSNS 64
+
+// Room reserved per block so translation never runs off the buffer
+#define MAX_BLOCK_CODE (MAX_BLOCK_INSNS * 128 + 64)
+
+typedef uint16_t (*EnterFn)(RVM *rvm, void *block, uint8_t *mem,
+			    uint8_t *covered);
+
+static uint8_t *cursor(Jit *j) {
+  return j->buf + j->used;
+}
+
+static void emit(Jit *j, int n, ...) {
+  va_list ap;
+  va_start(ap, n);
+  for(int i = 0; i < n; i++) {
+    j->buf[j->used++] = (uint8_t)va_arg(ap, int);
+  }
+  va_end(ap);
+}
+
+static void emit32(Jit *j, uint32_t v) {
+  memcpy(cursor(j), &v, 4);
+  j->used += 4;
+}
+
+static void emit64(Jit *j, uint64_t v) {
+  memcpy(cursor(j), &v, 8);
+  j->used += 8;
+}
+
+// rel32 operand that makes the instruction ending after it reach target
+static void emit_rel32(Jit *j, uint8_t *target) {
+  emit32(j, (uint32_t)(target - (cursor(j) + 4)));
+}
+
+/*
+ * Instruction helpers. Guest registers are bytes at [rbx + r], so
+ * every register operand is a disp8.
+ */
+
+// mov al, [rbx + r]
+static void ld_al(Jit *j, uint8_t r) { emit(j, 3, 0x8A, 0x43, r); }
+
+// mov cl, [rbx + r]
+static void ld_cl(Jit *j, uint8_t r) { emit(j, 3, 0x8A, 0x4B, r); }
+
+// mov [rbx + r], al
+static void st_al(Jit *j, uint8_t r) { emit(j, 3, 0x88, 0x43, r); }
+
+// mov [rbx + r], cl
+static void st_cl(Jit *j, uint8_t r) { emit(j, 3, 0x88, 0x4B, r); }
+
+// movzx eax, byte [rbx + r]
+static void ldz_eax(Jit *j, uint8_t r) { emit(j, 4, 0x0F, 0xB6, 0x43, r); }
+
+// sete r15b
+static void set_z(Jit *j) { emit(j, 4, 0x41, 0x0F, 0x94, 0xC7); }
+
+// setc / sets byte [rbp + c_flag / n_flag]
+static void set_c(Jit *j) {
+  emit(j, 3, 0x0F, 0x92, 0x85); emit32(j, offsetof(RVM, c_flag));
+}
+static void set_n(Jit *j) {
+  emit(j, 3, 0x0F, 0x98, 0x85); emit32(j, offsetof(RVM, n_flag));
+}
+
+// mov [rbx + rs], al ; mov [rbx + rd], ah
+static void st_pair(Jit *j, uint8_t rd, uint8_t rs) {
+  st_al(j, rs);
+  emit(j, 3, 0x88, 0x63, rd);
+}
+
+// mov eax, imm32
+static void mov_eax(Jit *j, uint32_t v) { emit(j, 1, 0xB8); emit32(j, v); }
+
+// eax = rx:ry
+static void pair_eax(Jit *j, uint8_t x, uint8_t y) {
+  ldz_eax(j, x);
+  emit(j, 3, 0xC1, 0xE0, 0x08);
+  ld_al(j, y);
+}
+
+// esi = rx:ry
+static void pair_esi(Jit *j, uint8_t x, uint8_t y) {
+  emit(j, 4, 0x0F, 0xB6, 0x73, x);
+  emit(j, 3, 0xC1, 0xE6, 0x08);
+  emit(j, 4, 0x40, 0x8A, 0x73, y);
+}
+
+// movzx eax, r14w
+static void sp_eax(Jit *j) { emit(j, 4, 0x41, 0x0F, 0xB7, 0xC6); }
+
+// dec r14w / inc r14w
+static void sp_dec(Jit *j) { emit(j, 4, 0x66, 0x41, 0xFF, 0xCE); }
+static void sp_inc(Jit *j) { emit(j, 4, 0x66, 0x41, 0xFF, 0xC6); }
+
+/*
+ * Store cl to guest address rax and mark its page dirty:
+ *   mov [r12 + rax], cl ; movzx edi, ah ; mov byte [rbp + rdi + dirty], 1
+ */
+static void store_cl(Jit *j) {
+  emit(j, 4, 0x41, 0x88, 0x0C, 0x04);
+  emit(j, 3, 0x0F, 0xB6, 0xFC);
+  emit(j, 3, 0xC6, 0x84, 0x3D);
+  emit32(j, offsetof(RVM, dirty));
+  emit(j, 1, 0x01);
+}
+
+// movzx ecx, byte [r12 + rax]
+static void load_ecx(Jit *j) { emit(j, 5, 0x41, 0x0F, 0xB6, 0x0C, 0x04); }
+
+// Short forward jcc/jmp whose rel8 is filled in by land()
+static uint8_t *jump8(Jit *j, uint8_t opcode) {
+  emit(j, 2, opcode, 0x00);
+  return cursor(j) - 1;
+}
+
+static void land(Jit *j, uint8_t *rel8) {
+  *rel8 = (uint8_t)(cursor(j) - (rel8 + 1));
+}
+
+/*
+ * Account for the guest instructions run since the block was entered:
+ *   add qword [rbp + icount], n
+ */
+static void count_insns(Jit *j) {
+  emit(j, 3, 0x48, 0x83, 0x85);
+  emit32(j, offsetof(RVM, icount));
+  emit(j, 1, j->count);
+}
+
+/*
+ * Leave the block for guest address pc through a site the dispatcher
+ * can later patch into a direct jump to the target block:
+ *   mov eax, pc ; call exit_chain
+ */
+static void exit_chained(Jit *j, uint16_t pc) {
+  count_insns(j);
+  mov_eax(j, pc);
+  emit(j, 1, 0xE8);
+  emit_rel32(j, j->exit_chain);
+}
+
+/*
+ * Leave the block for the guest address in eax. Outside lockstep mode
+ * the target block is looked up inline and jumped to directly.
+ */
+static void exit_indirect(Jit *j) {
+  count_insns(j);
+  if(!j->lockstep) {
+    // mov rdx, [rip + blocks] ; mov rdx, [rdx + rax*8] ; test rdx, rdx
+    emit(j, 3, 0x48, 0x8B, 0x15);
+    emit_rel32(j, j->buf);
+    emit(j, 4, 0x48, 0x8B, 0x14, 0xC2);
+    emit(j, 3, 0x48, 0x85, 0xD2);
+    // jz exit_plain ; jmp rdx
+    emit(j, 2, 0x0F, 0x84);
+    emit_rel32(j, j->exit_plain);
+    emit(j, 2, 0xFF, 0xE2);
+  } else {
+    emit(j, 1, 0xE9);
+    emit_rel32(j, j->exit_plain);
+  }
+}
+
+// Leave the block through exit_smc for the guest address in eax
+static void exit_smc(Jit *j) {
+  count_insns(j);
+  emit(j, 1, 0xE9);
+  emit_rel32(j, j->exit_smc);
+}
+
+/*
+ * After a store to [r12 + rax]: if it hit translated code, leave
+ * through exit_smc with next as the guest pc to resume at.
+ */
+static void smc_guard(Jit *j, uint16_t next) {
+  // cmp byte [r13 + rax], 0 ; je over
+  emit(j, 6, 0x41, 0x80, 0x7C, 0x05, 0x00, 0x00);
+  uint8_t *over = jump8(j, 0x74);
+  mov_eax(j, next);
+  exit_smc(j);
+  land(j, over);
+}
+
+/*
+ * Push the 16-bit return address the way call does, high byte
+ * first, and leave the smc verdict for both bytes in dl.
+ */
+static void push_ret(Jit *j, uint16_t ret) {
+  emit(j, 2, 0x31, 0xD2);
+  sp_eax(j);
+  emit(j, 2, 0xB1, ret >> 8);
+  store_cl(j);
+  emit(j, 5, 0x41, 0x0A, 0x54, 0x05, 0x00);
+  sp_dec(j);
+  sp_eax(j);
+  emit(j, 2, 0xB1, ret & 0xFF);
+  store_cl(j);
+  emit(j, 5, 0x41, 0x0A, 0x54, 0x05, 0x00);
+  sp_dec(j);
+}
+
+static void emit_stubs(Jit *j) {
+  size_t off_reg = offsetof(RVM, reg);
+  size_t off_pc = offsetof(RVM, pc);
+  size_t off_sp = offsetof(RVM, sp);
+  size_t off_z = offsetof(RVM, z_flag);
+
+  // The block table, for block code to reach without absolute
+  // addresses
+  emit64(j, (uint64_t)(uintptr_t)j->blocks);
+
+  // enter(rvm, block, mem, covered)
+  j->enter = cursor(j);
+  emit(j, 8, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56);
+  emit(j, 2, 0x41, 0x57);
+  emit(j, 4, 0x48, 0x83, 0xEC, 0x08);
+  emit(j, 3, 0x48, 0x89, 0xFD);
+  emit(j, 3, 0x48, 0x8D, 0x9F); emit32(j, off_reg);
+  emit(j, 3, 0x49, 0x89, 0xD4);
+  emit(j, 3, 0x49, 0x89, 0xCD);
+  emit(j, 4, 0x44, 0x0F, 0xB7, 0xB7); emit32(j, off_sp);
+  emit(j, 4, 0x44, 0x0F, 0xB6, 0xBF); emit32(j, off_z);
+  emit(j, 2, 0xFF, 0xE6);
+
+  // Common exit: write pc, sp and z back and return pc
+  uint8_t *leave = cursor(j);
+  emit(j, 3, 0x66, 0x89, 0x85); emit32(j, off_pc);
+  emit(j, 4, 0x66, 0x44, 0x89, 0xB5); emit32(j, off_sp);
+  emit(j, 3, 0x44, 0x88, 0xBD); emit32(j, off_z);
+  emit(j, 4, 0x48, 0x83, 0xC4, 0x08);
+  emit(j, 8, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C);
+  emit(j, 3, 0x5D, 0x5B, 0xC3);
+
+  // exit_chain: remember the call site so it can be patched
+  j->exit_chain = cursor(j);
+  emit(j, 1, 0x5A);
+  emit(j, 2, 0x48, 0xB9); emit64(j, (uint64_t)(uintptr_t)&j->last_site);
+  emit(j, 3, 0x48, 0x89, 0x11);
+  emit(j, 1, 0xE9); emit_rel32(j, leave);
+
+  // exit_smc: flag the flush, then leave like exit_plain
+  j->exit_smc = cursor(j);
+  emit(j, 2, 0x48, 0xB9); emit64(j, (uint64_t)(uintptr_t)&j->flush_pending);
+  emit(j, 3, 0xC6, 0x01, 0x01);
+
+  // exit_plain: nothing to patch
+  j->exit_plain = cursor(j);
+  emit(j, 2, 0x48, 0xB9); emit64(j, (uint64_t)(uintptr_t)&j->last_site);
+  emit(j, 3, 0x48, 0xC7, 0x01); emit32(j, 0);
+  emit(j, 1, 0xE9); emit_rel32(j, leave);
+
+  j->stubs_end = j->used;
+}
+
+static void jit_flush(Jit *j) {
+  j->used = j->stubs_end;
+  j->last_site = NULL;
+  j->flush_pending = false;
+  memset(j->blocks, 0, 0x10000 * sizeof(void *));
+  memset(j->covered, 0, 0x10000);
+}
+
+Jit *jit_init(RVM *rvm, bool lockstep) {
+  if(rvm->jit) {
+    return rvm->jit;
+  }
+  Jit *j = calloc(1, sizeof(Jit));
+  j->size = JIT_BUF_SIZE;
+  j->buf = mmap(NULL, j->size, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(j->buf == MAP_FAILED) {
+    printf("Failed to map JIT code buffer\n");
+    exit(1);
+  }
+  j->blocks = calloc(0x10000, sizeof(void *));
+  j->covered = calloc(0x10000, 1);
+  j->hits = calloc(0x10000, 1);
+  j->lockstep = lockstep;
+  j->threshold = lockstep ? 1 : JIT_THRESHOLD;
+  emit_stubs(j);
+
+  // Stores made by the interpreter report code writes through the code map
+  if(!rvm->code_map) {
+    rvm->code_map = calloc(0x10000 / 8, 1);
+  }
+  rvm->jit = j;
+  return j;
+}
+
+void jit_free(RVM *rvm) {
+  Jit *j = rvm->jit;
+  if(!j) {
+    return;
+  }
+  munmap(j->buf, j->size);
+  free(j->blocks);
+  free(j->covered);
+  free(j->hits);
+  free(j);
+  rvm->jit = NULL;
+}
+
+void jit_invalidate(RVM *rvm, uint16_t addr) {
+  if(rvm->jit->covered[addr]) {
+    jit_flush(rvm->jit);
+  }
+}
+
+static bool translatable(uint8_t opcode) {
+  return opcode <= 0x30 && opcode != 0x09 && opcode != 0x20;
+}
+
+/*
+ * Translates the block starting at start and returns its entry
+ * point, or NULL if the first instruction has to be interpreted.
+ */
+static uint8_t *translate(Jit *j, RVM *rvm, uint16_t start) {
+  if(!translatable(rvm->mem[start])) {
+    return NULL;
+  }
+  if(j->used + MAX_BLOCK_CODE > j->size) {
+    jit_flush(j);
+  }
+
+  uint8_t *entry = cursor(j);
+  uint16_t pc = start;
+  bool open = true;
+
+  for(int n = 0; open && n < MAX_BLOCK_INSNS; n++) {
+    uint8_t op = rvm->mem[pc];
+    if(!translatable(op)) {
+      break;
+    }
+    uint8_t b1 = rvm->mem[(uint16_t)(pc + 1)];
+    uint8_t b2 = rvm->mem[(uint16_t)(pc + 2)];
+    uint8_t b3 = rvm->mem[(uint16_t)(pc + 3)];
+    uint8_t rd = b1 >> 4;
+    uint8_t rs = b1 & 0xF;
+    uint16_t imm16 = b2 << 8 | b3;
+    uint8_t len = insn_length(op);
+    uint16_t next = pc + len;
+    uint8_t *skip;
+    j->count = n + 1;
+
+    for(uint8_t i = 0; i < len; i++) {
+      uint16_t a = pc + i;
+      j->covered[a] = 1;
+      rvm->code_map[a >> 3] |= 1 << (a & 7);
+    }
+
+    switch(op) {
+    case 0x00:
+      break;
+    case 0x01:
+      ld_al(j, rs);
+      st_al(j, rd);
+      break;
+    case 0x02:
+      emit(j, 4, 0xC6, 0x43, rd, b2);
+      break;
+    case 0x03:
+      mov_eax(j, imm16);
+      ld_cl(j, rs);
+      store_cl(j);
+      smc_guard(j, next);
+      break;
+    case 0x04:
+      // movzx ecx, byte [r12 + imm16]
+      emit(j, 5, 0x41, 0x0F, 0xB6, 0x8C, 0x24); emit32(j, imm16);
+      st_cl(j, rd);
+      break;
+    case 0x05:
+      emit(j, 4, 0xC6, 0x43, rs, b3);
+      emit(j, 4, 0xC6, 0x43, rd, b2);
+      break;
+    case 0x06:
+      pair_eax(j, rd, rs);
+      emit(j, 2, 0xB1, b2);
+      store_cl(j);
+      smc_guard(j, next);
+      break;
+    case 0x07:
+      pair_eax(j, rd, rs);
+      ld_cl(j, b2 & 0xF);
+      store_cl(j);
+      smc_guard(j, next);
+      break;
+    case 0x08:
+      pair_eax(j, rd, rs);
+      load_ecx(j);
+      st_cl(j, b2 & 0xF);
+      break;
+    case 0x0A:
+      ld_al(j, rs);
+      emit(j, 3, 0x00, 0x43, rd);
+      set_z(j);
+      break;
+    case 0x0B:
+      ld_al(j, rs);
+      emit(j, 3, 0x28, 0x43, rd);
+      set_z(j);
+      break;
+    case 0x0C:
+      emit(j, 3, 0xFE, 0x43, rd);
+      set_z(j);
+      break;
+    case 0x0D:
+      emit(j, 3, 0xFE, 0x4B, rd);
+      set_z(j);
+      break;
+    case 0x0E:
+      ld_al(j, rd);
+      emit(j, 3, 0x3A, 0x43, rs);
+      set_z(j);
+      break;
+    case 0x0F:
+      emit(j, 4, 0x80, 0x7B, rd, b2);
+      set_z(j);
+      break;
+    case 0x10:
+      exit_chained(j, imm16);
+      open = false;
+      break;
+    case 0x11:
+    case 0x12:
+      // test r15b, r15b ; jz/jnz over the taken exit
+      emit(j, 3, 0x45, 0x84, 0xFF);
+      skip = jump8(j, op == 0x11 ? 0x74 : 0x75);
+      exit_chained(j, imm16);
+      land(j, skip);
+      exit_chained(j, next);
+      open = false;
+      break;
+    case 0x13:
+      pair_eax(j, rd, rs);
+      exit_indirect(j);
+      open = false;
+      break;
+    case 0x14:
+    case 0x15:
+      emit(j, 3, 0x45, 0x84, 0xFF);
+      skip = jump8(j, op == 0x14 ? 0x75 : 0x74);
+      exit_chained(j, next);
+      land(j, skip);
+      pair_eax(j, rd, rs);
+      exit_indirect(j);
+      open = false;
+      break;
+    case 0x16:
+      push_ret(j, next);
+      // test dl, dl ; je over the smc exit
+      emit(j, 2, 0x84, 0xD2);
+      skip = jump8(j, 0x74);
+      mov_eax(j, imm16);
+      exit_smc(j);
+      land(j, skip);
+      exit_chained(j, imm16);
+      open = false;
+      break;
+    case 0x17:
+      pair_esi(j, rd, rs);
+      push_ret(j, next);
+      // mov eax, esi ; test dl, dl ; je over the smc exit
+      emit(j, 2, 0x89, 0xF0);
+      emit(j, 2, 0x84, 0xD2);
+      skip = jump8(j, 0x74);
+      exit_smc(j);
+      land(j, skip);
+      exit_indirect(j);
+      open = false;
+      break;
+    case 0x18:
+      sp_inc(j);
+      sp_eax(j);
+      load_ecx(j);
+      sp_inc(j);
+      sp_eax(j);
+      // movzx edx, byte [r12 + rax] ; shl edx, 8 ; or ecx, edx ; mov eax, ecx
+      emit(j, 5, 0x41, 0x0F, 0xB6, 0x14, 0x04);
+      emit(j, 3, 0xC1, 0xE2, 0x08);
+      emit(j, 2, 0x09, 0xD1);
+      emit(j, 2, 0x89, 0xC8);
+      exit_indirect(j);
+      open = false;
+      break;
+    case 0x19:
+    case 0x1B:
+      sp_eax(j);
+      if(op == 0x19) {
+	ld_cl(j, rs);
+      } else {
+	emit(j, 2, 0xB1, b2);
+      }
+      store_cl(j);
+      sp_dec(j);
+      smc_guard(j, next);
+      break;
+    case 0x1A:
+      sp_inc(j);
+      sp_eax(j);
+      load_ecx(j);
+      st_cl(j, rd);
+      break;
+    case 0x1C:
+      ld_al(j, rs);
+      emit(j, 3, 0x20, 0x43, rd);
+      break;
+    case 0x1D:
+      ld_al(j, rs);
+      emit(j, 3, 0x08, 0x43, rd);
+      break;
+    case 0x1E:
+      ld_al(j, rs);
+      emit(j, 3, 0x30, 0x43, rd);
+      break;
+    case 0x1F:
+      // mul byte [rbx + rs]
+      ld_al(j, rd);
+      emit(j, 3, 0xF6, 0x63, rs);
+      st_al(j, rd);
+      break;
+    case 0x21:
+    case 0x24:
+      // div byte [rbx + rs]; quotient in al, remainder in ah
+      ldz_eax(j, rd);
+      emit(j, 3, 0xF6, 0x73, rs);
+      if(op == 0x21) {
+	st_al(j, rd);
+      } else {
+	emit(j, 2, 0x84, 0xE4);
+	set_z(j);
+      }
+      break;
+    case 0x22:
+      // imul eax, eax, imm32
+      ldz_eax(j, rd);
+      emit(j, 2, 0x69, 0xC0); emit32(j, b2);
+      st_al(j, rd);
+      break;
+    case 0x23:
+    case 0x25:
+      // mov ecx, imm ; div cl
+      ldz_eax(j, rd);
+      emit(j, 1, 0xB9); emit32(j, b2);
+      emit(j, 2, 0xF6, 0xF1);
+      if(op == 0x23) {
+	st_al(j, rd);
+      } else {
+	emit(j, 2, 0x84, 0xE4);
+	set_z(j);
+      }
+      break;
+    case 0x26:
+    case 0x27:
+    case 0x2A:
+      // add / sub / cmp ax, si
+      pair_eax(j, rd, rs);
+      pair_esi(j, b2 >> 4, b2 & 0xF);
+      emit(j, 3, 0x66, op == 0x26 ? 0x01 : op == 0x27 ? 0x29 : 0x39, 0xF0);
+      set_z(j);
+      set_c(j);
+      set_n(j);
+      if(op != 0x2A) {
+	st_pair(j, rd, rs);
+      }
+      break;
+    case 0x28:
+    case 0x29:
+      // inc / dec ax, which leave the carry flag alone
+      pair_eax(j, rd, rs);
+      emit(j, 3, 0x66, 0xFF, op == 0x28 ? 0xC0 : 0xC8);
+      set_z(j);
+      set_n(j);
+      st_pair(j, rd, rs);
+      break;
+    case 0x2B:
+      // add ax, imm16
+      pair_eax(j, rd, rs);
+      emit(j, 4, 0x66, 0x05, b3, 0x00);
+      load_ecx(j);
+      st_cl(j, b2 & 0xF);
+      break;
+    case 0x2C:
+      // Load, then inc ax into the pair
+      pair_eax(j, rd, rs);
+      load_ecx(j);
+      emit(j, 3, 0x66, 0xFF, 0xC0);
+      st_pair(j, rd, rs);
+      st_cl(j, b2 & 0xF);
+      break;
+    case 0x2D:
+      pair_eax(j, rd, rs);
+      ld_cl(j, b2 & 0xF);
+      store_cl(j);
+      // lea edx, [rax + 1] ; mov [rbx + rs], dl ; mov [rbx + rd], dh
+      emit(j, 3, 0x8D, 0x50, 0x01);
+      emit(j, 3, 0x88, 0x53, rs);
+      emit(j, 3, 0x88, 0x73, rd);
+      smc_guard(j, next);
+      break;
+    case 0x2E:
+      // dec byte [rbx + rd] ; je over the taken exit
+      emit(j, 3, 0xFE, 0x4B, rd);
+      set_z(j);
+      skip = jump8(j, 0x74);
+      exit_chained(j, imm16);
+      land(j, skip);
+      exit_chained(j, next);
+      open = false;
+      break;
+    case 0x2F:
+    case 0x30:
+      // cmp byte [rbp + flag], 0 ; je over the taken exit
+      emit(j, 2, 0x80, 0xBD);
+      emit32(j, op == 0x2F ? offsetof(RVM, c_flag) : offsetof(RVM, n_flag));
+      emit(j, 1, 0x00);
+      skip = jump8(j, 0x74);
+      exit_chained(j, imm16);
+      land(j, skip);
+      exit_chained(j, next);
+      open = false;
+      break;
+    }
+    pc = next;
+  }
+
+  if(open) {
+    exit_chained(j, pc);
+  }
+  j->blocks[start] = entry;
+  return entry;
+}
+
+/*
+ * Steps the reference VM over the steps instructions the block just
+ * retired, then compares the two. Its exit can be inside the block,
+ * so the reference cannot just run until the pcs meet.
+ */
+static void lockstep_check(RVM *rvm, RVM *ref, uint16_t block,
+			   uint64_t steps) {
+  for(uint64_t i = 0; i < steps; i++) {
+    fetch(ref);
+    decode(ref);
+    execute(ref);
+  }
+
+  bool same = ref->pc == rvm->pc && ref->sp == rvm->sp
+    && ref->z_flag == rvm->z_flag
+    && ref->c_flag == rvm->c_flag
+    && ref->n_flag == rvm->n_flag
+    && !memcmp(ref->reg, rvm->reg, sizeof(rvm->reg))
+    && !memcmp(ref->mem, rvm->mem, 0x10000);
+  if(same) {
+    return;
+  }
+
+  out_flush(rvm);
+  printf("JIT lockstep divergence in block $%04X\n", block);
+  printf("       jit   interp\n");
+  printf("pc:  $%04X   $%04X\n", rvm->pc, ref->pc);
+  printf("sp:  $%04X   $%04X\n", rvm->sp, ref->sp);
+  printf("z:     %d       %d\n", rvm->z_flag, ref->z_flag);
+  printf("c:     %d       %d\n", rvm->c_flag, ref->c_flag);
+  printf("n:     %d       %d\n", rvm->n_flag, ref->n_flag);
+  for(uint8_t i = 0; i < 0x10; i++) {
+    if(rvm->reg[i] != ref->reg[i]) {
+      printf("r%X:    $%02X     $%02X\n", i, rvm->reg[i], ref->reg[i]);
+    }
+  }
+  for(uint32_t a = 0; a < 0x10000; a++) {
+    if(rvm->mem[a] != ref->mem[a]) {
+      printf("[$%04X] $%02X     $%02X\n", a, rvm->mem[a], ref->mem[a]);
+    }
+  }
+  exit(1);
+}
+
+// Copy the architectural state of src into dst
+static void sync_state(RVM *dst, RVM *src) {
+  memcpy(dst->reg, src->reg, sizeof(src->reg));
+  memcpy(dst->mem, src->mem, 0x10000);
+  dst->pc = src->pc;
+  dst->sp = src->sp;
+  dst->z_flag = src->z_flag;
+  dst->c_flag = src->c_flag;
+  dst->n_flag = src->n_flag;
+}
+
+static void jit_run(RVM *rvm, bool lockstep) {
+  Jit *j = jit_init(rvm, lockstep);
+  EnterFn enter = (EnterFn)j->enter;
+  RVM *ref = NULL;
+
+  if(lockstep) {
+    ref = new_rvm();
+    sync_state(ref, rvm);
+  }
+
+  rvm->r_flag = true;
+  while(rvm->r_flag) {
+    uint16_t pc = rvm->pc;
+    uint8_t *block = j->blocks[pc];
+
+    if(!block && ++j->hits[pc] >= j->threshold) {
+      j->hits[pc] = 0;
+      block = translate(j, rvm, pc);
+    }
+
+    if(!block) {
+      // Cold code, sys and hlt go through the interpreter
+      fetch(rvm);
+      decode(rvm);
+      execute(rvm);
+      rvm->icount++;
+      if(ref) {
+	sync_state(ref, rvm);
+      }
+      continue;
+    }
+
+    uint64_t before = rvm->icount;
+    enter(rvm, block, rvm->mem, j->covered);
+
+    if(ref) {
+      lockstep_check(rvm, ref, pc, rvm->icount - before);
+    }
+
+    if(j->flush_pending) {
+      jit_flush(j);
+    } else if(!lockstep && j->last_site && j->blocks[rvm->pc]) {
+      // Turn "call exit_chain" into "jmp block"
+      uint8_t *site = j->last_site - 5;
+      uint8_t *target = j->blocks[rvm->pc];
+      int32_t rel = (int32_t)(target - j->last_site);
+      site[0] = 0xE9;
+      memcpy(site + 1, &rel, 4);
+    }
+  }
+
+  if(ref) {
+    free_rvm(ref);
+  }
+}
+
+void run_jit(RVM *rvm) {
+  jit_run(rvm, false);
+}
+
+void run_jit_lockstep(RVM *rvm) {
+  jit_run(rvm, true);
+}
+
+#else
+
+void run_jit(RVM *rvm) {
+  run_threaded(rvm);
+}
+
+void run_jit_lockstep(RVM *rvm) {
+  run_threaded(rvm);
+}
+
+void jit_invalidate(RVM *rvm, uint16_t addr) {
+}
+
+void jit_free(RVM *rvm) {
+}
+
+#endif
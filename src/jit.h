@@ -0,0 +1,87 @@
+/* anewkirk */
+
+#pragma once
+
+#include "bool.h"
+#include "reflect.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Hosts with a translator; elsewhere run_jit() uses the threaded engine
+#if defined(__x86_64__) && !defined(RVM_PAGED_MEM)
+#define HAVE_JIT
+#endif
+
+// State of the x86-64 basic-block translator attached to an RVM
+typedef struct _jit {
+  // Executable code buffer and its fill level
+  uint8_t *buf;
+  size_t size;
+  size_t used;
+
+  // Start of block code; everything before it is the stubs. Block
+  // code only refers to the buffer relative to itself, so it stays
+  // valid copied to the same offset of another buffer (see tcache.h)
+  size_t stubs_end;
+
+  // Native entry point of the block starting at each guest address
+  void **blocks;
+
+  // Nonzero for guest bytes that were translated into a live block
+  uint8_t *covered;
+
+  // Dispatcher visits per guest address, used to find hot blocks
+  uint8_t *hits;
+
+  // Chainable exit site that last returned to the dispatcher
+  uint8_t *last_site;
+
+  // Set by native code that stored into a translated range
+  bool flush_pending;
+
+  // Visits after which a block gets translated
+  uint8_t threshold;
+
+  // Check every block against the interpreter as it runs
+  bool lockstep;
+
+  // Guest instructions emitted so far in the block being translated
+  uint8_t count;
+
+  // Stubs: entry trampoline and the three ways back out
+  uint8_t *enter;
+  uint8_t *exit_chain;
+  uint8_t *exit_plain;
+  uint8_t *exit_smc;
+} Jit;
+
+/*
+ * Runs the program, translating hot basic blocks into native
+ * x86-64 code and interpreting everything else. On other hosts
+ * this falls back to run_threaded().
+ */
+void run_jit(RVM *rvm);
+
+/*
+ * Like run_jit(), but every block is also executed by the
+ * switch interpreter on a shadow VM and the two states are
+ * compared after each block. Exits with an error report on
+ * the first divergence.
+ */
+void run_jit_lockstep(RVM *rvm);
+
+/*
+ * Attaches a translator to rvm, or returns the one it has.
+ * Only in builds with HAVE_JIT.
+ */
+Jit *jit_init(RVM *rvm, bool lockstep);
+
+/*
+ * Drops all translated code if addr lies in a translated range.
+ */
+void jit_invalidate(RVM *rvm, uint16_t addr);
+
+/*
+ * Releases the translator attached to rvm.
+ */
+void jit_free(RVM *rvm);
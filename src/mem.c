@@ -0,0 +1,382 @@
+/*
+ * anewkirk
+ *
+ * The two VM memory backends; see mem.h.
+ */
+
+#define _GNU_SOURCE
+
+#include "mem.h"
+#include "bool.h"
+#include "reflect.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes from addr that are contiguous in host memory, at most n:
+// to the end of its page, or of memory
+static uint32_t host_chunk(uint16_t addr, uint32_t n) {
+#ifdef RVM_PAGED_MEM
+  uint32_t chunk = MEM_PAGE - (addr & (MEM_PAGE - 1));
+#else
+  uint32_t chunk = 0x10000 - addr;
+#endif
+  return chunk < n ? chunk : n;
+}
+
+static uint8_t *host_at(RVM *rvm, uint16_t addr) {
+#ifdef RVM_PAGED_MEM
+  return rvm->pages[addr >> 8] + (addr & 0xFF);
+#else
+  return rvm->mem + addr;
+#endif
+}
+
+// host_at() for n bytes about to be written, within one host_chunk()
+static uint8_t *host_write(RVM *rvm, uint16_t addr, uint32_t n) {
+  for(uint32_t p = addr >> 8; p <= (addr + n - 1u) >> 8; p++) {
+#ifdef RVM_PAGED_MEM
+    if(!rvm->dirty[p]) {
+      mem_own_page(rvm, p);
+    }
+#else
+    rvm->dirty[p] = 1;
+#endif
+  }
+  return host_at(rvm, addr);
+}
+
+// Drops predecoded code among n bytes just written at addr
+static void code_written(RVM *rvm, uint16_t addr, uint32_t n) {
+  if(!rvm->code_map) {
+    return;
+  }
+  uint32_t i = 0;
+  while(i < n) {
+    uint16_t a = addr + i;
+    // Skip eight addresses at a time where no code was decoded
+    if(!(a & 7) && !rvm->code_map[a >> 3]) {
+      i += 8;
+      continue;
+    }
+    if(rvm->code_map[a >> 3] & 1 << (a & 7)) {
+      icache_invalidate(rvm, a);
+    }
+    i++;
+  }
+}
+
+void vm_read(RVM *rvm, uint16_t addr, uint8_t *dst, uint32_t n) {
+  while(n) {
+    uint32_t chunk = host_chunk(addr, n);
+    memcpy(dst, host_at(rvm, addr), chunk);
+    addr += chunk;
+    dst += chunk;
+    n -= chunk;
+  }
+}
+
+void vm_write(RVM *rvm, uint16_t addr, const uint8_t *src, uint32_t n) {
+  while(n) {
+    uint32_t chunk = host_chunk(addr, n);
+    memcpy(host_write(rvm, addr, chunk), src, chunk);
+    code_written(rvm, addr, chunk);
+    addr += chunk;
+    src += chunk;
+    n -= chunk;
+  }
+}
+
+void vm_move(RVM *rvm, uint16_t dst, uint16_t src, uint32_t n) {
+  if(!n) {
+    return;
+  }
+  if(host_chunk(dst, n) == n && host_chunk(src, n) == n) {
+    memmove(host_write(rvm, dst, n), host_at(rvm, src), n);
+    code_written(rvm, dst, n);
+    return;
+  }
+  // Across pages or the wrap, go through a copy of the source
+  uint8_t small[MEM_PAGE];
+  uint8_t *tmp = n <= sizeof(small) ? small : malloc(n);
+  vm_read(rvm, src, tmp, n);
+  vm_write(rvm, dst, tmp, n);
+  if(tmp != small) {
+    free(tmp);
+  }
+}
+
+void vm_fill(RVM *rvm, uint16_t addr, uint8_t val, uint32_t n) {
+  while(n) {
+    uint32_t chunk = host_chunk(addr, n);
+    memset(host_write(rvm, addr, chunk), val, chunk);
+    code_written(rvm, addr, chunk);
+    addr += chunk;
+    n -= chunk;
+  }
+}
+
+int vm_compare(RVM *rvm, uint16_t a, uint16_t b, uint32_t n) {
+  while(n) {
+    uint32_t chunk = host_chunk(b, host_chunk(a, n));
+    int c = memcmp(host_at(rvm, a), host_at(rvm, b), chunk);
+    if(c) {
+      return c;
+    }
+    a += chunk;
+    b += chunk;
+    n -= chunk;
+  }
+  return 0;
+}
+
+int32_t vm_find(RVM *rvm, uint16_t addr, uint8_t val, uint32_t n) {
+  while(n) {
+    uint32_t chunk = host_chunk(addr, n);
+    const uint8_t *p = host_at(rvm, addr);
+    const uint8_t *hit = memchr(p, val, chunk);
+    if(hit) {
+      return (uint16_t)(addr + (hit - p));
+    }
+    addr += chunk;
+    n -= chunk;
+  }
+  return -1;
+}
+
+typedef uint16_t v16h __attribute__((vector_size(32)));
+
+#if defined(__x86_64__)
+#define VECTOR_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define VECTOR_TARGETS
+#endif
+
+/*
+ * Adds the bytes at even offsets of p to *even and those at odd
+ * offsets to *odd, 32 bytes at a time in 16-bit lanes, which are
+ * widened before they can overflow.
+ */
+VECTOR_TARGETS
+static void sum_bytes(const uint8_t *p, uint32_t n, uint64_t *even,
+		      uint64_t *odd) {
+  uint32_t i = 0;
+  while(n - i >= sizeof(v16h)) {
+    v16h lo = {0}, hi = {0};
+    // 256 additions of at most $FF fit in 16 bits
+    for(uint32_t k = 0; k < 0x100 && n - i >= sizeof(v16h); k++) {
+      v16h w;
+      memcpy(&w, p + i, sizeof(w));
+      lo += w & 0xFF;
+      hi += w >> 8;
+      i += sizeof(v16h);
+    }
+    for(uint32_t l = 0; l < sizeof(v16h) / 2; l++) {
+      *even += lo[l];
+      *odd += hi[l];
+    }
+  }
+  for(; i < n; i++) {
+    *(i & 1 ? odd : even) += p[i];
+  }
+}
+
+uint16_t vm_checksum(RVM *rvm, uint16_t addr, uint32_t n) {
+  uint64_t high = 0, low = 0;
+  uint32_t done = 0;
+  while(done < n) {
+    uint32_t chunk = host_chunk(addr, n - done);
+    // Bytes at even offsets from the start are the high halves
+    if(done & 1) {
+      sum_bytes(host_at(rvm, addr), chunk, &low, &high);
+    } else {
+      sum_bytes(host_at(rvm, addr), chunk, &high, &low);
+    }
+    addr += chunk;
+    done += chunk;
+  }
+  uint64_t sum = (high << 8) + low;
+  while(sum >> 16) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  return ~sum;
+}
+
+#ifdef RVM_PAGED_MEM
+
+struct _mem_image {
+  // The snapshot and every VM attached to the image
+  uint32_t refs;
+
+  // Contents of each page; all-zero pages point at zero_page
+  uint8_t *pages[0x100];
+
+  // The pages that are not all zero
+  uint8_t data[];
+};
+
+static uint8_t zero_page[MEM_PAGE];
+
+static void image_ref(MemImage *image) {
+  __atomic_add_fetch(&image->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void image_unref(MemImage *image) {
+  if(image && !__atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL)) {
+    free(image);
+  }
+}
+
+void mem_init(RVM *rvm) {
+  for(uint32_t p = 0; p < 0x100; p++) {
+    rvm->pages[p] = zero_page;
+  }
+  rvm->image = NULL;
+}
+
+// Frees the pages rvm owns and lets go of its image
+static void drop_pages(RVM *rvm) {
+  for(uint32_t p = 0; p < 0x100; p++) {
+    if(rvm->dirty[p]) {
+      free(rvm->pages[p]);
+      rvm->dirty[p] = 0;
+    }
+    rvm->pages[p] = zero_page;
+  }
+  image_unref(rvm->image);
+  rvm->image = NULL;
+}
+
+void mem_free(RVM *rvm) {
+  drop_pages(rvm);
+}
+
+void mem_own_page(RVM *rvm, uint8_t page) {
+  uint8_t *copy = malloc(MEM_PAGE);
+  memcpy(copy, rvm->pages[page], MEM_PAGE);
+  rvm->pages[page] = copy;
+  rvm->dirty[page] = 1;
+}
+
+MemImage *mem_capture(RVM *rvm) {
+  uint32_t used = 0;
+  for(uint32_t p = 0; p < 0x100; p++) {
+    used += memcmp(rvm->pages[p], zero_page, MEM_PAGE) != 0;
+  }
+
+  MemImage *image = malloc(sizeof(MemImage) + used * MEM_PAGE);
+  image->refs = 1;
+  uint8_t *next = image->data;
+  for(uint32_t p = 0; p < 0x100; p++) {
+    if(memcmp(rvm->pages[p], zero_page, MEM_PAGE)) {
+      memcpy(next, rvm->pages[p], MEM_PAGE);
+      image->pages[p] = next;
+      next += MEM_PAGE;
+    } else {
+      image->pages[p] = zero_page;
+    }
+  }
+
+  mem_attach(rvm, image);
+  return image;
+}
+
+void mem_attach(RVM *rvm, MemImage *image) {
+  image_ref(image);
+  drop_pages(rvm);
+  memcpy(rvm->pages, image->pages, sizeof(rvm->pages));
+  rvm->image = image;
+}
+
+void mem_restore_page(RVM *rvm, MemImage *image, uint8_t page) {
+  if(rvm->dirty[page]) {
+    free(rvm->pages[page]);
+  }
+  rvm->pages[page] = image->pages[page];
+}
+
+void mem_release(MemImage *image) {
+  image_unref(image);
+}
+
+#else
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define HOST_PAGE 0x1000
+
+struct _mem_image {
+  // Memory file holding the 64 KiB, and a read-only view of it
+  int fd;
+  const uint8_t *view;
+};
+
+static const uint8_t zero_page[HOST_PAGE];
+
+void mem_init(RVM *rvm) {
+  // Pages are only committed once written
+  rvm->mem = mmap(NULL, 0x10000, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(rvm->mem == MAP_FAILED) {
+    printf("Failed to map VM memory\n");
+    exit(1);
+  }
+}
+
+void mem_free(RVM *rvm) {
+  munmap(rvm->mem, 0x10000);
+}
+
+MemImage *mem_capture(RVM *rvm) {
+  MemImage *image = malloc(sizeof(MemImage));
+  image->fd = memfd_create("rvm-snapshot", MFD_CLOEXEC);
+  if(image->fd < 0 || ftruncate(image->fd, 0x10000)) {
+    printf("Failed to create snapshot\n");
+    exit(1);
+  }
+
+  // Untouched pages read back as zero without being stored
+  for(uint32_t a = 0; a < 0x10000; a += HOST_PAGE) {
+    if(!memcmp(rvm->mem + a, zero_page, HOST_PAGE)) {
+      continue;
+    }
+    if(pwrite(image->fd, rvm->mem + a, HOST_PAGE, a) != HOST_PAGE) {
+      printf("Failed to create snapshot\n");
+      exit(1);
+    }
+  }
+
+  image->view = mmap(NULL, 0x10000, PROT_READ, MAP_SHARED, image->fd, 0);
+  if(image->view == MAP_FAILED) {
+    printf("Failed to map snapshot\n");
+    exit(1);
+  }
+
+  mem_attach(rvm, image);
+  return image;
+}
+
+void mem_attach(RVM *rvm, MemImage *image) {
+  void *p = mmap(rvm->mem, 0x10000, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_FIXED, image->fd, 0);
+  if(p == MAP_FAILED) {
+    printf("Failed to map snapshot\n");
+    exit(1);
+  }
+  memset(rvm->dirty, 0, sizeof(rvm->dirty));
+}
+
+void mem_restore_page(RVM *rvm, MemImage *image, uint8_t page) {
+  memcpy(rvm->mem + page * MEM_PAGE, image->view + page * MEM_PAGE,
+	 MEM_PAGE);
+}
+
+void mem_release(MemImage *image) {
+  munmap((void *)image->view, 0x10000);
+  close(image->fd);
+  free(image);
+}
+
+#endif
@@ -0,0 +1,154 @@
+/* anewkirk */
+
+#pragma once
+
+#include "reflect.h"
+#include <stdint.h>
+
+/*
+ * Access to VM memory. Everything outside this layer reads and
+ * writes guest memory through these functions, so the backend is
+ * chosen when the VM is built:
+ *
+ * By default memory is one 64 KiB mapping. The kernel commits it a
+ * 4 KiB page at a time as it is written, and unwritten pages read
+ * as zero.
+ *
+ * With RVM_PAGED_MEM (make PAGED=1) memory is 256 pages of 256
+ * bytes. Every page starts out pointing at one shared zero page or
+ * at a page of the snapshot the VM was cloned from, and gets a page
+ * of its own the first time it is written. A VM that runs a small
+ * program then costs a few hundred bytes of memory instead of a few
+ * 4 KiB pages. The JIT needs flat memory, so run_jit() uses the
+ * threaded engine in this build.
+ */
+
+#define MEM_PAGE 0x100
+
+#ifdef RVM_PAGED_MEM
+
+// What engines keep in a local to reach memory
+typedef uint8_t **MemBase;
+#define MEM_BASE(rvm) ((rvm)->pages)
+
+static inline uint8_t mem_load(MemBase mem, uint16_t addr) {
+  return mem[addr >> 8][addr & 0xFF];
+}
+
+/*
+ * Gives rvm a private copy of page, which is not yet dirty.
+ */
+void mem_own_page(RVM *rvm, uint8_t page);
+
+static inline void mem_store(RVM *rvm, MemBase mem, uint16_t addr,
+			     uint8_t val) {
+  // In this build a page is dirty exactly when it is the VM's own
+  if(!rvm->dirty[addr >> 8]) {
+    mem_own_page(rvm, addr >> 8);
+  }
+  mem[addr >> 8][addr & 0xFF] = val;
+}
+
+#else
+
+typedef uint8_t *MemBase;
+#define MEM_BASE(rvm) ((rvm)->mem)
+
+static inline uint8_t mem_load(MemBase mem, uint16_t addr) {
+  return mem[addr];
+}
+
+static inline void mem_store(RVM *rvm, MemBase mem, uint16_t addr,
+			     uint8_t val) {
+  mem[addr] = val;
+  rvm->dirty[addr >> 8] = 1;
+}
+
+#endif
+
+/*
+ * Reads the byte at addr.
+ */
+static inline uint8_t vm_load(RVM *rvm, uint16_t addr) {
+  return mem_load(MEM_BASE(rvm), addr);
+}
+
+/*
+ * Drops the predecoded entries covering addr; see icache.h
+ */
+void icache_invalidate(RVM *rvm, uint16_t addr);
+
+/*
+ * Writes val to memory at addr. Every store into VM memory
+ * goes through here or mem_store() so the predecode cache and
+ * JIT stay coherent with self-modifying programs, and so the
+ * page is marked dirty.
+ */
+static inline void vm_store(RVM *rvm, uint16_t addr, uint8_t val) {
+  mem_store(rvm, MEM_BASE(rvm), addr, val);
+  if(rvm->code_map && rvm->code_map[addr >> 3] & 1 << (addr & 7)) {
+    icache_invalidate(rvm, addr);
+  }
+}
+
+/*
+ * Copies n bytes from memory at addr into dst, wrapping at $FFFF.
+ */
+void vm_read(RVM *rvm, uint16_t addr, uint8_t *dst, uint32_t n);
+
+/*
+ * Copies n bytes from src into memory at addr, wrapping at $FFFF,
+ * as vm_store() would.
+ */
+void vm_write(RVM *rvm, uint16_t addr, const uint8_t *src, uint32_t n);
+
+/*
+ * Bulk operations over n bytes of memory, wrapping at $FFFF, for
+ * the sys calls that stand in for guest byte loops. Writes behave
+ * as vm_write() does.
+ *
+ * vm_move() copies as if through a temporary buffer, so the ranges
+ * may overlap. vm_compare() returns memcmp()'s sign for the bytes
+ * at a and b, vm_find() the address of the first val or -1, and
+ * vm_checksum() the 16-bit ones' complement checksum of the bytes
+ * as big-endian words, an odd last byte padded with zero (RFC 1071).
+ */
+void vm_move(RVM *rvm, uint16_t dst, uint16_t src, uint32_t n);
+void vm_fill(RVM *rvm, uint16_t addr, uint8_t val, uint32_t n);
+int vm_compare(RVM *rvm, uint16_t a, uint16_t b, uint32_t n);
+int32_t vm_find(RVM *rvm, uint16_t addr, uint8_t val, uint32_t n);
+uint16_t vm_checksum(RVM *rvm, uint16_t addr, uint32_t n);
+
+/*
+ * Sets up the memory of a new VM, all zero, and releases it.
+ */
+void mem_init(RVM *rvm);
+void mem_free(RVM *rvm);
+
+/*
+ * The memory of a snapshot, shared by the VMs cloned from it.
+ */
+typedef struct _mem_image MemImage;
+
+/*
+ * Makes an image of rvm's memory and puts rvm on it, as if it were
+ * a clone that has written nothing.
+ */
+MemImage *mem_capture(RVM *rvm);
+
+/*
+ * Replaces the memory of rvm with a copy-on-write view of image.
+ */
+void mem_attach(RVM *rvm, MemImage *image);
+
+/*
+ * Returns page of rvm, a VM attached to image, to the image's
+ * contents.
+ */
+void mem_restore_page(RVM *rvm, MemImage *image, uint8_t page);
+
+/*
+ * Drops the snapshot's hold on image. VMs attached to it keep
+ * their memory.
+ */
+void mem_release(MemImage *image);
@@ -0,0 +1,174 @@
+/* anewkirk */
+
+#pragma once
+
+/*
+ * The semantics of every opcode except hlt, for engines that keep
+ * the VM state in locals. The including file provides:
+ *
+ *   pc, sp, z, rvm        the state, as lvalues
+ *   carry, neg            the carry and negative flags, as lvalues
+ *   mem                   memory, as a MemBase (see mem.h)
+ *   REG(r)                register r, as an lvalue
+ *   STORE(addr, val)      a store to VM memory
+ */
+
+#define PAIR(x, y) ((uint16_t)(REG(x) << 8 | REG(y)))
+
+/*
+ * Executes opcode OPC with the operands of entry E and leaves pc at
+ * the next instruction to run; NEXT is the address of the one that
+ * follows E. Everything needed from E is read before any store,
+ * since a store may invalidate it.
+ */
+#define OP(OPC, E, NEXT) do {						\
+    switch(OPC) {							\
+    case 0x00: pc = (NEXT); break;					\
+    case 0x01: REG((E)->reg_d) = REG((E)->reg_s); pc = (NEXT); break;	\
+    case 0x02: REG((E)->reg_d) = (E)->imm8; pc = (NEXT); break;		\
+    case 0x03: pc = (NEXT); STORE((E)->imm16, REG((E)->reg_s)); break;	\
+    case 0x04: REG((E)->reg_d) = mem_load(mem, (E)->imm16); pc = (NEXT); break;	\
+    case 0x05:								\
+      REG((E)->reg_s) = (E)->imm16 & 0xFF;				\
+      REG((E)->reg_d) = (E)->imm16 >> 8;				\
+      pc = (NEXT);							\
+      break;								\
+    case 0x06:								\
+      pc = (NEXT);							\
+      STORE(PAIR((E)->reg_d, (E)->reg_s), (E)->imm8);			\
+      break;								\
+    case 0x07:								\
+      pc = (NEXT);							\
+      STORE(PAIR((E)->reg_d, (E)->reg_s), REG((E)->imm8 & 0xF));	\
+      break;								\
+    case 0x08:								\
+      REG((E)->imm8 & 0xF) = mem_load(mem, PAIR((E)->reg_d, (E)->reg_s));		\
+      pc = (NEXT);							\
+      break;								\
+    case 0x0A:								\
+      REG((E)->reg_d) += REG((E)->reg_s);				\
+      z = REG((E)->reg_d) == 0;						\
+      pc = (NEXT);							\
+      break;								\
+    case 0x0B:								\
+      REG((E)->reg_d) -= REG((E)->reg_s);				\
+      z = REG((E)->reg_d) == 0;						\
+      pc = (NEXT);							\
+      break;								\
+    case 0x0C: z = ++REG((E)->reg_d) == 0; pc = (NEXT); break;		\
+    case 0x0D: z = --REG((E)->reg_d) == 0; pc = (NEXT); break;		\
+    case 0x0E: z = REG((E)->reg_d) == REG((E)->reg_s); pc = (NEXT); break; \
+    case 0x0F: z = REG((E)->reg_d) == (E)->imm8; pc = (NEXT); break;	\
+    case 0x10: pc = (E)->imm16; break;					\
+    case 0x11: pc = z ? (E)->imm16 : (NEXT); break;			\
+    case 0x12: pc = z ? (NEXT) : (E)->imm16; break;			\
+    case 0x13: pc = PAIR((E)->reg_d, (E)->reg_s); break;		\
+    case 0x14: pc = z ? PAIR((E)->reg_d, (E)->reg_s) : (NEXT); break;	\
+    case 0x15: pc = z ? (NEXT) : PAIR((E)->reg_d, (E)->reg_s); break;	\
+    case 0x16:								\
+    case 0x17: {							\
+      uint16_t _t = (OPC) == 0x16 ? (E)->imm16				\
+	: PAIR((E)->reg_d, (E)->reg_s);					\
+      pc = (NEXT);							\
+      STORE(sp--, pc >> 8);						\
+      STORE(sp--, pc & 0xFF);						\
+      pc = _t;								\
+      break;								\
+    }									\
+    case 0x18: {							\
+      uint8_t _lo = mem_load(mem, ++sp);						\
+      uint8_t _hi = mem_load(mem, ++sp);						\
+      pc = _hi << 8 | _lo;						\
+      break;								\
+    }									\
+    case 0x19: pc = (NEXT); STORE(sp--, REG((E)->reg_s)); break;	\
+    case 0x1A: REG((E)->reg_d) = mem_load(mem, ++sp); pc = (NEXT); break;	\
+    case 0x1B: pc = (NEXT); STORE(sp--, (E)->imm8); break;		\
+    case 0x1C: REG((E)->reg_d) &= REG((E)->reg_s); pc = (NEXT); break;	\
+    case 0x1D: REG((E)->reg_d) |= REG((E)->reg_s); pc = (NEXT); break;	\
+    case 0x1E: REG((E)->reg_d) ^= REG((E)->reg_s); pc = (NEXT); break;	\
+    case 0x1F: REG((E)->reg_d) *= REG((E)->reg_s); pc = (NEXT); break;	\
+    case 0x20: {							\
+      /* sys calls work on the RVM struct, and host handlers may */	\
+      /* change pc, sp or the flags, so sync the locals both ways */	\
+      uint8_t _call = (E)->imm8;					\
+      uint8_t _x = (E)->reg_d;						\
+      uint8_t _y = (E)->reg_s;						\
+      pc = (NEXT);							\
+      rvm->pc = pc;							\
+      rvm->sp = sp;							\
+      rvm->z_flag = z;							\
+      rvm->c_flag = carry;						\
+      rvm->n_flag = neg;						\
+      sys_call(rvm, _call, _x, _y);					\
+      pc = rvm->pc;							\
+      sp = rvm->sp;							\
+      z = rvm->z_flag;							\
+      carry = rvm->c_flag;						\
+      neg = rvm->n_flag;						\
+      break;								\
+    }									\
+    case 0x21: REG((E)->reg_d) /= REG((E)->reg_s); pc = (NEXT); break;	\
+    case 0x22: REG((E)->reg_d) *= (E)->imm8; pc = (NEXT); break;	\
+    case 0x23: REG((E)->reg_d) /= (E)->imm8; pc = (NEXT); break;	\
+    case 0x24:								\
+      z = REG((E)->reg_d) % REG((E)->reg_s) == 0;			\
+      pc = (NEXT);							\
+      break;								\
+    case 0x25: z = REG((E)->reg_d) % (E)->imm8 == 0; pc = (NEXT); break; \
+    case 0x26:								\
+    case 0x27:								\
+    case 0x2A: {							\
+      uint16_t _a = PAIR((E)->reg_d, (E)->reg_s);			\
+      uint16_t _b = PAIR((E)->imm8 >> 4, (E)->imm8 & 0xF);		\
+      uint16_t _r = (OPC) == 0x26 ? _a + _b : _a - _b;			\
+      if((OPC) != 0x2A) {						\
+	REG((E)->reg_s) = _r & 0xFF;					\
+	REG((E)->reg_d) = _r >> 8;					\
+      }									\
+      z = _r == 0;							\
+      neg = _r >> 15;							\
+      carry = (OPC) == 0x26 ? _r < _a : _a < _b;			\
+      pc = (NEXT);							\
+      break;								\
+    }									\
+    case 0x28:								\
+    case 0x29: {							\
+      uint16_t _r = PAIR((E)->reg_d, (E)->reg_s) + ((OPC) == 0x28 ? 1 : -1); \
+      REG((E)->reg_s) = _r & 0xFF;					\
+      REG((E)->reg_d) = _r >> 8;					\
+      z = _r == 0;							\
+      neg = _r >> 15;							\
+      pc = (NEXT);							\
+      break;								\
+    }									\
+    case 0x2B:								\
+      REG((E)->imm16 >> 8 & 0xF) =					\
+	mem_load(mem, PAIR((E)->reg_d, (E)->reg_s) + ((E)->imm16 & 0xFF)); \
+      pc = (NEXT);							\
+      break;								\
+    case 0x2C: {							\
+      uint16_t _at = PAIR((E)->reg_d, (E)->reg_s);			\
+      REG((E)->reg_s) = (_at + 1) & 0xFF;				\
+      REG((E)->reg_d) = (_at + 1) >> 8 & 0xFF;				\
+      REG((E)->imm8 & 0xF) = mem_load(mem, _at);			\
+      pc = (NEXT);							\
+      break;								\
+    }									\
+    case 0x2D: {							\
+      uint16_t _at = PAIR((E)->reg_d, (E)->reg_s);			\
+      uint8_t _v = REG((E)->imm8 & 0xF);				\
+      REG((E)->reg_s) = (_at + 1) & 0xFF;				\
+      REG((E)->reg_d) = (_at + 1) >> 8 & 0xFF;				\
+      pc = (NEXT);							\
+      STORE(_at, _v);							\
+      break;								\
+    }									\
+    case 0x2E:								\
+      z = --REG((E)->reg_d) == 0;					\
+      pc = z ? (NEXT) : (E)->imm16;					\
+      break;								\
+    case 0x2F: pc = carry ? (E)->imm16 : (NEXT); break;			\
+    case 0x30: pc = neg ? (E)->imm16 : (NEXT); break;			\
+    }									\
+  } while(0)
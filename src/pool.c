@@ -0,0 +1,75 @@
+/*
+ * anewkirk
+ *
+ * Pools of VMs that are reset and reused rather than freed.
+ */
+
+#include "pool.h"
+#include "reflect.h"
+#include "snapshot.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+Pool *new_pool(uint8_t *filename) {
+  Pool *p = malloc(sizeof(Pool));
+  RVM *rvm = new_rvm();
+  load_code(rvm, filename);
+  p->image = rvm_snapshot(rvm);
+
+  pthread_mutex_init(&p->lock, NULL);
+  p->cap = 16;
+  p->idle = malloc(p->cap * sizeof(RVM *));
+  p->num_idle = 0;
+  p->acquired = 0;
+  p->created = 0;
+  p->resets = 0;
+  p->pages_restored = 0;
+
+  // The VM the snapshot was taken of is as good as a clone
+  p->idle[p->num_idle++] = rvm;
+  p->created++;
+  return p;
+}
+
+void free_pool(Pool *p) {
+  for(uint32_t i = 0; i < p->num_idle; i++) {
+    free_rvm(p->idle[i]);
+  }
+  free(p->idle);
+  free_snapshot(p->image);
+  pthread_mutex_destroy(&p->lock);
+  free(p);
+}
+
+RVM *pool_acquire(Pool *p) {
+  RVM *rvm = NULL;
+  pthread_mutex_lock(&p->lock);
+  p->acquired++;
+  if(p->num_idle) {
+    rvm = p->idle[--p->num_idle];
+  } else {
+    p->created++;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  if(!rvm) {
+    rvm = rvm_clone(p->image);
+  }
+  return rvm;
+}
+
+uint32_t pool_release(Pool *p, RVM *rvm) {
+  uint32_t restored = rvm_reset(rvm, p->image);
+
+  pthread_mutex_lock(&p->lock);
+  if(p->num_idle == p->cap) {
+    p->cap *= 2;
+    p->idle = realloc(p->idle, p->cap * sizeof(RVM *));
+  }
+  p->idle[p->num_idle++] = rvm;
+  p->resets++;
+  p->pages_restored += restored;
+  pthread_mutex_unlock(&p->lock);
+  return restored;
+}
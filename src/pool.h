@@ -0,0 +1,57 @@
+/* anewkirk */
+
+#pragma once
+
+#include "reflect.h"
+#include "snapshot.h"
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Reusable instances of one image. Released VMs are reset with
+ * rvm_reset() and handed out again, so a run costs the pages the
+ * previous one wrote rather than a new VM and a load of the image.
+ * Safe to use from several threads.
+ */
+typedef struct _pool {
+  Snapshot *image;
+
+  // Protects everything below
+  pthread_mutex_t lock;
+
+  // Idle VMs, ready to run
+  RVM **idle;
+  uint32_t num_idle;
+  uint32_t cap;
+
+  // VMs handed out, and how many of them had to be created
+  uint64_t acquired;
+  uint64_t created;
+
+  // Resets, and the 256-byte pages they restored
+  uint64_t resets;
+  uint64_t pages_restored;
+} Pool;
+
+/*
+ * Loads the image in filename and creates an empty pool for it.
+ */
+Pool *new_pool(uint8_t *filename);
+
+/*
+ * Frees a pool, its idle VMs and its snapshot. VMs still handed
+ * out must be freed with free_rvm().
+ */
+void free_pool(Pool *p);
+
+/*
+ * Returns an idle VM, or a new clone of the image if there is none,
+ * in the state the image was loaded in.
+ */
+RVM *pool_acquire(Pool *p);
+
+/*
+ * Resets rvm and keeps it for the next pool_acquire(). Returns the
+ * number of pages the reset restored.
+ */
+uint32_t pool_release(Pool *p, RVM *rvm);
@@ -0,0 +1,260 @@
+/*
+ * anewkirk
+ *
+ * The execution profiler behind reflectvm -P; see profile.h.
+ *
+ * Counting happens per instruction on the switch engine. Basic blocks
+ * are only worked out when the report is written: executed
+ * instructions that follow each other in memory, run equally often
+ * and are not separated by a jump, call, return or hlt belong to the
+ * same block.
+ */
+
+#include "profile.h"
+#include "bool.h"
+#include "disasm_backend.h"
+#include "icache.h"
+#include "image.h"
+#include "mem.h"
+#include "reflect.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Rows in each ranked section of the report
+#define HOT_BLOCKS 20
+#define HOT_BRANCHES 20
+
+// An address or number and how often it ran, for ranking
+typedef struct _rank {
+  uint64_t count;
+  uint32_t key;
+} Rank;
+
+typedef struct _block {
+  uint16_t start;
+  uint32_t insns;
+
+  // Executions of each instruction in the block, and their total
+  uint64_t entries;
+  uint64_t cost;
+} Block;
+
+Profile *new_profile(void) {
+  return calloc(1, sizeof(Profile));
+}
+
+void free_profile(Profile *p) {
+  free(p);
+}
+
+// Whether the conditional branch op, just executed, was taken
+static inline bool branch_taken(RVM *rvm, uint8_t op) {
+  switch(op) {
+  case 0x11:
+  case 0x14:
+    return rvm->z_flag;
+  case 0x12:
+  case 0x15:
+  case 0x2E:
+    return !rvm->z_flag;
+  case 0x2F:
+    return rvm->c_flag;
+  case 0x30:
+    return rvm->n_flag;
+  }
+  return false;
+}
+
+static bool is_branch(uint8_t op) {
+  switch(op) {
+  case 0x11:
+  case 0x12:
+  case 0x14:
+  case 0x15:
+  case 0x2E:
+  case 0x2F:
+  case 0x30:
+    return true;
+  }
+  return false;
+}
+
+// Whether execution may leave the instruction other than to the next
+static bool ends_block(uint8_t op) {
+  return op == 0x09 || (op >= 0x10 && op <= 0x18) || is_branch(op);
+}
+
+void run_profiled(RVM *rvm, Profile *p) {
+  rvm->r_flag = true;
+  while(rvm->r_flag) {
+    uint16_t pc = rvm->pc;
+    uint8_t op = vm_load(rvm, pc);
+    p->total++;
+    p->op[op]++;
+    p->pc[pc]++;
+    if(op == 0x20) {
+      p->sys[vm_load(rvm, pc + 2)]++;
+    }
+    fetch(rvm);
+    decode(rvm);
+    execute(rvm);
+    rvm->icount++;
+    p->taken[pc] += branch_taken(rvm, op);
+  }
+}
+
+static int by_count(const void *a, const void *b) {
+  const Rank *x = a, *y = b;
+  if(x->count != y->count) {
+    return x->count < y->count ? 1 : -1;
+  }
+  return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static int by_cost(const void *a, const void *b) {
+  const Block *x = a, *y = b;
+  if(x->cost != y->cost) {
+    return x->cost < y->cost ? 1 : -1;
+  }
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static double percent(uint64_t n, uint64_t total) {
+  return total ? 100.0 * n / total : 0;
+}
+
+// Disassembly of the instruction at addr, to be freed
+static char *insn_text(RVM *rvm, uint16_t addr) {
+  uint8_t b[4];
+  for(uint8_t i = 0; i < 4; i++) {
+    b[i] = vm_load(rvm, addr + i);
+  }
+  uint8_t adv = 0;
+  char *text = (char *)disassemble(b, &adv);
+  if(!text) {
+    text = malloc(8);
+    snprintf(text, 8, "db $%02X", b[0]);
+  }
+  return text;
+}
+
+static void report_opcodes(FILE *f, Profile *p, RVM *rvm) {
+  // An address each opcode ran at, to name it by
+  uint16_t where[0x100] = {0};
+  for(uint32_t a = 0; a < 0x10000; a++) {
+    if(p->pc[a]) {
+      where[vm_load(rvm, a)] = a;
+    }
+  }
+
+  Rank ops[0x100];
+  uint32_t n = 0;
+  for(uint32_t op = 0; op < 0x100; op++) {
+    if(p->op[op]) {
+      ops[n++] = (Rank){ p->op[op], op };
+    }
+  }
+  qsort(ops, n, sizeof(Rank), by_count);
+
+  fprintf(f, "\nopcode        executions       %%\n");
+  for(uint32_t i = 0; i < n; i++) {
+    char *text = insn_text(rvm, where[ops[i].key]);
+    // Just the mnemonic
+    uint32_t len = 0;
+    while(text[len] && text[len] != ' ') {
+      len++;
+    }
+    fprintf(f, "  $%02X %-6.*s %14" PRIu64 " %6.2f%%\n", ops[i].key, len,
+	    text, ops[i].count, percent(ops[i].count, p->total));
+    free(text);
+  }
+}
+
+static void report_sys(FILE *f, Profile *p) {
+  fprintf(f, "\nsys call           calls\n");
+  for(uint32_t s = 0; s < 0x100; s++) {
+    if(p->sys[s]) {
+      fprintf(f, "  $%02X    %14" PRIu64 "\n", s, p->sys[s]);
+    }
+  }
+}
+
+static void report_branches(FILE *f, Profile *p, RVM *rvm) {
+  Rank *br = malloc(0x10000 * sizeof(Rank));
+  uint32_t n = 0;
+  for(uint32_t a = 0; a < 0x10000; a++) {
+    if(p->pc[a] && is_branch(vm_load(rvm, a))) {
+      br[n++] = (Rank){ p->pc[a], a };
+    }
+  }
+  qsort(br, n, sizeof(Rank), by_count);
+
+  fprintf(f, "\nbranch                         taken    not taken\n");
+  for(uint32_t i = 0; i < n && i < HOT_BRANCHES; i++) {
+    uint16_t a = br[i].key;
+    char *text = insn_text(rvm, a);
+    fprintf(f, "  $%04X  %-18s %12" PRIu64 " %12" PRIu64 "\n", a, text,
+	    p->taken[a], p->pc[a] - p->taken[a]);
+    free(text);
+  }
+  free(br);
+}
+
+static void report_blocks(FILE *f, Profile *p, RVM *rvm, Image *img) {
+  Block *blocks = malloc(0x10000 * sizeof(Block));
+  uint32_t n = 0;
+  Block *open = NULL;
+  uint32_t next = 0;
+  uint8_t prev_op = 0;
+  uint64_t prev_count = 0;
+
+  for(uint32_t a = 0; a < 0x10000; a++) {
+    if(!p->pc[a]) {
+      continue;
+    }
+    uint8_t op = vm_load(rvm, a);
+    if(!open || a != next || ends_block(prev_op) || p->pc[a] != prev_count) {
+      open = &blocks[n++];
+      *open = (Block){ a, 0, p->pc[a], 0 };
+    }
+    open->insns++;
+    open->cost += p->pc[a];
+    next = a + insn_length(op);
+    prev_op = op;
+    prev_count = p->pc[a];
+  }
+  qsort(blocks, n, sizeof(Block), by_cost);
+
+  fprintf(f, "\nhot blocks\n");
+  for(uint32_t i = 0; i < n && i < HOT_BLOCKS; i++) {
+    Block *b = &blocks[i];
+    const char *name = img ? image_symbol(img, b->start) : NULL;
+    fprintf(f, "\n#%u  $%04X%s%s  entries %" PRIu64 "  instructions %"
+	    PRIu64 "  %.2f%%\n", i + 1, b->start, name ? " " : "",
+	    name ? name : "", b->entries, b->cost, percent(b->cost, p->total));
+    uint16_t a = b->start;
+    for(uint32_t k = 0; k < b->insns; k++) {
+      char *text = insn_text(rvm, a);
+      fprintf(f, "  $%04X  %s", a, text);
+      uint8_t op = vm_load(rvm, a);
+      if(is_branch(op)) {
+	fprintf(f, "    ; taken %" PRIu64 ", not taken %" PRIu64, p->taken[a],
+		p->pc[a] - p->taken[a]);
+      }
+      fprintf(f, "\n");
+      free(text);
+      a += insn_length(op);
+    }
+  }
+  free(blocks);
+}
+
+void profile_report(FILE *f, Profile *p, RVM *rvm, Image *img) {
+  fprintf(f, "instructions: %" PRIu64 "\n", p->total);
+  report_opcodes(f, p, rvm);
+  report_sys(f, p);
+  report_branches(f, p, rvm);
+  report_blocks(f, p, rvm, img);
+}
@@ -0,0 +1,45 @@
+/* anewkirk */
+
+#pragma once
+
+#include "image.h"
+#include "reflect.h"
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Execution counts gathered by run_profiled(). Everything is a fixed
+ * array, so counting an instruction is a few increments and nothing
+ * is allocated while the program runs.
+ */
+typedef struct _profile {
+  // Instructions retired
+  uint64_t total;
+
+  // Executions by opcode, and of the instruction at each address
+  uint64_t op[0x100];
+  uint64_t pc[0x10000];
+
+  // Times the conditional branch at each address was taken; the
+  // rest of its executions fell through
+  uint64_t taken[0x10000];
+
+  // Sys calls by number
+  uint64_t sys[0x100];
+} Profile;
+
+Profile *new_profile(void);
+void free_profile(Profile *p);
+
+/*
+ * The switch engine, counting every instruction into p as it runs.
+ */
+void run_profiled(RVM *rvm, Profile *p);
+
+/*
+ * Writes the report of p to f: the opcode, sys call and branch
+ * counts, then the hottest basic blocks by instructions retired,
+ * disassembled from rvm's memory as it is now. img, if not NULL,
+ * names the blocks that start at one of its symbols.
+ */
+void profile_report(FILE *f, Profile *p, RVM *rvm, Image *img);
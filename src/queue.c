@@ -40,6 +40,7 @@ Queue *new_queue() {
   q->front = NULL;
   q->back = NULL;
   q->size = 0;
+  return q;
 }
 
 void destroy_queue(Queue *q) {
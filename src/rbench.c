@@ -0,0 +1,659 @@
+/*
+ * anewkirk
+ *
+ * Benchmarks the engines, the disassembler and the debugger on
+ * per-opcode microbenchmarks and on the programs in reflect_bin, and
+ * compares the results with an earlier run's.
+ *
+ * Every measurement runs in a child process of its own, so its peak
+ * RSS is its own, and repeats its workload on fresh VMs until enough
+ * time has gone by to be worth dividing.
+ */
+
+#include "bool.h"
+#include "disasm_backend.h"
+#include "icache.h"
+#include "image.h"
+#include "io.h"
+#include "jit.h"
+#include "reflect.h"
+#include "threaded.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Copies of the unit between the loop's djnz, and trips round it
+#define MICRO_UNITS 64
+#define MICRO_OUTER 64
+
+// Result rows, and the longest workload and engine names
+#define MAX_RESULTS 512
+#define NAME_LEN 32
+
+typedef enum {
+  KIND_VM,
+  KIND_DISASM,
+  KIND_DEBUGGER
+} Kind;
+
+typedef struct _engine {
+  const char *name;
+  Kind kind;
+  void (*run)(RVM *);
+} Engine;
+
+static const Engine engines[] = {
+  { "switch", KIND_VM, run },
+  { "threaded", KIND_VM, run_threaded },
+  { "jit", KIND_VM, run_jit },
+  { "disasm", KIND_DISASM, NULL },
+  { "rdbg", KIND_DEBUGGER, NULL },
+};
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+/*
+ * A microbenchmark: a unit of one or a few instructions, repeated
+ * MICRO_UNITS times in a loop. When at is set, code[at] holds the
+ * big-endian address of the next unit, or with to_ret that of a ret.
+ */
+typedef struct _micro {
+  const char *name;
+  uint8_t code[8];
+  uint8_t len;
+  uint8_t insns;
+  uint8_t at;
+  bool to_ret;
+} Micro;
+
+static const Micro micros[] = {
+  { "00_nop", { 0x00, 0x00 }, 2, 1 },
+  { "01_mov_rr", { 0x01, 0x12 }, 2, 1 },
+  { "02_mov_ri", { 0x02, 0x10, 0x05 }, 3, 1 },
+  { "03_store", { 0x03, 0x01, 0x80, 0x00 }, 4, 1 },
+  { "04_load", { 0x04, 0x10, 0x80, 0x00 }, 4, 1 },
+  { "05_mov_pair", { 0x05, 0xCD, 0x80, 0x00 }, 4, 1 },
+  { "06_store_pi", { 0x06, 0x23, 0x55 }, 3, 1 },
+  { "07_store_pr", { 0x07, 0x23, 0x01 }, 3, 1 },
+  { "08_load_p", { 0x08, 0x23, 0x01 }, 3, 1 },
+  { "0A_add", { 0x0A, 0x12 }, 2, 1 },
+  { "0B_sub", { 0x0B, 0x12 }, 2, 1 },
+  { "0C_inc", { 0x0C, 0x10 }, 2, 1 },
+  { "0D_dec", { 0x0D, 0x10 }, 2, 1 },
+  { "0E_cmp", { 0x0E, 0x12 }, 2, 1 },
+  { "0F_cmp_ri", { 0x0F, 0x10, 0x05 }, 3, 1 },
+  { "10_jmp", { 0x10, 0x00 }, 4, 1, 2 },
+  { "11_jz", { 0x11, 0x00 }, 4, 1, 2 },
+  { "12_jnz", { 0x12, 0x00 }, 4, 1, 2 },
+  { "13_jmp_p", { 0x05, 0xCD, 0x00, 0x00, 0x13, 0xCD }, 6, 2, 2 },
+  { "16_call_ret", { 0x16, 0x00 }, 4, 2, 2, true },
+  { "17_call_p", { 0x05, 0xCD, 0x00, 0x00, 0x17, 0xCD }, 6, 3, 2, true },
+  { "19_push_pop", { 0x19, 0x01, 0x1A, 0x10 }, 4, 2 },
+  { "1B_push_i", { 0x1B, 0x00, 0x4A, 0x1A, 0x10 }, 5, 2 },
+  { "1C_and", { 0x1C, 0x12 }, 2, 1 },
+  { "1D_or", { 0x1D, 0x12 }, 2, 1 },
+  { "1E_xor", { 0x1E, 0x12 }, 2, 1 },
+  { "1F_mul", { 0x1F, 0x12 }, 2, 1 },
+  { "20_sys", { 0x20, 0x23, 0x0F }, 3, 1 },
+  { "21_div", { 0x21, 0x12 }, 2, 1 },
+  { "22_mul_ri", { 0x22, 0x10, 0x03 }, 3, 1 },
+  { "23_div_ri", { 0x23, 0x10, 0x03 }, 3, 1 },
+  { "24_mod", { 0x24, 0x12 }, 2, 1 },
+  { "25_mod_ri", { 0x25, 0x10, 0x03 }, 3, 1 },
+  { "26_add_pair", { 0x26, 0x45, 0x67 }, 3, 1 },
+  { "27_sub_pair", { 0x27, 0x45, 0x67 }, 3, 1 },
+  { "28_inc_pair", { 0x28, 0x45 }, 2, 1 },
+  { "29_dec_pair", { 0x29, 0x45 }, 2, 1 },
+  { "2A_cmp_pair", { 0x2A, 0x45, 0x67 }, 3, 1 },
+  { "2B_load_off", { 0x2B, 0x23, 0x01, 0x10 }, 4, 1 },
+  { "2C_load_inc", { 0x2C, 0x23, 0x01 }, 3, 1 },
+  { "2D_store_inc", { 0x05, 0x89, 0x80, 0x00, 0x2D, 0x89, 0x01 }, 7, 2 },
+  { "2E_djnz", { 0x2E, 0xC0 }, 4, 1, 2 },
+  { "2F_jc", { 0x2F, 0x00 }, 4, 1, 2 },
+  { "30_jn", { 0x30, 0x00 }, 4, 1, 2 },
+};
+#define NUM_MICROS (sizeof(micros) / sizeof(micros[0]))
+
+// A program of the corpus in reflect_bin, and the stdin it is given
+typedef struct _program {
+  const char *name;
+  const char *input;
+} Program;
+
+static const Program corpus[] = {
+  { "sieve", "" },
+  { "bubblesort", "" },
+  { "memcpy", "" },
+  { "reverse", "" },
+  { "hailstone", "27\n" },
+  { "fizzbuzz", "" },
+  { "echo", "The quick brown fox jumps over the lazy dog\n" },
+};
+#define NUM_CORPUS (sizeof(corpus) / sizeof(corpus[0]))
+
+typedef struct _workload {
+  char name[NAME_LEN];
+  // The image, and its file if it has one
+  uint8_t *data;
+  uint32_t size;
+  char *path;
+  const char *input;
+} Workload;
+
+// One row of the results file
+typedef struct _result {
+  char workload[NAME_LEN];
+  char engine[NAME_LEN];
+  uint64_t runs;
+  // Per run
+  uint64_t insns;
+  uint64_t ns;
+  uint64_t rss_kb;
+  // FNV-1a of the program's output, when hashed
+  bool hashed;
+  uint32_t hash;
+} Result;
+
+static uint64_t min_ns = 100000000;
+static const char *rdbg_path = "bin/rdbg";
+
+void print_usage() {
+  printf("Usage: rbench [-o results.txt] [-b baseline.txt] [-t percent]\n");
+  printf("              [-e engine,...] [-m ms] [-d dir] [-r rdbg]\n");
+  printf("       rbench -c baseline.txt results.txt [-t percent]\n");
+  printf("  -o  write the results to a file\n");
+  printf("  -b  compare the results with an earlier run's\n");
+  printf("  -t  slowdown that counts as a regression (default: 10)\n");
+  printf("  -e  engines to run, of switch, threaded, jit, disasm and rdbg\n");
+  printf("      (default: all)\n");
+  printf("  -m  least time spent on each measurement (default: 100)\n");
+  printf("  -d  directory of the corpus images (default: reflect_bin)\n");
+  printf("  -r  debugger to run the corpus under (default: bin/rdbg)\n");
+  printf("  -c  only compare two results files\n");
+}
+
+static uint64_t now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static double per_insn(const Result *r) {
+  return r->insns ? (double)r->ns / r->insns : 0;
+}
+
+/*
+ * A legacy image of the microbenchmark m: a prologue setting up the
+ * registers its units use, the units and the loop around them.
+ */
+static void build_micro(const Micro *m, Workload *w) {
+  static const uint8_t prologue[] = {
+    0x02, 0x10, 0x07,       // mov r1, $07
+    0x05, 0x23, 0x80, 0x00, // mov r2:r3, $8000
+    0x05, 0x45, 0x12, 0x34, // mov r4:r5, $1234
+    0x05, 0x67, 0x01, 0x01, // mov r6:r7, $0101
+    0x05, 0x89, 0x80, 0x00, // mov r8:r9, $8000
+    0x05, 0xEF, 0x00, 0x00, // mov rE:rF, $0000
+    0x02, 0xA0, 0x00,       // mov rA, $00
+    0x02, 0xB0, MICRO_OUTER // mov rB, MICRO_OUTER
+  };
+  uint32_t loop = sizeof(prologue);
+  uint32_t ret = loop + MICRO_UNITS * m->len + 10;
+
+  w->size = ret + 2;
+  w->data = calloc(1, w->size);
+  memcpy(w->data, prologue, loop);
+  uint8_t *p = w->data + loop;
+  for(uint32_t i = 0; i < MICRO_UNITS; i++) {
+    memcpy(p, m->code, m->len);
+    if(m->at) {
+      uint16_t to = m->to_ret ? ret : p + m->len - w->data;
+      p[m->at] = to >> 8;
+      p[m->at + 1] = to;
+    }
+    p += m->len;
+  }
+  uint8_t tail[] = {
+    0x2E, 0xA0, loop >> 8, loop, // djnz rA, loop
+    0x2E, 0xB0, loop >> 8, loop, // djnz rB, loop
+    0x09, 0x00,                  // hlt
+    0x18, 0x00                   // ret
+  };
+  memcpy(p, tail, sizeof(tail));
+
+  snprintf(w->name, NAME_LEN, "%s", m->name);
+  w->path = NULL;
+  w->input = "";
+}
+
+static bool read_program(const char *dir, const Program *prog, Workload *w) {
+  w->path = malloc(strlen(dir) + strlen(prog->name) + 6);
+  sprintf(w->path, "%s/%s.rvm", dir, prog->name);
+  FILE *f = fopen(w->path, "rb");
+  if(!f) {
+    printf("Failed to open file: %s\n", w->path);
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  w->size = ftell(f);
+  rewind(f);
+  w->data = malloc(w->size);
+  bool ok = fread(w->data, 1, w->size, f) == w->size;
+  fclose(f);
+  snprintf(w->name, NAME_LEN, "%s", prog->name);
+  w->input = prog->input;
+  return ok;
+}
+
+// Runs w on a VM with engine e until min_ns have been spent in it
+static void measure_vm(Workload *w, const Engine *e, Image *img, Result *r) {
+  uint64_t spent = 0;
+  do {
+    RVM *rvm = new_rvm();
+    image_load(img, rvm);
+    in_set_data(rvm->in, (const uint8_t *)w->input, strlen(w->input));
+    char *out = NULL;
+    size_t len = 0;
+    rvm->out->capture = open_memstream(&out, &len);
+
+    uint64_t start = now_ns();
+    e->run(rvm);
+    spent += now_ns() - start;
+
+    out_flush(rvm);
+    fclose(rvm->out->capture);
+    rvm->out->capture = NULL;
+    if(!r->runs) {
+      r->hash = image_hash(IMAGE_FNV_BASIS, (uint8_t *)out, len);
+      r->hashed = true;
+    }
+    free(out);
+    r->insns = rvm->icount;
+    r->runs++;
+    free_rvm(rvm);
+  } while(spent < min_ns);
+  r->ns = spent / r->runs;
+}
+
+// Disassembles the code of w from its start to its end, repeatedly
+static void measure_disasm(Workload *w, Image *img, Result *r) {
+  // The bytes a legacy image loads, or a container's first segment
+  const uint8_t *code = img->data;
+  uint32_t len = img->size;
+  if(img->header) {
+    const ImageSegment *seg = (const ImageSegment *)(img->header + 1);
+    code = img->data + seg->offset;
+    len = seg->len;
+  }
+  uint8_t *padded = calloc(1, len + 4);
+  memcpy(padded, code, len);
+
+  uint64_t spent = 0;
+  do {
+    uint64_t insns = 0;
+    uint64_t start = now_ns();
+    for(uint32_t at = 0; at < len; insns++) {
+      uint8_t n = 0;
+      uint8_t *text = disassemble(padded + at, &n);
+      if(!text) {
+	n = 1;
+      }
+      free(text);
+      at += n;
+    }
+    spent += now_ns() - start;
+    r->insns = insns;
+    r->runs++;
+  } while(spent < min_ns);
+  r->ns = spent / r->runs;
+  free(padded);
+}
+
+/*
+ * Runs w under the debugger with a continue, repeatedly, and takes
+ * the instruction count from a run on the threaded engine.
+ */
+static void measure_debugger(Workload *w, Image *img, Result *r) {
+  RVM *rvm = new_rvm();
+  image_load(img, rvm);
+  in_set_data(rvm->in, (const uint8_t *)w->input, strlen(w->input));
+  rvm->out->capture = fopen("/dev/null", "w");
+  run_threaded(rvm);
+  out_flush(rvm);
+  fclose(rvm->out->capture);
+  rvm->out->capture = NULL;
+  uint64_t insns = rvm->icount;
+  free_rvm(rvm);
+
+  // The debugger's commands and the program's input share stdin
+  FILE *in = tmpfile();
+  fprintf(in, "c\n%s", w->input);
+  fflush(in);
+
+  uint64_t spent = 0;
+  do {
+    lseek(fileno(in), 0, SEEK_SET);
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if(!pid) {
+      int null = open("/dev/null", O_WRONLY);
+      dup2(fileno(in), 0);
+      dup2(null, 1);
+      dup2(null, 2);
+      execl(rdbg_path, rdbg_path, w->path, (char *)NULL);
+      _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    wait4(pid, &status, 0, &ru);
+    spent += now_ns() - start;
+    if(!WIFEXITED(status) || WEXITSTATUS(status)) {
+      printf("%s failed on %s\n", rdbg_path, w->path);
+      exit(1);
+    }
+    if((uint64_t)ru.ru_maxrss > r->rss_kb) {
+      r->rss_kb = ru.ru_maxrss;
+    }
+    r->runs++;
+  } while(spent < min_ns);
+  fclose(in);
+  r->insns = insns;
+  r->ns = spent / r->runs;
+}
+
+// Measures w on engine e in a child process
+static void measure(Workload *w, const Engine *e, Result *r) {
+  memset(r, 0, sizeof(Result));
+  snprintf(r->workload, NAME_LEN, "%s", w->name);
+  snprintf(r->engine, NAME_LEN, "%s", e->name);
+
+  int fds[2];
+  if(pipe(fds)) {
+    printf("Failed to create a pipe\n");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if(!pid) {
+    close(fds[0]);
+    const char *err = NULL;
+    Image *img = image_from_buffer(w->data, w->size, &err);
+    if(!img) {
+      printf("%s: %s\n", w->name, err);
+      _exit(1);
+    }
+    switch(e->kind) {
+    case KIND_VM:
+      measure_vm(w, e, img, r);
+      break;
+    case KIND_DISASM:
+      measure_disasm(w, img, r);
+      break;
+    case KIND_DEBUGGER:
+      measure_debugger(w, img, r);
+      break;
+    }
+    close_image(img);
+    write(fds[1], r, sizeof(Result));
+    _exit(0);
+  }
+  close(fds[1]);
+  bool ok = read(fds[0], r, sizeof(Result)) == sizeof(Result);
+  close(fds[0]);
+  int status;
+  struct rusage ru;
+  wait4(pid, &status, 0, &ru);
+  if(!ok || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    printf("Benchmark %s failed on %s\n", w->name, e->name);
+    exit(1);
+  }
+  // The debugger's own processes are what it measured
+  if(e->kind != KIND_DEBUGGER) {
+    r->rss_kb = ru.ru_maxrss;
+  }
+}
+
+static void print_result(const Result *r) {
+  double ns = per_insn(r);
+  printf("%-16s %-9s %12" PRIu64 " %9.2f %10.1f %8" PRIu64 "\n", r->workload,
+	 r->engine, r->insns, ns, ns ? 1000 / ns : 0, r->rss_kb);
+}
+
+static void write_results(const char *path, Result *results, uint32_t n) {
+  FILE *f = fopen(path, "w");
+  if(!f) {
+    printf("Failed to open file: %s\n", path);
+    exit(1);
+  }
+  fprintf(f, "# workload\tengine\truns\tinstructions\tns\tns_per_insn"
+	  "\tmips\tmax_rss_kb\toutput_hash\n");
+  for(uint32_t i = 0; i < n; i++) {
+    Result *r = &results[i];
+    double ns = per_insn(r);
+    fprintf(f, "%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%.4f\t%.2f\t%"
+	    PRIu64 "\t", r->workload, r->engine, r->runs, r->insns, r->ns, ns,
+	    ns ? 1000 / ns : 0, r->rss_kb);
+    if(r->hashed) {
+      fprintf(f, "%08x\n", r->hash);
+    } else {
+      fprintf(f, "-\n");
+    }
+  }
+  fclose(f);
+}
+
+static Result *read_results(const char *path, uint32_t *n) {
+  FILE *f = fopen(path, "r");
+  if(!f) {
+    printf("Failed to open file: %s\n", path);
+    exit(1);
+  }
+  Result *results = calloc(MAX_RESULTS, sizeof(Result));
+  *n = 0;
+  char *line = NULL;
+  size_t len = 0;
+  while(getline(&line, &len, f) != -1 && *n < MAX_RESULTS) {
+    if(line[0] == '#') {
+      continue;
+    }
+    Result *r = &results[*n];
+    char hash[16];
+    double ns, mips;
+    if(sscanf(line, "%31s %31s %" SCNu64 " %" SCNu64 " %" SCNu64 " %lf %lf %"
+	      SCNu64 " %15s", r->workload, r->engine, &r->runs, &r->insns,
+	      &r->ns, &ns, &mips, &r->rss_kb, hash) != 9) {
+      printf("Not a results file: %s\n", path);
+      exit(1);
+    }
+    r->hashed = strcmp(hash, "-");
+    r->hash = strtoul(hash, NULL, 16);
+    (*n)++;
+  }
+  free(line);
+  fclose(f);
+  return results;
+}
+
+/*
+ * Prints each result beside the baseline's for the same workload and
+ * engine, flagging ns per instruction or peak RSS more than threshold
+ * percent above it and output that differs. Returns the number
+ * flagged.
+ */
+static uint32_t compare(Result *base, uint32_t nbase, Result *results,
+			uint32_t n, double threshold) {
+  uint32_t flagged = 0;
+  printf("\n%-16s %-9s %9s %9s %8s %8s %8s\n", "workload", "engine",
+	 "ns/insn", "was", "change", "rss kb", "change");
+  for(uint32_t i = 0; i < n; i++) {
+    Result *r = &results[i];
+    Result *b = NULL;
+    for(uint32_t j = 0; j < nbase && !b; j++) {
+      if(!strcmp(base[j].workload, r->workload) &&
+	 !strcmp(base[j].engine, r->engine)) {
+	b = &base[j];
+      }
+    }
+    if(!b) {
+      continue;
+    }
+    double was = per_insn(b);
+    double time = was ? (per_insn(r) / was - 1) * 100 : 0;
+    double rss = b->rss_kb ? ((double)r->rss_kb / b->rss_kb - 1) * 100 : 0;
+    printf("%-16s %-9s %9.2f %9.2f %+7.1f%% %8" PRIu64 " %+7.1f%%",
+	   r->workload, r->engine, per_insn(r), was, time, r->rss_kb, rss);
+    if(time > threshold) {
+      printf("  SLOWER");
+    }
+    if(rss > threshold) {
+      printf("  LARGER");
+    }
+    bool differs = r->hashed && b->hashed &&
+      (r->hash != b->hash || r->insns != b->insns);
+    if(differs) {
+      printf("  OUTPUT DIFFERS");
+    }
+    printf("\n");
+    flagged += time > threshold || rss > threshold || differs;
+  }
+  printf("\n%u regression%s above %.1f%%\n", flagged, flagged == 1 ? "" : "s",
+	 threshold);
+  return flagged;
+}
+
+// Whether engine is in the comma separated list, or there is none
+static bool selected(const char *list, const char *engine) {
+  if(!list) {
+    return true;
+  }
+  size_t len = strlen(engine);
+  for(const char *p = list; p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL) {
+    if(!strncmp(p, engine, len) && (p[len] == ',' || !p[len])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+  const char *out = NULL;
+  const char *baseline = NULL;
+  const char *list = NULL;
+  const char *dir = "reflect_bin";
+  bool only_compare = false;
+  double threshold = 10;
+  int opt;
+
+  while((opt = getopt(argc, argv, "o:b:t:e:m:d:r:c")) != -1) {
+    switch(opt) {
+    case 'o':
+      out = optarg;
+      break;
+    case 'b':
+      baseline = optarg;
+      break;
+    case 't':
+      threshold = atof(optarg);
+      break;
+    case 'e':
+      list = optarg;
+      break;
+    case 'm':
+      min_ns = strtoull(optarg, NULL, 10) * 1000000;
+      break;
+    case 'd':
+      dir = optarg;
+      break;
+    case 'r':
+      rdbg_path = optarg;
+      break;
+    case 'c':
+      only_compare = true;
+      break;
+    default:
+      print_usage();
+      exit(1);
+    }
+  }
+
+  if(only_compare) {
+    if(optind != argc - 2) {
+      print_usage();
+      exit(1);
+    }
+    uint32_t nbase, n;
+    Result *base = read_results(argv[optind], &nbase);
+    Result *results = read_results(argv[optind + 1], &n);
+    return compare(base, nbase, results, n, threshold) ? 1 : 0;
+  }
+  if(optind != argc) {
+    print_usage();
+    exit(1);
+  }
+  // Every name in the list must be an engine
+  for(const char *p = list; p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL) {
+    size_t len = strcspn(p, ",");
+    bool known = false;
+    for(uint32_t e = 0; e < NUM_ENGINES; e++) {
+      known |= strlen(engines[e].name) == len &&
+	!strncmp(p, engines[e].name, len);
+    }
+    if(!known) {
+      printf("Unknown engine: %.*s\n", (int)len, p);
+      exit(1);
+    }
+  }
+
+  uint32_t nwork = NUM_MICROS + NUM_CORPUS;
+  Workload *work = calloc(nwork, sizeof(Workload));
+  for(uint32_t i = 0; i < NUM_MICROS; i++) {
+    build_micro(&micros[i], &work[i]);
+  }
+  for(uint32_t i = 0; i < NUM_CORPUS; i++) {
+    if(!read_program(dir, &corpus[i], &work[NUM_MICROS + i])) {
+      printf("Failed to read file: %s\n", work[NUM_MICROS + i].path);
+      exit(1);
+    }
+  }
+
+  Result *results = calloc(MAX_RESULTS, sizeof(Result));
+  uint32_t n = 0;
+  printf("%-16s %-9s %12s %9s %10s %8s\n", "workload", "engine",
+	 "instructions", "ns/insn", "MIPS", "rss kb");
+  for(uint32_t i = 0; i < nwork; i++) {
+    for(uint32_t e = 0; e < NUM_ENGINES; e++) {
+      const Engine *eng = &engines[e];
+      // Microbenchmarks are for the engines, and have no file
+      if(!selected(list, eng->name) || (!work[i].path && eng->kind != KIND_VM)) {
+	continue;
+      }
+      measure(&work[i], eng, &results[n]);
+      print_result(&results[n++]);
+    }
+  }
+
+  if(out) {
+    write_results(out, results, n);
+  }
+  uint32_t flagged = 0;
+  if(baseline) {
+    uint32_t nbase;
+    Result *base = read_results(baseline, &nbase);
+    flagged = compare(base, nbase, results, n, threshold);
+    free(base);
+  }
+
+  for(uint32_t i = 0; i < nwork; i++) {
+    free(work[i].data);
+    free(work[i].path);
+  }
+  free(work);
+  free(results);
+  return flagged ? 1 : 0;
+}
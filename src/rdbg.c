@@ -8,6 +8,11 @@
 #include "rdbg.h"
 #include "bool.h"
 #include "reflect.h"
+#include "icache.h"
+#include "io.h"
+#include "mem.h"
+#include "threaded.h"
+#include "watch.h"
 #include "disasm_backend.h"
 #include <stdio.h>
 #include <string.h>
@@ -16,11 +21,17 @@
 
 #define VERSION 0.2
 
-Breakpoint *head = NULL;
+// Watchpoints and breakpoint conditions
+Watches *watches = NULL;
 
 int main(int argc, char *argv[]) {
   RVM *rvm = new_rvm();
+  // Keep program output in step with the debugger's own
+  rvm->out->mode = OUT_NONE;
+  // Commands and program input share stdin
+  rvm->in->shared = true;
   load_code(rvm, argv[1]);
+  watches = new_watches();
   print_startup();
 
   for(;;) {
@@ -95,6 +106,36 @@ Command read_command() {
       free(line);
       return RBREAK;
     }
+
+    o = strcmp(line, "bc\n");
+    if(!o) {
+      free(line);
+      return ICOND;
+    }
+
+    o = strcmp(line, "wm\n");
+    if(!o) {
+      free(line);
+      return WMEM;
+    }
+
+    o = strcmp(line, "wg\n");
+    if(!o) {
+      free(line);
+      return WREG;
+    }
+
+    o = strcmp(line, "lw\n");
+    if(!o) {
+      free(line);
+      return LWATCH;
+    }
+
+    o = strcmp(line, "dw\n");
+    if(!o) {
+      free(line);
+      return DWATCH;
+    }
   }
   if(strlen(line) == 2) {
     o = strcmp(line, "s\n");
@@ -117,14 +158,17 @@ void run_command(RVM *rvm, Command c) {
   case STEP:{
 
     uint8_t b[4];
-    b[0] = rvm->mem[rvm->pc];
-    b[1] = rvm->mem[rvm->pc + 1];
-    b[2] = rvm->pc <= 0xFFFD ? rvm->mem[rvm->pc + 2] : 0x00;
-    b[3] = rvm->pc <= 0xFFFC ? rvm->mem[rvm->pc + 3] : 0x00;
+    b[0] = vm_load(rvm, rvm->pc);
+    b[1] = vm_load(rvm, rvm->pc + 1);
+    b[2] = rvm->pc <= 0xFFFD ? vm_load(rvm, rvm->pc + 2) : 0x00;
+    b[3] = rvm->pc <= 0xFFFC ? vm_load(rvm, rvm->pc + 3) : 0x00;
     uint8_t bytes_advanced = 0;
     uint8_t *disassembly = disassemble(b, &bytes_advanced);
     printf("%s\n", disassembly);
     free(disassembly);
+    if(b[0] == 0x20 && b[2] >= 0x0B && b[2] <= 0x0F) {
+      print_bulk(rvm, b);
+    }
     
     fetch(rvm);
     decode(rvm);
@@ -133,53 +177,138 @@ void run_command(RVM *rvm, Command c) {
     break;
   }
   case CONTINUE:
-    if(is_breakpoint(rvm->pc)) {
+    // Step off a breakpoint, and stop at once on the next
+    if(is_breakpoint(rvm, rvm->pc)) {
       run_command(rvm, STEP);
+      if(is_breakpoint(rvm, rvm->pc) && cond_holds(watches, rvm, rvm->pc)) {
+	break;
+      }
+    }
+    // Watchpoints need the instrumented engine
+    if(watches_active(watches)) {
+      print_watch_exit(rvm, run_watched(rvm, watches));
+      break;
     }
-    while(!is_breakpoint(rvm->pc) && rvm->opcode != 0x09) {
-      fetch(rvm);
-      decode(rvm);
-      execute(rvm);
+    // On the threaded engine, which stops on the breakpoint bitmap
+    for(;;) {
+      RunExit why = run_for(rvm, UINT64_MAX);
+      if(why == RUN_ILLEGAL) {
+	run_report_illegal(rvm);
+	run_skip_illegal(rvm);
+	continue;
+      }
+      if(why != RUN_BREAK || cond_holds(watches, rvm, rvm->pc)) {
+	break;
+      }
     }
     printf("\n");
     break;
   case IBREAK:
-    add_breakpoint(rvm->pc);
+    add_breakpoint(rvm, rvm->pc);
     break;
   case IBREAKADDR: {
-    uint16_t addr = read_address();
-    add_breakpoint(addr);
+    uint16_t addr;
+    if(read_address(&addr)) {
+      add_breakpoint(rvm, addr);
+    }
     break;
   }
-  case LBREAK: {
-    Breakpoint *current = head;
-    while(current) {
-      printf("[+] 0x%04x\n", current->addr);
-      current = current->next;
+  case LBREAK:
+    for(uint32_t addr = 0; addr < 0x10000; addr++) {
+      if(!is_breakpoint(rvm, addr)) {
+	continue;
+      }
+      printf("[+] 0x%04x\n", addr);
+      for(uint32_t i = 0; i < watches->num_conds; i++) {
+	if(watches->conds[i].addr == addr) {
+	  printf("    if %s\n", watches->conds[i].text);
+	}
+      }
     }
     break;
-  }
   case RBREAK: {
-    uint16_t addr = read_address();
-    Breakpoint *current = head;
-    Breakpoint *previous = NULL;
-    while(current) {
-      if(current->addr == addr) {
-	if(previous) {
-	  previous->next = current->next;
-	}
-	if(head == current) {
-	  head = current->next;
-	}
+    uint16_t addr;
+    if(read_address(&addr)) {
+      icache_clear_break(rvm, addr);
+      clear_conds(watches, addr);
+    }
+    break;
+  }
+  case ICOND: {
+    Cond cond;
+    if(!read_address(&cond.addr)) {
+      break;
+    }
+    char *line = read_line("Enter condition (e.g. r2 == $01):");
+    if(parse_cond(line, &cond)) {
+      // A breakpoint already there now stops only on its conditions
+      icache_set_break(rvm, cond.addr);
+      add_cond(watches, &cond);
+    } else {
+      printf("[-] Unrecognized condition.\n");
+    }
+    free(line);
+    break;
+  }
+  case WMEM: {
+    uint16_t addr;
+    if(!read_address(&addr)) {
+      break;
+    }
+    char *line = read_line("Enter length:");
+    uint32_t len = 0;
+    sscanf(line, "0x%x", &len);
+    free(line);
+    line = read_line("Enter r, w or rw:");
+    uint8_t kinds = (strchr(line, 'r') ? WATCH_READ : 0) |
+      (strchr(line, 'w') ? WATCH_WRITE : 0);
+    free(line);
+    if(!len || !kinds) {
+      printf("[-] Unrecognized watchpoint.\n");
+      break;
+    }
+    watch_mem(watches, addr, len, kinds);
+    break;
+  }
+  case WREG: {
+    char *line = read_line("Enter register:");
+    unsigned int r;
+    if(sscanf(line, "r%x", &r) == 1 && r < 0x10) {
+      watches->regs |= 1 << r;
+    } else {
+      printf("[-] Unrecognized register.\n");
+    }
+    free(line);
+    break;
+  }
+  case LWATCH:
+    for(uint32_t i = 0; i < watches->num_mem; i++) {
+      MemWatch *m = &watches->mem[i];
+      printf("[+] %u: 0x%04x, 0x%x bytes, %s%s\n", i, m->addr, m->len,
+	     m->kinds & WATCH_READ ? "r" : "", m->kinds & WATCH_WRITE ? "w" : "");
+    }
+    for(uint8_t r = 0; r < 0x10; r++) {
+      if(watches->regs & 1 << r) {
+	printf("[+] r%x\n", r);
       }
-      previous = current;
-      current = current->next;
     }
     break;
+  case DWATCH: {
+    char *line = read_line("Enter watchpoint number or register:");
+    unsigned int i;
+    if(sscanf(line, "r%x", &i) == 1 && i < 0x10) {
+      watches->regs &= ~(1 << i);
+    } else if(sscanf(line, "%u", &i) == 1) {
+      unwatch_mem(watches, i);
+    }
+    free(line);
+    break;
   }
   case PMEM: {
-    uint16_t addr = read_address();
-    printf("0x%02X\n", addr, rvm->mem[addr]);
+    uint16_t addr;
+    if(read_address(&addr)) {
+      printf("0x%04X: 0x%02X\n", addr, vm_load(rvm, addr));
+    }
     break;
   }
   case PREG:
@@ -209,8 +338,13 @@ void print_help() {
   printf("[+] ba: insert breakpoint at address\n");
   printf("[+] lb: list breakpoints\n");
   printf("[+] rb: remove breakpoint at address\n");
+  printf("[+] bc: insert breakpoint at address with a condition\n");
+  printf("[+] wm: watch memory for reads or writes\n");
+  printf("[+] wg: watch a register for changes\n");
+  printf("[+] lw: list watchpoints\n");
+  printf("[+] dw: delete watchpoint\n");
   printf("[+] pm: print value at memory address\n");
-  printf("[+] pr: print register values\n");
+  printf("[+] pr: print register and flag values\n");
   printf("[+] help: display this help menu\n");
   printf("[+] exit: halt VM and exit debugger\n");
 }
@@ -219,44 +353,69 @@ void print_registers(RVM *rvm) {
   for(uint8_t i = 0; i < 16; i++) {
     printf("r%x: 0x%02x\n", i, rvm->reg[i]);
   }
+  printf("z: %d c: %d n: %d\n", rvm->z_flag, rvm->c_flag, rvm->n_flag);
+}
+
+void print_bulk(RVM *rvm, uint8_t *b) {
+  uint8_t *r = rvm->reg;
+  printf("[rx:ry] 0x%04x, [rC:rD] 0x%04x, rD 0x%02x, n 0x%04x\n",
+	 r[b[1] >> 4] << 8 | r[b[1] & 0xF], r[0xC] << 8 | r[0xD], r[0xD],
+	 r[0xE] << 8 | r[0xF]);
 }
 
-uint16_t read_address() {
+bool read_address(uint16_t *addr) {
   printf("Enter address:\n");
   
   char *line = NULL;
   size_t n = 0;
   getline(&line, &n, stdin);
 
-  uint16_t addr;
+  unsigned int a = 0x10000;
+  sscanf(line, "0x%x\n", &a);
+  free(line);
+  if(a > 0xFFFF) {
+    printf("[-] Unrecognized address.\n");
+    return false;
+  }
+  *addr = a;
+  return true;
+}
+
+char *read_line(const char *prompt) {
+  printf("%s\n", prompt);
 
-  sscanf(line, "0x%x\n", &addr);
-  return addr;
+  char *line = NULL;
+  size_t n = 0;
+  if(getline(&line, &n, stdin) == -1) {
+    line[0] = 0;
+  }
+  return line;
 }
 
-void add_breakpoint(uint16_t bp) {
-  Breakpoint *n = malloc(sizeof(Breakpoint));
-  n->addr = bp;
-  n->next = NULL;
-  Breakpoint *current = head;
-  if(current) {
-    while(current->next) {
-      current = current->next;
-    }
-    current->next = n;
-  } else {
-    head = n;
+void print_watch_exit(RVM *rvm, WatchExit why) {
+  switch(why) {
+  case WATCH_MEM:
+    printf("\n[!] Watchpoint %u: %s of 0x%04x\n", watches->hit,
+	   watches->hit_kind == WATCH_READ ? "read" : "write",
+	   watches->hit_addr);
+    printf("    0x%04x is now 0x%02x\n", watches->hit_addr,
+	   vm_load(rvm, watches->hit_addr));
+    break;
+  case WATCH_REG:
+    printf("\n[!] r%x changed from 0x%02x to 0x%02x\n", watches->hit_reg,
+	   watches->hit_was, rvm->reg[watches->hit_reg]);
+    break;
+  default:
+    printf("\n");
   }
+}
 
+void add_breakpoint(RVM *rvm, uint16_t bp) {
+  // Plain breakpoints stop whatever the conditions were
+  clear_conds(watches, bp);
+  icache_set_break(rvm, bp);
 }
 
-bool is_breakpoint(uint16_t bp) {
-  Breakpoint *current = head;
-  while(current) {
-    if(current->addr == bp) {
-      return true;
-    }
-    current = current->next;
-  }
-  return false;
+bool is_breakpoint(RVM *rvm, uint16_t bp) {
+  return rvm->breaks && rvm->breaks[bp >> 3] & 1 << (bp & 7);
 }
@@ -3,6 +3,7 @@
 #pragma once
 
 #include "reflect.h"
+#include "watch.h"
 #include <stdint.h>
 
 typedef enum _command {
@@ -16,6 +17,16 @@ typedef enum _command {
   LBREAK,
   //Remove breakpoint
   RBREAK,
+  //Insert breakpoint with a condition at specified address
+  ICOND,
+  //Watch memory for reads or writes
+  WMEM,
+  //Watch a register for changes
+  WREG,
+  //List watchpoints
+  LWATCH,
+  //Delete watchpoint
+  DWATCH,
   //Print memory
   PMEM,
   //Print registers
@@ -25,11 +36,6 @@ typedef enum _command {
   UNKNOWN
 } Command;
 
-typedef struct _breakpoint {
-  struct _breakpoint *next;
-  uint16_t addr;
-} Breakpoint;
-
 void print_startup();
 
 void print_prompt(RVM *rvm);
@@ -44,8 +50,19 @@ void print_registers(RVM *rvm);
 
 void print_memory();
 
-uint16_t read_address();
+// Operands of the bulk memory sys call in bytes b, before it runs
+void print_bulk(RVM *rvm, uint8_t *b);
+
+// Reads an address as 0x1234 into addr, or says why it cannot
+bool read_address(uint16_t *addr);
+
+// Prints prompt and returns the line typed, which the caller frees
+char *read_line(const char *prompt);
+
+// Reports what stopped a run on the watchpoint engine
+void print_watch_exit(RVM *rvm, WatchExit why);
 
-void add_breakpoint(uint16_t bp);
+// Breakpoints are kept in the VM's bitmap (see icache_set_break())
+void add_breakpoint(RVM *rvm, uint16_t bp);
 
-bool is_breakpoint(uint16_t bp);
+bool is_breakpoint(RVM *rvm, uint16_t bp);
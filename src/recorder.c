@@ -0,0 +1,260 @@
+/*
+ * anewkirk
+ *
+ * The execution trace recorder behind reflectvm -r; see recorder.h.
+ */
+
+#include "recorder.h"
+#include "access.h"
+#include "bool.h"
+#include "icache.h"
+#include "mem.h"
+#include "reflect.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The longest record without its memory ranges: kinds, pc, an
+// instruction, every register, sp, flags and the range count
+#define REC_MAX (1 + 2 + 4 + 2 + 0x10 + 2 + 1 + 1)
+
+// A gap record
+#define GAP_LEN (1 + 8)
+
+// The writer waits for this much before writing, unless done
+#define WRITE_CHUNK (1 << 20)
+
+static void *writer_main(void *arg) {
+  Recorder *r = arg;
+  for(;;) {
+    // Anything put in before done was set is in head once it is seen
+    bool done = __atomic_load_n(&r->done, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if(head - r->tail < (done ? 1 : WRITE_CHUNK)) {
+      if(done) {
+	break;
+      }
+      struct timespec t = { 0, 1000000 };
+      nanosleep(&t, NULL);
+      continue;
+    }
+    // Up to the end of the ring, then around on the next pass
+    uint64_t at = r->tail & (r->size - 1);
+    uint64_t n = head - r->tail;
+    if(n > r->size - at) {
+      n = r->size - at;
+    }
+    fwrite(r->ring + at, 1, n, r->f);
+    __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+// Copies n bytes to the ring at *at, which wraps
+static inline void put(Recorder *r, uint64_t *at, const uint8_t *p,
+		       uint32_t n) {
+  uint64_t i = *at & (r->size - 1);
+  if(i + n <= r->size) {
+    memcpy(r->ring + i, p, n);
+  } else {
+    uint64_t first = r->size - i;
+    memcpy(r->ring + i, p, first);
+    memcpy(r->ring, p + first, n - first);
+  }
+  *at += n;
+}
+
+Recorder *open_recorder(const char *filename, uint64_t size) {
+  Recorder *r = calloc(1, sizeof(Recorder));
+  r->f = fopen(filename, "wb");
+  if(!r->f) {
+    printf("Failed to open file: %s\n", filename);
+    exit(1);
+  }
+  RecordHeader h = { RECORD_MAGIC, RECORD_VERSION, 0 };
+  fwrite(&h, sizeof(h), 1, r->f);
+
+  r->ring = malloc(size);
+  r->size = size;
+  r->key = true;
+  pthread_create(&r->writer, NULL, writer_main, r);
+  return r;
+}
+
+void close_recorder(Recorder *r) {
+  // Account for the records dropped last, waiting for room if need be
+  if(r->dropped) {
+    while(r->size - (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+	  < GAP_LEN) {
+      struct timespec t = { 0, 1000000 };
+      nanosleep(&t, NULL);
+    }
+    uint8_t gap[GAP_LEN] = { REC_GAP };
+    memcpy(gap + 1, &r->dropped, 8);
+    uint64_t head = r->head;
+    put(r, &head, gap, GAP_LEN);
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&r->done, true, __ATOMIC_RELEASE);
+  pthread_join(r->writer, NULL);
+  fclose(r->f);
+  free(r->ring);
+  free(r);
+}
+
+// As put(), for len bytes of VM memory at addr
+static void put_mem(Recorder *r, uint64_t *at, RVM *rvm, uint16_t addr,
+		    uint32_t len) {
+  uint64_t i = *at & (r->size - 1);
+  if(i + len <= r->size) {
+    vm_read(rvm, addr, r->ring + i, len);
+  } else {
+    uint64_t first = r->size - i;
+    vm_read(rvm, addr, r->ring + i, first);
+    vm_read(rvm, addr + first, r->ring, len - first);
+  }
+  *at += len;
+}
+
+// Opcodes that may write memory
+static const bool stores[0x100] = {
+  [0x03] = true,
+  [0x06] = true,
+  [0x07] = true,
+  [0x16] = true,
+  [0x17] = true,
+  [0x19] = true,
+  [0x1B] = true,
+  [0x20] = true,
+  [0x2D] = true,
+};
+
+static inline uint8_t flags(RVM *rvm) {
+  return rvm->z_flag | rvm->c_flag << 1 | rvm->n_flag << 2;
+}
+
+// Records the instruction b of length n at pc, just executed
+static void record(Recorder *r, RVM *rvm, uint16_t pc, uint8_t *b,
+		   uint8_t n, uint32_t ranges, uint16_t *at, uint32_t *len) {
+  uint64_t need = REC_MAX + GAP_LEN;
+  for(uint32_t i = 0; i < ranges; i++) {
+    need += 4 + len[i];
+  }
+  // The writer's progress is only looked up again when short of room
+  if(r->size - (r->head - r->tail_seen) < need) {
+    r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if(r->size - (r->head - r->tail_seen) < need) {
+      r->dropped++;
+      r->key = true;
+      return;
+    }
+  }
+
+  // Built in place, unless it could run past the end of the ring
+  uint8_t buf[REC_MAX + GAP_LEN];
+  uint64_t i = r->head & (r->size - 1);
+  bool direct = i + sizeof(buf) <= r->size;
+  uint8_t *rec = direct ? r->ring + i : buf;
+
+  uint32_t k = 0;
+  if(r->dropped) {
+    rec[k++] = REC_GAP;
+    memcpy(rec + k, &r->dropped, 8);
+    k += 8;
+    r->dropped = 0;
+  }
+
+  uint32_t kinds_at = k++;
+  uint8_t kinds = (n - 1) << 6;
+  if(r->key || pc != r->next_pc) {
+    kinds |= REC_PC;
+    memcpy(rec + k, &pc, 2);
+    k += 2;
+  }
+  memcpy(rec + k, b, 4);
+  k += n;
+
+  uint64_t now[2], was[2];
+  memcpy(now, rvm->reg, 0x10);
+  memcpy(was, r->reg, 0x10);
+  uint64_t diff[2] = { now[0] ^ was[0], now[1] ^ was[1] };
+  if(r->key) {
+    diff[0] = diff[1] = ~0ull;
+  }
+  if(diff[0] | diff[1]) {
+    uint16_t mask = 0;
+    uint32_t mask_at = k;
+    k += 2;
+    for(uint32_t h = 0; h < 2; h++) {
+      // Only the bytes that differ
+      while(diff[h]) {
+	uint32_t reg = h * 8 + __builtin_ctzll(diff[h]) / 8;
+	mask |= 1 << reg;
+	rec[k++] = rvm->reg[reg];
+	diff[h] &= ~(0xFFull << (reg % 8 * 8));
+      }
+    }
+    memcpy(rec + mask_at, &mask, 2);
+    memcpy(r->reg, now, 0x10);
+    kinds |= REC_REGS;
+  }
+  if(r->key || rvm->sp != r->sp) {
+    kinds |= REC_SP;
+    memcpy(rec + k, &rvm->sp, 2);
+    k += 2;
+    r->sp = rvm->sp;
+  }
+  uint8_t f = flags(rvm);
+  if(r->key || f != r->flags) {
+    kinds |= REC_FLAGS;
+    rec[k++] = f;
+    r->flags = f;
+  }
+  if(ranges) {
+    kinds |= REC_MEM;
+    rec[k++] = ranges;
+  }
+  rec[kinds_at] = kinds;
+
+  uint64_t head = r->head;
+  if(direct) {
+    head += k;
+  } else {
+    put(r, &head, rec, k);
+  }
+  for(uint32_t i = 0; i < ranges; i++) {
+    uint16_t l = len[i];
+    put(r, &head, (uint8_t *)&at[i], 2);
+    put(r, &head, (uint8_t *)&l, 2);
+    put_mem(r, &head, rvm, at[i], len[i]);
+  }
+  __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+
+  r->next_pc = pc + n;
+  r->key = false;
+}
+
+void run_recorded(RVM *rvm, Recorder *r) {
+  rvm->r_flag = true;
+  while(rvm->r_flag) {
+    uint16_t pc = rvm->pc;
+    // All four bytes, whatever the length, to keep this branch-free
+    uint8_t b[4];
+    for(uint8_t i = 0; i < 4; i++) {
+      b[i] = vm_load(rvm, pc + i);
+    }
+    uint8_t n = insn_length(b[0]);
+    uint16_t at[ACCESS_MAX];
+    uint32_t len[ACCESS_MAX];
+    uint32_t ranges = stores[b[0]] ? insn_writes(rvm, b, at, len) : 0;
+
+    fetch(rvm);
+    decode(rvm);
+    execute(rvm);
+    rvm->icount++;
+    record(r, rvm, pc, b, n, ranges, at, len);
+  }
+}
@@ -0,0 +1,103 @@
+/* anewkirk */
+
+#pragma once
+
+#include "bool.h"
+#include "reflect.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * The binary execution trace written by reflectvm -r and read by
+ * rtrace. The file is a RecordHeader followed by one record per
+ * instruction retired, each
+ *
+ *   uint8_t kinds         REC_* bits, and the instruction's length
+ *                         less one in the top two bits
+ *   uint16_t pc           if REC_PC: the instruction did not follow
+ *                         the one before it
+ *   instruction bytes
+ *   uint16_t mask, values if REC_REGS: the registers in mask changed,
+ *                         their new values in register order
+ *   uint16_t sp           if REC_SP
+ *   uint8_t flags         if REC_FLAGS: z, c and n in bits 0 to 2
+ *   uint8_t count         if REC_MEM: ranges written, each a uint16_t
+ *                         address, uint16_t length and the bytes
+ *
+ * A record of only REC_GAP stands for the uint64_t count of
+ * instructions that follow it in place of records dropped while the
+ * writer fell behind. The next record then holds the whole state, as
+ * the first one of the file does. All fields are little-endian.
+ *
+ * Memory writes are worked out from each instruction before it runs.
+ * Writes by sys calls with a host handler (see rvm.h) are not
+ * recorded.
+ */
+
+#define RECORD_MAGIC "\x7FRTR"
+#define RECORD_VERSION 1
+
+#define REC_PC 0x01
+#define REC_REGS 0x02
+#define REC_SP 0x04
+#define REC_FLAGS 0x08
+#define REC_MEM 0x10
+#define REC_GAP 0x20
+
+typedef struct _record_header {
+  uint8_t magic[4];
+  uint16_t version;
+  uint16_t pad;
+} RecordHeader;
+
+/*
+ * Records for one VM, built by the engine into a ring buffer that a
+ * writer thread drains to the file, so the engine never waits on the
+ * disk. When the ring is full records are dropped and a gap left.
+ */
+typedef struct _recorder {
+  uint8_t *ring;
+  uint64_t size;
+
+  // Bytes ever put in and taken out of the ring; head is only
+  // advanced by the engine and tail by the writer
+  uint64_t head;
+  uint64_t tail;
+
+  // The engine's last look at tail
+  uint64_t tail_seen;
+
+  FILE *f;
+  pthread_t writer;
+  bool done;
+
+  // State as of the last record, which the next is a delta from
+  uint8_t reg[0x10];
+  uint16_t sp;
+  uint8_t flags;
+  uint16_t next_pc;
+
+  // Instructions not recorded since the last record, and whether the
+  // next record must hold the whole state
+  uint64_t dropped;
+  bool key;
+} Recorder;
+
+/*
+ * Creates filename, writes the header and starts the writer. The ring
+ * holds size bytes, a power of two. Exits with a message if the file
+ * cannot be created.
+ */
+Recorder *open_recorder(const char *filename, uint64_t size);
+
+/*
+ * Writes what is left in the ring, stops the writer and closes the
+ * file.
+ */
+void close_recorder(Recorder *r);
+
+/*
+ * The switch engine, recording every instruction it runs.
+ */
+void run_recorded(RVM *rvm, Recorder *r);
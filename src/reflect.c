@@ -7,12 +7,19 @@
 
 #include "bool.h"
 #include "reflect.h"
+#include "icache.h"
+#include "image.h"
+#include "io.h"
+#include "iolog.h"
+#include "jit.h"
+#include "mem.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 RVM *new_rvm() {
-  RVM *rvm = malloc(sizeof(RVM));
+  RVM *rvm = calloc(1, sizeof(RVM));
+  mem_init(rvm);
   rvm->sp = 0;
   rvm->pc = 0;
   rvm->reg_d = 0;
@@ -21,33 +28,62 @@ RVM *new_rvm() {
   rvm->fetched = 0;
   rvm->r_flag = 0;
   rvm->z_flag = 0;
+  rvm->c_flag = 0;
+  rvm->n_flag = 0;
+  rvm->fuse = true;
+  rvm->icount = 0;
+  rvm->fused = 0;
+  rvm->icache = NULL;
+  rvm->code_map = NULL;
+  rvm->jit = NULL;
+  rvm->boundaries = NULL;
+  rvm->breaks = NULL;
+  rvm->out = new_output();
+  rvm->in = new_input();
+  rvm->iolog = NULL;
+  rvm->sys = NULL;
+  rvm->user = NULL;
   return rvm;
 }
 
-void load_code(RVM *rvm, uint8_t *filename) {
-  FILE *fp;
-  uint32_t len;
-  fp = fopen(filename, "rb");
-  // Seek to end of file to determine file length
-  fseek(fp, 0, SEEK_END);
-  len = ftell(fp);
-  if(len > 0xFFFF) {
-    printf("Program size too large; Exiting");
-    exit(1);
-  }
-  rewind(fp);
+void free_rvm(RVM *rvm) {
+  out_flush(rvm);
+  free_output(rvm->out);
+  free_input(rvm->in);
+  jit_free(rvm);
+  free(rvm->icache);
+  free(rvm->code_map);
+  free(rvm->boundaries);
+  free(rvm->breaks);
+  mem_free(rvm);
+  free(rvm);
+}
 
-  // Read program into VM memory
-  fread(rvm->mem, len, 1, fp);
-  fclose(fp);
+void load_code(RVM *rvm, uint8_t *filename) {
+  Image *img = open_image(filename);
+  image_load(img, rvm);
+  close_image(img);
 }
 
 uint16_t get_imm16(RVM *rvm) {
-  return rvm->mem[rvm->pc++] << 8 | rvm->mem[rvm->pc++];
+  uint8_t hi = vm_load(rvm, rvm->pc++);
+  uint8_t lo = vm_load(rvm, rvm->pc++);
+  return hi << 8 | lo;
 }
 
 uint8_t get_imm8(RVM *rvm) {
-  return rvm->mem[rvm->pc++];
+  return vm_load(rvm, rvm->pc++);
+}
+
+// Sets the flags from the result r of a 16-bit pair instruction
+static void pair_flags(RVM *rvm, uint16_t r) {
+  rvm->z_flag = r == 0;
+  rvm->n_flag = r >> 15;
+}
+
+void write_16b_reg(RVM *rvm, uint16_t val) {
+  rvm->reg[rvm->reg_s] = val & 0xFF;
+  rvm->reg[rvm->reg_d] = val >> 8;
 }
 
 uint16_t read_16b_reg(RVM *rvm) {
@@ -58,8 +94,8 @@ uint16_t read_16b_reg(RVM *rvm) {
 }
 
 void fetch(RVM *rvm) {
-  uint8_t b1 = rvm->mem[rvm->pc++];
-  uint8_t b2 = rvm->mem[rvm->pc++];
+  uint8_t b1 = vm_load(rvm, rvm->pc++);
+  uint8_t b2 = vm_load(rvm, rvm->pc++);
   rvm->fetched = (b1 << 8) | b2;
 }
 
@@ -89,13 +125,13 @@ void execute(RVM *rvm) {
   case 0x03: {
     // mov [imm16], rs
     uint16_t imm_addr = get_imm16(rvm);
-    rvm->mem[imm_addr] = rvm->reg[rvm->reg_s];
+    vm_store(rvm, imm_addr, rvm->reg[rvm->reg_s]);
     break;
   }
   case 0x04: {
     // mov rd, [$imm16]
     uint16_t imm_addr = get_imm16(rvm);
-    rvm->reg[rvm->reg_d] = rvm->mem[imm_addr];
+    rvm->reg[rvm->reg_d] = vm_load(rvm, imm_addr);
     break;
   }
   case 0x05: {
@@ -109,26 +145,27 @@ void execute(RVM *rvm) {
     // mov [rx:ry], $imm8
     uint8_t imm_val = get_imm8(rvm);
     uint16_t addr = read_16b_reg(rvm);
-    rvm->mem[addr] = imm_val;
+    vm_store(rvm, addr, imm_val);
     break;
   }
   case 0x07: {
     // mov [rx:ry], rc
     uint8_t r_src = get_imm8(rvm);
     uint16_t addr = read_16b_reg(rvm);
-    rvm->mem[addr] = rvm->reg[r_src];
+    vm_store(rvm, addr, rvm->reg[r_src & 0xF]);
     break;
   }
   case 0x08: {
     // mov rc, [rx:ry]
     uint8_t r_dest = get_imm8(rvm);
     uint16_t addr = read_16b_reg(rvm);
-    rvm->reg[r_dest] = rvm->mem[addr];
+    rvm->reg[r_dest & 0xF] = vm_load(rvm, addr);
     break;
   }
   case 0x09: {
     // hlt
     rvm->r_flag = false;
+    out_flush(rvm);
     break;
   }
   case 0x0A: {
@@ -213,38 +250,39 @@ void execute(RVM *rvm) {
   case 0x16: {
     // call $imm16
     uint16_t addr = get_imm16(rvm);
-    rvm->mem[rvm->sp--] = rvm->pc >> 8;
-    rvm->mem[rvm->sp--] = rvm->pc & 0xFF;
+    vm_store(rvm, rvm->sp--, rvm->pc >> 8);
+    vm_store(rvm, rvm->sp--, rvm->pc & 0xFF);
     rvm->pc = addr;
     break;
   }
   case 0x17: {
     // call [rx:ry]
-    rvm->mem[rvm->sp--] = rvm->pc >> 8;
-    rvm->mem[rvm->sp--] = rvm->pc & 0xFF;
+    vm_store(rvm, rvm->sp--, rvm->pc >> 8);
+    vm_store(rvm, rvm->sp--, rvm->pc & 0xFF);
     rvm->pc = read_16b_reg(rvm);
     break;
   }
   case 0x18: {
     // ret
-    uint16_t ret_addr = rvm->mem[++rvm->sp] | rvm->mem[++rvm->sp] << 8;
-    rvm->pc = ret_addr;
+    uint8_t lo = vm_load(rvm, ++rvm->sp);
+    uint8_t hi = vm_load(rvm, ++rvm->sp);
+    rvm->pc = hi << 8 | lo;
     break;
   }
   case 0x19: {
     // push rs
-    rvm->mem[rvm->sp--] = rvm->reg[rvm->reg_s];
+    vm_store(rvm, rvm->sp--, rvm->reg[rvm->reg_s]);
     break;
   }
   case 0x1A: {
     // pop rd
-    rvm->reg[rvm->reg_d] = rvm->mem[++rvm->sp];
+    rvm->reg[rvm->reg_d] = vm_load(rvm, ++rvm->sp);
     break;
   }
   case 0x1B: {
     // push $imm8
     uint8_t imm_val = get_imm8(rvm);
-    rvm->mem[rvm->sp--] = imm_val;
+    vm_store(rvm, rvm->sp--, imm_val);
     break;
   }
   case 0x1C: {
@@ -270,50 +308,7 @@ void execute(RVM *rvm) {
   case 0x20: {
     // sys
     uint8_t syscall = get_imm8(rvm);
-    switch(syscall) {
-    case 0x00: {
-      uint8_t c = rvm->mem[++rvm->sp];
-      printf("%c", c);
-      break;
-    }
-    case 0x01: {
-      uint8_t c = fgetc(stdin);
-      rvm->mem[rvm->sp--] = c;
-      break;
-    }
-    case 0x02: {
-      uint8_t c = rvm->mem[read_16b_reg(rvm)];
-      printf("%c", c);
-      break;
-    }
-    case 0x03: {
-      uint8_t c = fgetc(stdin);
-      rvm->mem[read_16b_reg(rvm)] = c;
-      break;
-    }
-    case 0x04: {
-      uint8_t i = rvm->mem[++rvm->sp];
-      printf("%d", i);
-      break;
-    }
-    case 0x05: {
-      uint8_t i = 0;
-      scanf("%d", &i);
-      rvm->mem[rvm->sp--] = i;
-      break;
-    }
-    case 0x06: {
-      uint8_t i = rvm->mem[read_16b_reg(rvm)];
-      printf("%d", i);
-      break;
-    }
-    case 0x07: {
-      uint8_t i = 0;
-      scanf("%d", &i);
-      rvm->mem[read_16b_reg(rvm)] = i;
-      break;
-    }
-    }
+    sys_call(rvm, syscall, rvm->reg_d, rvm->reg_s);
     break;
   }
   case 0x21: {
@@ -348,9 +343,218 @@ void execute(RVM *rvm) {
     rvm->z_flag = rvm->reg[rvm->reg_d] % imm == 0 ? true : false;
     break;
   }
+  case 0x26: {
+    // add rx:ry, ru:rv
+    uint8_t regs = get_imm8(rvm);
+    uint16_t a = read_16b_reg(rvm);
+    uint16_t b = rvm->reg[regs >> 4] << 8 | rvm->reg[regs & 0xF];
+    write_16b_reg(rvm, a + b);
+    pair_flags(rvm, a + b);
+    rvm->c_flag = a + b > 0xFFFF;
+    break;
+  }
+  case 0x27: {
+    // sub rx:ry, ru:rv
+    uint8_t regs = get_imm8(rvm);
+    uint16_t a = read_16b_reg(rvm);
+    uint16_t b = rvm->reg[regs >> 4] << 8 | rvm->reg[regs & 0xF];
+    write_16b_reg(rvm, a - b);
+    pair_flags(rvm, a - b);
+    rvm->c_flag = a < b;
+    break;
+  }
+  case 0x28: {
+    // inc rx:ry
+    uint16_t val = read_16b_reg(rvm) + 1;
+    write_16b_reg(rvm, val);
+    pair_flags(rvm, val);
+    break;
+  }
+  case 0x29: {
+    // dec rx:ry
+    uint16_t val = read_16b_reg(rvm) - 1;
+    write_16b_reg(rvm, val);
+    pair_flags(rvm, val);
+    break;
+  }
+  case 0x2A: {
+    // cmp rx:ry, ru:rv
+    uint8_t regs = get_imm8(rvm);
+    uint16_t a = read_16b_reg(rvm);
+    uint16_t b = rvm->reg[regs >> 4] << 8 | rvm->reg[regs & 0xF];
+    pair_flags(rvm, a - b);
+    rvm->c_flag = a < b;
+    break;
+  }
+  case 0x2B: {
+    // mov rc, [rx:ry+$imm8]
+    uint8_t r_dest = get_imm8(rvm);
+    uint8_t offset = get_imm8(rvm);
+    uint16_t addr = read_16b_reg(rvm) + offset;
+    rvm->reg[r_dest & 0xF] = vm_load(rvm, addr);
+    break;
+  }
+  case 0x2C: {
+    // mov rc, [rx:ry+]
+    uint8_t r_dest = get_imm8(rvm);
+    uint16_t addr = read_16b_reg(rvm);
+    write_16b_reg(rvm, addr + 1);
+    rvm->reg[r_dest & 0xF] = vm_load(rvm, addr);
+    break;
+  }
+  case 0x2D: {
+    // mov [rx:ry+], rc
+    uint8_t r_src = get_imm8(rvm);
+    uint16_t addr = read_16b_reg(rvm);
+    uint8_t val = rvm->reg[r_src & 0xF];
+    write_16b_reg(rvm, addr + 1);
+    vm_store(rvm, addr, val);
+    break;
+  }
+  case 0x2E: {
+    // djnz rd, $imm16
+    uint16_t addr = get_imm16(rvm);
+    rvm->reg[rvm->reg_d]--;
+    rvm->z_flag = rvm->reg[rvm->reg_d] == 0 ? 1 : 0;
+    if(!rvm->z_flag) {
+      rvm->pc = addr;
+    }
+    break;
+  }
+  case 0x2F: {
+    // jc $imm16
+    uint16_t addr = get_imm16(rvm);
+    if(rvm->c_flag) {
+      rvm->pc = addr;
+    }
+    break;
+  }
+  case 0x30: {
+    // jn $imm16
+    uint16_t addr = get_imm16(rvm);
+    if(rvm->n_flag) {
+      rvm->pc = addr;
+    }
+    break;
+  }
     
   default: {
-    printf("Illegal orvm->pcode: 0x%x\n", rvm->opcode);
+    out_flush(rvm);
+    printf("Illegal opcode: 0x%x\n", rvm->opcode);
+    break;
+  }
+  }
+}
+
+// The 16-bit value in registers r:r+1
+#define REG_PAIR(rvm, r) ((rvm)->reg[r] << 8 | (rvm)->reg[(r) + 1])
+
+void sys_call(RVM *rvm, uint8_t syscall, uint8_t reg_x, uint8_t reg_y) {
+  uint16_t addr = rvm->reg[reg_x] << 8 | rvm->reg[reg_y];
+  if(rvm->sys && rvm->sys[syscall]) {
+    rvm->sys[syscall](rvm, syscall, addr);
+    return;
+  }
+  switch(syscall) {
+  case 0x00: {
+    out_putc(rvm, vm_load(rvm, ++rvm->sp));
+    out_done(rvm);
+    break;
+  }
+  case 0x01: {
+    uint8_t c = rvm->iolog ? iolog_getc(rvm, syscall) : in_getc(rvm);
+    vm_store(rvm, rvm->sp--, c);
+    break;
+  }
+  case 0x02: {
+    out_putc(rvm, vm_load(rvm, addr));
+    out_done(rvm);
+    break;
+  }
+  case 0x03: {
+    uint8_t c = rvm->iolog ? iolog_getc(rvm, syscall) : in_getc(rvm);
+    vm_store(rvm, addr, c);
+    break;
+  }
+  case 0x04: {
+    out_int(rvm, vm_load(rvm, ++rvm->sp));
+    out_done(rvm);
+    break;
+  }
+  case 0x05: {
+    int i = rvm->iolog ? iolog_int(rvm, syscall) : in_int(rvm);
+    vm_store(rvm, rvm->sp--, i);
+    break;
+  }
+  case 0x06: {
+    out_int(rvm, vm_load(rvm, addr));
+    out_done(rvm);
+    break;
+  }
+  case 0x07: {
+    int i = rvm->iolog ? iolog_int(rvm, syscall) : in_int(rvm);
+    vm_store(rvm, addr, i);
+    break;
+  }
+  case 0x08: {
+    // Pop a count n and print n bytes from [rx:ry], wrapping at $FFFF
+    uint8_t n = vm_load(rvm, ++rvm->sp);
+    uint8_t bytes[0x100];
+    vm_read(rvm, addr, bytes, n);
+    out_write(rvm, bytes, n);
+    out_done(rvm);
+    break;
+  }
+  case 0x09: {
+    // Pop a count n, read a line of up to n bytes into [rx:ry]
+    // and push the number of bytes read
+    uint8_t n = vm_load(rvm, ++rvm->sp);
+    uint8_t got = rvm->iolog ? iolog_read(rvm, syscall, addr, n, true)
+      : in_read(rvm, addr, n, true);
+    vm_store(rvm, rvm->sp--, got);
+    break;
+  }
+  case 0x0A: {
+    // As $09, but only stopping at n bytes or end of input
+    uint8_t n = vm_load(rvm, ++rvm->sp);
+    uint8_t got = rvm->iolog ? iolog_read(rvm, syscall, addr, n, false)
+      : in_read(rvm, addr, n, false);
+    vm_store(rvm, rvm->sp--, got);
+    break;
+  }
+  case 0x0B: {
+    // Copy rE:rF bytes from [rC:rD] to [rx:ry]; they may overlap
+    vm_move(rvm, addr, REG_PAIR(rvm, 0xC), REG_PAIR(rvm, 0xE));
+    break;
+  }
+  case 0x0C: {
+    // Set rE:rF bytes at [rx:ry] to rD
+    vm_fill(rvm, addr, rvm->reg[0xD], REG_PAIR(rvm, 0xE));
+    break;
+  }
+  case 0x0D: {
+    // Compare rE:rF bytes at [rx:ry] with those at [rC:rD] and push
+    // 0 if equal, 1 if [rx:ry] is greater, $FF if it is less
+    int c = vm_compare(rvm, addr, REG_PAIR(rvm, 0xC), REG_PAIR(rvm, 0xE));
+    vm_store(rvm, rvm->sp--, c < 0 ? 0xFF : c > 0);
+    break;
+  }
+  case 0x0E: {
+    // Search rE:rF bytes at [rx:ry] for rD; push 1 and leave its
+    // address in rC:rD if found, else push 0
+    int32_t at = vm_find(rvm, addr, rvm->reg[0xD], REG_PAIR(rvm, 0xE));
+    if(at >= 0) {
+      rvm->reg[0xC] = at >> 8;
+      rvm->reg[0xD] = at;
+    }
+    vm_store(rvm, rvm->sp--, at >= 0);
+    break;
+  }
+  case 0x0F: {
+    // Internet checksum of rE:rF bytes at [rx:ry] into rC:rD
+    uint16_t sum = vm_checksum(rvm, addr, REG_PAIR(rvm, 0xE));
+    rvm->reg[0xC] = sum >> 8;
+    rvm->reg[0xD] = sum;
     break;
   }
   }
@@ -362,5 +566,6 @@ void run(RVM *rvm) {
     fetch(rvm);
     decode(rvm);
     execute(rvm);
+    rvm->icount++;
   }
 }
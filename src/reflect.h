@@ -4,13 +4,36 @@
 #include <stdint.h>
 #include "bool.h"
 
+// Bumped whenever decoding or translation changes, so translations
+// cached by older builds (see tcache.h) are not used
+#define RVM_VERSION 3
+
+struct _rvm;
+
+/*
+ * A host handler for sys call number syscall. addr is the value of
+ * the register pair the instruction names (rx:ry). See rvm.h.
+ */
+typedef void (*SysFn)(struct _rvm *rvm, uint8_t syscall, uint16_t addr);
+
 // Represents an instance of ReflectVM
 typedef struct _rvm {
   // Registers
   uint8_t reg[0x10];
 
-  // Memory
-  uint8_t mem[0x10000];
+#ifdef RVM_PAGED_MEM
+  // Memory as 256-byte pages, and the snapshot image pages not yet
+  // written come from (see mem.h)
+  uint8_t *pages[0x100];
+  struct _mem_image *image;
+#else
+  // Memory, one 64 KiB mapping (see mem.h)
+  uint8_t *mem;
+#endif
+
+  // Set for each 256-byte page of memory stored to since the VM was
+  // created or reset (see rvm_reset() in snapshot.h)
+  uint8_t dirty[0x100];
 
   // Stack pointer
   uint16_t sp;
@@ -35,6 +58,54 @@ typedef struct _rvm {
   
   // Zero flag
   bool z_flag;
+
+  // Carry (unsigned borrow for sub and cmp) and negative flags, set
+  // only by the 16-bit register-pair instructions
+  bool c_flag;
+  bool n_flag;
+
+  // Decode runs of instructions into superinstructions (fusion.def)
+  bool fuse;
+
+  // Instructions retired, by every engine; run_for() budgets count these
+  uint64_t icount;
+
+  // Instructions retired as part of a superinstruction
+  uint64_t fused;
+
+  // Predecoded instruction cache, allocated by engines that use it
+  struct _insn *icache;
+
+  // One bit per address covered by a decoded icache entry
+  // or a JIT translated block
+  uint8_t *code_map;
+
+  // x86-64 translator state, allocated by run_jit()
+  struct _jit *jit;
+
+  // One bit per instruction start, from the image loaded (see
+  // image.h), NULL if it had none
+  uint8_t *boundaries;
+
+  // One bit per address with a breakpoint, NULL while there are none
+  uint8_t *breaks;
+
+  // Buffered console output of sys calls
+  struct _output *out;
+
+  // Read-ahead console input of sys calls
+  struct _input *in;
+
+  // Log input sys calls are recorded to or replayed from, or NULL
+  // (see iolog.h)
+  struct _iolog *iolog;
+
+  // Host handlers by sys call number, NULL entries (or a NULL
+  // table) for the built-in console calls
+  SysFn *sys;
+
+  // For the host's use (see rvm.h)
+  void *user;
 } RVM;
 
 /*
@@ -44,7 +115,13 @@ typedef struct _rvm {
 RVM *new_rvm();
 
 /*
- * Loads the specified file into the memory of the VM
+ * Frees a ReflectVM instance and everything it owns.
+ */
+void free_rvm(RVM *rvm);
+
+/*
+ * Loads the specified .rvm image or legacy raw image into the
+ * memory of the VM (see image.h)
  */
 void load_code(RVM *rvm, uint8_t *filename);
 
@@ -67,6 +144,12 @@ uint8_t get_imm8(RVM *rvm);
  */
 uint16_t read_16b_reg(RVM *rvm);
 
+/*
+ * Writes a 16-bit value to the pair of registers
+ * read by read_16b_reg().
+ */
+void write_16b_reg(RVM *rvm, uint16_t val);
+
 /*
  * Retrieves 16 bits from memory at pc
  */
@@ -86,6 +169,14 @@ void decode(RVM *rvm);
  */
 void execute(RVM *rvm);
 
+/*
+ * Performs the sys call numbered syscall, with the host's handler
+ * if rvm->sys has one. reg_x and reg_y name the register pair
+ * (rx:ry) used as an address by the calls that read or write
+ * memory.
+ */
+void sys_call(RVM *rvm, uint8_t syscall, uint8_t reg_x, uint8_t reg_y);
+
 /*
  * Sets r_flag to true, and begins execution of the 
  * program. Execution will be halted when the VM 
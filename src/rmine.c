@@ -0,0 +1,207 @@
+/*
+ * anewkirk
+ *
+ * Mines execution traces written by `reflectvm -t` for the opcode
+ * sequences worth fusing into superinstructions, and prints them as a
+ * replacement for src/fusion.def
+ */
+
+#include "bool.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_FUSE 4
+#define TABLE_SIZE 0x10000
+
+typedef struct _seq {
+  uint8_t n;
+  uint8_t ops[MAX_FUSE];
+  uint64_t count;
+} Seq;
+
+Seq table[TABLE_SIZE];
+
+void print_usage() {
+  printf("Usage: rmine [-n maxlen] [-k count] trace.txt\n");
+}
+
+// Whether an opcode is defined
+bool legal(uint8_t op) {
+  return op <= 0x30;
+}
+
+/*
+ * Whether an opcode may come before the last instruction of a
+ * superinstruction. Must agree with fusable_head() in icache.c.
+ */
+bool fusable_head(uint8_t op) {
+  if(!legal(op)) {
+    return false;
+  }
+  switch(op) {
+  case 0x03:
+  case 0x06:
+  case 0x07:
+  case 0x09:
+  case 0x19:
+  case 0x1B:
+  case 0x20:
+  case 0x2D:
+  case 0x2E:
+  case 0x2F:
+  case 0x30:
+    return false;
+  }
+  return op < 0x10 || op > 0x18;
+}
+
+/*
+ * Must agree with fusable_tail() in icache.c, which also drops sys
+ * calls reading input; traces do not say which call a sys makes.
+ */
+bool fusable_tail(uint8_t op) {
+  return legal(op) && op != 0x09;
+}
+
+void count_seq(uint8_t *ops, uint8_t n) {
+  uint32_t h = n;
+  for(uint8_t i = 0; i < n; i++) {
+    h = h * 131 + ops[i];
+  }
+  h &= TABLE_SIZE - 1;
+
+  // Open addressing; the table is far larger than the opcode space in use
+  while(table[h].n) {
+    if(table[h].n == n && !memcmp(table[h].ops, ops, n)) {
+      table[h].count++;
+      return;
+    }
+    h = (h + 1) & (TABLE_SIZE - 1);
+  }
+  table[h].n = n;
+  memcpy(table[h].ops, ops, n);
+  table[h].count = 1;
+}
+
+// Dispatches saved by fusing every occurrence of s
+uint64_t savings(const Seq *s) {
+  return s->count * (s->n - 1);
+}
+
+int by_savings(const void *a, const void *b) {
+  uint64_t sa = savings(a);
+  uint64_t sb = savings(b);
+  return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  uint8_t maxlen = MAX_FUSE;
+  uint32_t top = 16;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:k:")) != -1) {
+    switch(opt) {
+    case 'n':
+      maxlen = atoi(optarg);
+      if(maxlen < 2 || maxlen > MAX_FUSE) {
+	printf("maxlen must be between 2 and %d\n", MAX_FUSE);
+	exit(1);
+      }
+      break;
+    case 'k':
+      top = atoi(optarg);
+      break;
+    default:
+      print_usage();
+      exit(1);
+    }
+  }
+
+  if(optind != argc - 1) {
+    print_usage();
+    exit(1);
+  }
+
+  FILE *f = fopen(argv[optind], "r");
+  if(!f) {
+    printf("Failed to open file: %s\n", argv[optind]);
+    exit(1);
+  }
+
+  // Sliding window over the last maxlen executed instructions
+  uint8_t ops[MAX_FUSE];
+  uint16_t next_pc[MAX_FUSE];
+  uint8_t window = 0;
+  uint64_t total = 0;
+  unsigned pc, op, len;
+
+  while(fscanf(f, "%x %x %u", &pc, &op, &len) == 3) {
+    total++;
+    // A jump breaks the window, as does anything that cannot lead a run
+    if(window && next_pc[window - 1] != pc) {
+      window = 0;
+    }
+    if(window == maxlen) {
+      memmove(ops, ops + 1, maxlen - 1);
+      memmove(next_pc, next_pc + 1, (maxlen - 1) * sizeof(uint16_t));
+      window--;
+    }
+    ops[window] = op;
+    next_pc[window] = pc + len;
+    window++;
+
+    // Count every run ending at this instruction
+    if(fusable_tail(op)) {
+      for(uint8_t n = 2; n <= window; n++) {
+	uint8_t *run = ops + window - n;
+	bool ok = true;
+	for(uint8_t i = 0; i < n - 1; i++) {
+	  ok = ok && fusable_head(run[i]);
+	}
+	if(ok) {
+	  count_seq(run, n);
+	}
+      }
+    }
+
+    // Nothing can be fused across a branch, call, store or sys call
+    if(!fusable_head(op)) {
+      window = 0;
+    }
+  }
+  fclose(f);
+
+  qsort(table, TABLE_SIZE, sizeof(Seq), by_savings);
+
+  printf("/*\n");
+  printf(" * Superinstruction table, regenerate with:\n");
+  printf(" *\n");
+  printf(" *   bin/reflectvm -t trace.txt program.rvm\n");
+  printf(" *   bin/rmine trace.txt > src/fusion.def\n");
+  printf(" *\n");
+  printf(" * FUSEn(handler, opcode...) runs n consecutive instructions with the\n");
+  printf(" * given opcodes as one handler. Only the last one may branch, call,\n");
+  printf(" * return, write memory or make a sys call, and then only one that\n");
+  printf(" * does not read input.\n");
+  printf(" *\n");
+  printf(" * Mined from %" PRIu64 " executed instructions.\n", total);
+  printf(" */\n\n");
+
+  for(uint32_t i = 0; i < top && i < TABLE_SIZE && table[i].n; i++) {
+    Seq *s = &table[i];
+    printf("// %" PRIu64 " runs, %" PRIu64 " dispatches saved\n",
+	   s->count, savings(s));
+    printf("FUSE%d(H_F", s->n);
+    for(uint8_t k = 0; k < s->n; k++) {
+      printf("_%02X", s->ops[k]);
+    }
+    for(uint8_t k = 0; k < s->n; k++) {
+      printf(", 0x%02X", s->ops[k]);
+    }
+    printf(")\n");
+  }
+}
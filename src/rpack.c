@@ -0,0 +1,279 @@
+/*
+ * anewkirk
+ *
+ * Packs raw program images into an .rvm container (see image.h)
+ */
+
+#include "bool.h"
+#include "icache.h"
+#include "image.h"
+#include "mem.h"
+#include "reflect.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SEGMENTS 0x100
+
+typedef struct _input_file {
+  uint16_t addr;
+  uint8_t *data;
+  uint32_t len;
+} InputFile;
+
+void print_usage() {
+  printf("Usage: rpack [-e entry] [-s sp] [-y symbols.txt] [-l lines.txt] [-b]\n");
+  printf("             output.rvm program.bin[@addr]...\n");
+  printf("  -e  address execution starts at (default: $0000)\n");
+  printf("  -s  initial stack pointer (default: $0000)\n");
+  printf("  -y  symbol table, one \"addr name\" per line\n");
+  printf("  -l  debug line map, one \"addr line\" per line\n");
+  printf("  -b  include the instruction-boundary bitmap\n");
+  printf("Each raw image is loaded at addr (hex, default 0).\n");
+}
+
+uint8_t *read_file(const char *filename, uint32_t *len) {
+  FILE *fp = fopen(filename, "rb");
+  if(!fp) {
+    printf("Failed to open file: %s\n", filename);
+    exit(1);
+  }
+  fseek(fp, 0, SEEK_END);
+  *len = ftell(fp);
+  rewind(fp);
+  uint8_t *data = malloc(*len ? *len : 1);
+  *len = fread(data, 1, *len, fp);
+  fclose(fp);
+  return data;
+}
+
+uint16_t parse_addr(const char *s) {
+  char *end;
+  if(*s == '$') {
+    s++;
+  }
+  unsigned long v = strtoul(s, &end, 16);
+  if(end == s || *end || v > 0xFFFF) {
+    printf("Bad address: %s\n", s);
+    exit(1);
+  }
+  return v;
+}
+
+/*
+ * Reads "addr rest" lines. Returns how many there were; the
+ * addresses go in addrs and the rest of each line in rest.
+ */
+uint32_t read_pairs(const char *filename, uint16_t **addrs, char ***rest) {
+  FILE *f = fopen(filename, "r");
+  if(!f) {
+    printf("Failed to open file: %s\n", filename);
+    exit(1);
+  }
+  uint32_t count = 0, cap = 64;
+  *addrs = malloc(cap * sizeof(uint16_t));
+  *rest = malloc(cap * sizeof(char *));
+  char addr[32], text[256];
+  while(fscanf(f, "%31s %255s", addr, text) == 2) {
+    if(count == cap) {
+      cap *= 2;
+      *addrs = realloc(*addrs, cap * sizeof(uint16_t));
+      *rest = realloc(*rest, cap * sizeof(char *));
+    }
+    (*addrs)[count] = parse_addr(addr);
+    (*rest)[count] = strdup(text);
+    count++;
+  }
+  fclose(f);
+  return count;
+}
+
+/*
+ * Marks the start of every instruction reachable from entry, found
+ * the same way the threaded engine predecodes a program.
+ */
+void find_boundaries(InputFile *in, uint32_t n, uint16_t entry,
+		     uint8_t *bitmap) {
+  RVM *rvm = new_rvm();
+  for(uint32_t i = 0; i < n; i++) {
+    vm_write(rvm, in[i].addr, in[i].data, in[i].len);
+  }
+  rvm->fuse = false;
+  icache_init(rvm);
+  icache_prepare(rvm, entry);
+  for(uint32_t a = 0; a < 0x10000; a++) {
+    if(rvm->icache[a].len) {
+      bitmap[a >> 3] |= 1 << (a & 7);
+    }
+  }
+  free_rvm(rvm);
+}
+
+// Pads the output to a multiple of 4 bytes
+uint32_t align4(FILE *f, uint32_t pos) {
+  while(pos & 3) {
+    fputc(0, f);
+    pos++;
+  }
+  return pos;
+}
+
+int main(int argc, char *argv[]) {
+  ImageHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, IMAGE_MAGIC, 4);
+  h.version = IMAGE_VERSION;
+  char *symbols = NULL;
+  char *lines = NULL;
+  bool boundaries = false;
+
+  int opt;
+  while((opt = getopt(argc, argv, "e:s:y:l:b")) != -1) {
+    switch(opt) {
+    case 'e':
+      h.entry = parse_addr(optarg);
+      break;
+    case 's':
+      h.sp = parse_addr(optarg);
+      break;
+    case 'y':
+      symbols = optarg;
+      break;
+    case 'l':
+      lines = optarg;
+      break;
+    case 'b':
+      boundaries = true;
+      break;
+    default:
+      print_usage();
+      exit(1);
+    }
+  }
+  if(argc - optind < 2 || argc - optind - 1 > MAX_SEGMENTS) {
+    print_usage();
+    exit(1);
+  }
+
+  // Segments
+  uint32_t n = argc - optind - 1;
+  InputFile *in = calloc(n, sizeof(InputFile));
+  for(uint32_t i = 0; i < n; i++) {
+    char *name = argv[optind + 1 + i];
+    char *at = strrchr(name, '@');
+    if(at) {
+      *at = '\0';
+      in[i].addr = parse_addr(at + 1);
+    }
+    in[i].data = read_file(name, &in[i].len);
+    if(in[i].addr + in[i].len > 0x10000) {
+      printf("Segment does not fit in memory: %s\n", name);
+      exit(1);
+    }
+  }
+  h.num_segments = n;
+
+  // Lay out the file: header, segment table, then each section
+  uint32_t pos = sizeof(ImageHeader) + n * sizeof(ImageSegment);
+  ImageSegment *seg = calloc(n, sizeof(ImageSegment));
+  for(uint32_t i = 0; i < n; i++) {
+    pos = (pos + 3) & ~3u;
+    seg[i].addr = in[i].addr;
+    seg[i].len = in[i].len;
+    seg[i].offset = pos;
+    pos += in[i].len;
+  }
+
+  uint16_t *sym_addrs = NULL;
+  char **sym_names = NULL;
+  ImageSymbol *sym = NULL;
+  if(symbols) {
+    h.num_symbols = read_pairs(symbols, &sym_addrs, &sym_names);
+    sym = calloc(h.num_symbols, sizeof(ImageSymbol));
+    for(uint32_t i = 0; i < h.num_symbols; i++) {
+      sym[i].addr = sym_addrs[i];
+      sym[i].name = h.strings_len;
+      h.strings_len += strlen(sym_names[i]) + 1;
+    }
+    pos = (pos + 3) & ~3u;
+    h.symbols = pos;
+    pos += h.num_symbols * sizeof(ImageSymbol);
+    h.strings = pos;
+    pos += h.strings_len;
+  }
+
+  uint16_t *line_addrs = NULL;
+  char **line_nums = NULL;
+  ImageLine *line = NULL;
+  if(lines) {
+    h.num_lines = read_pairs(lines, &line_addrs, &line_nums);
+    line = calloc(h.num_lines, sizeof(ImageLine));
+    for(uint32_t i = 0; i < h.num_lines; i++) {
+      line[i].addr = line_addrs[i];
+      line[i].line = strtoul(line_nums[i], NULL, 10);
+      if(i && line[i].addr <= line[i - 1].addr) {
+	printf("Line map must be sorted by address\n");
+	exit(1);
+      }
+    }
+    pos = (pos + 3) & ~3u;
+    h.lines = pos;
+    pos += h.num_lines * sizeof(ImageLine);
+  }
+
+  uint8_t *bitmap = NULL;
+  if(boundaries) {
+    bitmap = calloc(IMAGE_BOUNDARIES, 1);
+    find_boundaries(in, n, h.entry, bitmap);
+    pos = (pos + 3) & ~3u;
+    h.boundaries = pos;
+    pos += IMAGE_BOUNDARIES;
+  }
+
+  // Write it out, leaving the checksum for last
+  char *out = argv[optind];
+  FILE *f = fopen(out, "w+b");
+  if(!f) {
+    printf("Failed to open file: %s\n", out);
+    exit(1);
+  }
+  fwrite(&h, sizeof(h), 1, f);
+  fwrite(seg, sizeof(ImageSegment), n, f);
+  pos = sizeof(ImageHeader) + n * sizeof(ImageSegment);
+  for(uint32_t i = 0; i < n; i++) {
+    pos = align4(f, pos);
+    pos += fwrite(in[i].data, 1, in[i].len, f);
+  }
+  if(symbols) {
+    pos = align4(f, pos);
+    pos += fwrite(sym, sizeof(ImageSymbol), h.num_symbols, f)
+      * sizeof(ImageSymbol);
+    for(uint32_t i = 0; i < h.num_symbols; i++) {
+      pos += fwrite(sym_names[i], 1, strlen(sym_names[i]) + 1, f);
+    }
+  }
+  if(lines) {
+    pos = align4(f, pos);
+    pos += fwrite(line, sizeof(ImageLine), h.num_lines, f)
+      * sizeof(ImageLine);
+  }
+  if(bitmap) {
+    pos = align4(f, pos);
+    pos += fwrite(bitmap, 1, IMAGE_BOUNDARIES, f);
+  }
+
+  uint8_t *file = malloc(pos);
+  rewind(f);
+  if(fread(file, 1, pos, f) != pos) {
+    printf("Failed to write file: %s\n", out);
+    exit(1);
+  }
+  h.checksum = image_hash(IMAGE_FNV_BASIS, file, pos);
+  fseek(f, offsetof(ImageHeader, checksum), SEEK_SET);
+  fwrite(&h.checksum, sizeof(h.checksum), 1, f);
+  fclose(f);
+  return 0;
+}
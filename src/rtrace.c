@@ -0,0 +1,518 @@
+/*
+ * anewkirk
+ *
+ * Reads binary execution traces written by `reflectvm -r` (see
+ * recorder.h). Prints every instruction with what it changed, or
+ * summaries of the run: its hot paths, memory accesses by page and
+ * its sys calls in order.
+ */
+
+#include "bool.h"
+#include "disasm_backend.h"
+#include "recorder.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A range of memory an instruction wrote, its bytes in the trace
+typedef struct _write {
+  uint16_t addr;
+  uint16_t len;
+  const uint8_t *bytes;
+} Write;
+
+// One record, decoded
+typedef struct _rec {
+  uint64_t index;
+  uint8_t kinds;
+  uint16_t pc;
+  uint8_t len;
+  uint8_t b[4];
+  uint16_t mask;
+  uint32_t ranges;
+  Write w[2];
+} Rec;
+
+// The trace and the VM state as of the record last read
+typedef struct _reader {
+  const uint8_t *data;
+  uint64_t size;
+  uint64_t at;
+
+  // Instructions retired, recorded or not
+  uint64_t icount;
+  uint8_t reg[0x10];
+  uint16_t sp;
+  uint8_t flags;
+  uint16_t next_pc;
+} Reader;
+
+// A control transfer from one block to another
+typedef struct _edge {
+  uint32_t key;
+  uint64_t count;
+} Edge;
+
+#define EDGES 0x10000
+
+// Executions of each address, and instructions and entries of the
+// blocks starting there
+uint64_t execs[0x10000];
+uint64_t block_insns[0x10000];
+uint64_t block_entries[0x10000];
+
+// Bytes and length of the instruction last seen at each address
+uint8_t code[0x10000][4];
+uint8_t code_len[0x10000];
+
+uint64_t page_exec[0x100];
+uint64_t page_read[0x100];
+uint64_t page_write[0x100];
+
+Edge edges[EDGES];
+
+void print_usage() {
+  printf("Usage: rtrace [-p] [-m] [-y] [-k count] trace.rtr\n");
+  printf("  -p  print the hot blocks and the transfers between them\n");
+  printf("  -m  print memory accesses by page\n");
+  printf("  -y  print every sys call in order\n");
+  printf("  -k  rows in the hot path tables (default: 20)\n");
+  printf("With none of -p, -m or -y every instruction is printed.\n");
+}
+
+void truncated() {
+  printf("Trace is truncated\n");
+  exit(1);
+}
+
+void need(Reader *r, uint64_t n) {
+  if(r->size - r->at < n) {
+    truncated();
+  }
+}
+
+uint8_t rd8(Reader *r) {
+  need(r, 1);
+  return r->data[r->at++];
+}
+
+uint16_t rd16(Reader *r) {
+  need(r, 2);
+  uint16_t v = r->data[r->at] | r->data[r->at + 1] << 8;
+  r->at += 2;
+  return v;
+}
+
+/*
+ * Reads the next record into rec and applies it to the state,
+ * returning false at the end of the trace. Instructions lost to a
+ * gap are added to *gap.
+ */
+bool next_record(Reader *r, Rec *rec, uint64_t *gap) {
+  *gap = 0;
+  for(;;) {
+    if(r->at == r->size) {
+      return false;
+    }
+    uint8_t kinds = rd8(r);
+    if(!(kinds & REC_GAP)) {
+      rec->kinds = kinds;
+      rec->len = (kinds >> 6) + 1;
+      rec->pc = kinds & REC_PC ? rd16(r) : r->next_pc;
+      need(r, rec->len);
+      memcpy(rec->b, r->data + r->at, rec->len);
+      r->at += rec->len;
+
+      rec->mask = 0;
+      if(kinds & REC_REGS) {
+	rec->mask = rd16(r);
+	for(uint32_t i = 0; i < 0x10; i++) {
+	  if(rec->mask & 1 << i) {
+	    r->reg[i] = rd8(r);
+	  }
+	}
+      }
+      if(kinds & REC_SP) {
+	r->sp = rd16(r);
+      }
+      if(kinds & REC_FLAGS) {
+	r->flags = rd8(r);
+      }
+      rec->ranges = 0;
+      if(kinds & REC_MEM) {
+	rec->ranges = rd8(r);
+	if(rec->ranges > 2) {
+	  printf("Trace is corrupt\n");
+	  exit(1);
+	}
+	for(uint32_t i = 0; i < rec->ranges; i++) {
+	  rec->w[i].addr = rd16(r);
+	  rec->w[i].len = rd16(r);
+	  need(r, rec->w[i].len);
+	  rec->w[i].bytes = r->data + r->at;
+	  r->at += rec->w[i].len;
+	}
+      }
+      rec->index = r->icount++;
+      r->next_pc = rec->pc + rec->len;
+      return true;
+    }
+    need(r, 8);
+    uint64_t n;
+    memcpy(&n, r->data + r->at, 8);
+    r->at += 8;
+    r->icount += n;
+    *gap += n;
+  }
+}
+
+void open_trace(Reader *r, const char *filename) {
+  memset(r, 0, sizeof(Reader));
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st)) {
+    printf("Failed to open file: %s\n", filename);
+    exit(1);
+  }
+  r->size = st.st_size;
+  if(r->size < sizeof(RecordHeader)) {
+    printf("Not a trace: %s\n", filename);
+    exit(1);
+  }
+  r->data = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(r->data == MAP_FAILED) {
+    printf("Failed to map file: %s\n", filename);
+    exit(1);
+  }
+  close(fd);
+
+  RecordHeader h;
+  memcpy(&h, r->data, sizeof(h));
+  if(memcmp(h.magic, RECORD_MAGIC, 4) || h.version != RECORD_VERSION) {
+    printf("Not a trace: %s\n", filename);
+    exit(1);
+  }
+  r->at = sizeof(RecordHeader);
+}
+
+// Disassembly of the instruction in b, to be freed
+char *insn_text(const uint8_t *b) {
+  uint8_t bytes[4] = {0};
+  memcpy(bytes, b, 4);
+  uint8_t adv = 0;
+  char *text = (char *)disassemble(bytes, &adv);
+  if(!text) {
+    text = malloc(8);
+    snprintf(text, 8, "db $%02X", b[0]);
+  }
+  return text;
+}
+
+uint16_t pair(uint8_t *reg, uint8_t xy) {
+  return reg[xy >> 4] << 8 | reg[xy & 0xF];
+}
+
+// Counts a read of n bytes at addr towards the pages it covers
+void count_read(uint16_t addr, uint32_t n) {
+  for(uint32_t i = 0; i < n; i++) {
+    page_read[(uint16_t)(addr + i) >> 8]++;
+  }
+}
+
+/*
+ * Counts the memory the instruction of rec read. regs and sp are its
+ * state before it ran.
+ */
+void count_reads(Rec *rec, uint8_t *regs, uint16_t sp) {
+  uint8_t *b = rec->b;
+  switch(b[0]) {
+  case 0x04:
+    count_read(b[2] << 8 | b[3], 1);
+    return;
+  case 0x08:
+  case 0x2C:
+    count_read(pair(regs, b[1]), 1);
+    return;
+  case 0x2B:
+    count_read(pair(regs, b[1]) + b[3], 1);
+    return;
+  case 0x18:
+    count_read(sp + 1, 2);
+    return;
+  case 0x1A:
+    count_read(sp + 1, 1);
+    return;
+  case 0x20:
+    break;
+  default:
+    return;
+  }
+
+  uint16_t addr = pair(regs, b[1]);
+  uint32_t len = regs[0xE] << 8 | regs[0xF];
+  switch(b[2]) {
+  case 0x00:
+  case 0x04:
+  case 0x08:
+  case 0x09:
+  case 0x0A:
+    count_read(sp + 1, 1);
+    break;
+  case 0x02:
+  case 0x06:
+    count_read(addr, 1);
+    break;
+  case 0x0B:
+    count_read(regs[0xC] << 8 | regs[0xD], len);
+    break;
+  case 0x0D:
+    count_read(regs[0xC] << 8 | regs[0xD], len);
+    count_read(addr, len);
+    break;
+  case 0x0E:
+  case 0x0F:
+    count_read(addr, len);
+    break;
+  }
+}
+
+// Whether execution may leave the instruction other than to the next
+bool ends_block(uint8_t op) {
+  return op == 0x09 || (op >= 0x10 && op <= 0x18) || op == 0x2E ||
+    op == 0x2F || op == 0x30;
+}
+
+void count_edge(uint16_t from, uint16_t to) {
+  uint32_t key = from << 16 | to;
+  uint32_t h = (key * 2654435761u) >> 16 & (EDGES - 1);
+  // Open addressing; edges past a full table are not counted
+  for(uint32_t i = 0; i < EDGES; i++) {
+    Edge *e = &edges[(h + i) & (EDGES - 1)];
+    if(!e->count || e->key == key) {
+      e->key = key;
+      e->count++;
+      return;
+    }
+  }
+}
+
+int by_count(const void *a, const void *b) {
+  const Edge *x = a, *y = b;
+  if(x->count != y->count) {
+    return x->count < y->count ? 1 : -1;
+  }
+  return x->key < y->key ? -1 : x->key > y->key;
+}
+
+void print_record(Reader *r, Rec *rec) {
+  char *text = insn_text(rec->b);
+  printf("%12" PRIu64 "  $%04X  %-24s", rec->index, rec->pc, text);
+  free(text);
+  for(uint32_t i = 0; i < 0x10; i++) {
+    if(rec->mask & 1 << i) {
+      printf(" r%X=%02X", i, r->reg[i]);
+    }
+  }
+  if(rec->kinds & REC_SP) {
+    printf(" sp=%04X", r->sp);
+  }
+  if(rec->kinds & REC_FLAGS) {
+    printf(" z=%d c=%d n=%d", r->flags & 1, r->flags >> 1 & 1,
+	   r->flags >> 2 & 1);
+  }
+  for(uint32_t i = 0; i < rec->ranges; i++) {
+    Write *w = &rec->w[i];
+    printf(" [$%04X]=", w->addr);
+    for(uint32_t k = 0; k < w->len && k < 8; k++) {
+      printf("%02X", w->bytes[k]);
+    }
+    if(w->len > 8) {
+      printf("... (%u bytes)", w->len);
+    }
+  }
+  printf("\n");
+}
+
+void print_sys(Rec *rec) {
+  char *text = insn_text(rec->b);
+  printf("%12" PRIu64 "  $%04X  %s", rec->index, rec->pc, text);
+  free(text);
+  for(uint32_t i = 0; i < rec->ranges; i++) {
+    printf("  wrote %u at $%04X", rec->w[i].len, rec->w[i].addr);
+  }
+  printf("\n");
+}
+
+void print_paths(uint64_t total, uint32_t top) {
+  Edge *blocks = malloc(0x10000 * sizeof(Edge));
+  uint32_t n = 0;
+  for(uint32_t a = 0; a < 0x10000; a++) {
+    if(block_entries[a]) {
+      blocks[n++] = (Edge){ a, block_insns[a] };
+    }
+  }
+  qsort(blocks, n, sizeof(Edge), by_count);
+
+  printf("\nhot blocks\n");
+  for(uint32_t i = 0; i < n && i < top; i++) {
+    uint16_t a = blocks[i].key;
+    printf("\n  $%04X  entries %" PRIu64 "  instructions %" PRIu64
+	   "  %.2f%%\n", a, block_entries[a], blocks[i].count,
+	   total ? 100.0 * blocks[i].count / total : 0);
+    // The straight line from the entry as long as it kept running
+    uint64_t entries = block_entries[a];
+    for(uint32_t k = 0; k < 64; k++) {
+      char *text = insn_text(code[a]);
+      printf("    $%04X  %s\n", a, text);
+      free(text);
+      uint8_t op = code[a][0];
+      a += code_len[a];
+      if(ends_block(op) || execs[a] < entries || block_entries[a]) {
+	break;
+      }
+    }
+  }
+  free(blocks);
+
+  qsort(edges, EDGES, sizeof(Edge), by_count);
+  printf("\nhot transfers\n");
+  for(uint32_t i = 0; i < top && i < EDGES && edges[i].count; i++) {
+    printf("  $%04X -> $%04X  %14" PRIu64 "\n", edges[i].key >> 16,
+	   edges[i].key & 0xFFFF, edges[i].count);
+  }
+}
+
+void print_pages() {
+  uint64_t most = 1;
+  for(uint32_t p = 0; p < 0x100; p++) {
+    uint64_t all = page_exec[p] + page_read[p] + page_write[p];
+    most = all > most ? all : most;
+  }
+  printf("\npage          executed           read        written\n");
+  for(uint32_t p = 0; p < 0x100; p++) {
+    uint64_t all = page_exec[p] + page_read[p] + page_write[p];
+    if(!all) {
+      continue;
+    }
+    char bar[33];
+    uint32_t len = (all * 32 + most - 1) / most;
+    memset(bar, '#', len);
+    bar[len] = 0;
+    printf("  $%02Xxx %14" PRIu64 " %14" PRIu64 " %14" PRIu64 "  %s\n", p,
+	   page_exec[p], page_read[p], page_write[p], bar);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  bool paths = false;
+  bool pages = false;
+  bool sys = false;
+  uint32_t top = 20;
+  int opt;
+
+  while((opt = getopt(argc, argv, "pmyk:")) != -1) {
+    switch(opt) {
+    case 'p':
+      paths = true;
+      break;
+    case 'm':
+      pages = true;
+      break;
+    case 'y':
+      sys = true;
+      break;
+    case 'k':
+      top = atoi(optarg);
+      break;
+    default:
+      print_usage();
+      exit(1);
+    }
+  }
+
+  if(optind != argc - 1) {
+    print_usage();
+    exit(1);
+  }
+
+  Reader r;
+  open_trace(&r, argv[optind]);
+  bool dump = !paths && !pages && !sys;
+
+  Rec rec;
+  uint64_t gap;
+  uint16_t block = 0;
+  bool in_block = false;
+  uint8_t prev_op = 0;
+  uint16_t prev_pc = 0;
+  uint8_t regs[0x10];
+  uint16_t sp = 0;
+
+  if(sys) {
+    printf("instruction     pc     call\n");
+  }
+  for(;;) {
+    // The state before the instruction, for the reads it made
+    memcpy(regs, r.reg, 0x10);
+    sp = r.sp;
+    if(!next_record(&r, &rec, &gap)) {
+      break;
+    }
+    if(gap) {
+      in_block = false;
+      if(dump || sys) {
+	printf("%12s  %" PRIu64 " instructions not recorded\n", "...", gap);
+      }
+    }
+    if(dump) {
+      print_record(&r, &rec);
+      continue;
+    }
+    if(sys && rec.b[0] == 0x20) {
+      print_sys(&rec);
+    }
+
+    uint16_t pc = rec.pc;
+    bool jumped = in_block && pc != (uint16_t)(prev_pc + code_len[prev_pc]);
+    if(!in_block || jumped || ends_block(prev_op)) {
+      if(jumped) {
+	count_edge(prev_pc, pc);
+      }
+      block = pc;
+      block_entries[pc]++;
+      in_block = true;
+    }
+    block_insns[block]++;
+    execs[pc]++;
+    memcpy(code[pc], rec.b, 4);
+    code_len[pc] = rec.len;
+    prev_op = rec.b[0];
+    prev_pc = pc;
+
+    for(uint32_t i = 0; i < rec.len; i++) {
+      page_exec[(uint16_t)(pc + i) >> 8]++;
+    }
+    count_reads(&rec, regs, sp);
+    for(uint32_t i = 0; i < rec.ranges; i++) {
+      for(uint32_t k = 0; k < rec.w[i].len; k++) {
+	page_write[(uint16_t)(rec.w[i].addr + k) >> 8]++;
+      }
+    }
+  }
+
+  if(!dump) {
+    printf("instructions: %" PRIu64 "\n", r.icount);
+  }
+  if(paths) {
+    print_paths(r.icount, top);
+  }
+  if(pages) {
+    print_pages();
+  }
+}
@@ -0,0 +1,141 @@
+/*
+ * anewkirk
+ *
+ * The librvm embedding API; see rvm.h.
+ */
+
+#include "rvm.h"
+#include "bool.h"
+#include "image.h"
+#include "io.h"
+#include "mem.h"
+#include "reflect.h"
+#include "threaded.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+RVM *rvm_create(void) {
+  return new_rvm();
+}
+
+void rvm_destroy(RVM *rvm) {
+  free_rvm(rvm);
+}
+
+int rvm_load(RVM *rvm, const void *image, size_t len, const char **err) {
+  const char *why = "image too large";
+  Image *img = NULL;
+  if(len <= UINT32_MAX) {
+    img = image_from_buffer(image, len, &why);
+  }
+  if(!img) {
+    if(err) {
+      *err = why;
+    }
+    return -1;
+  }
+  image_load(img, rvm);
+  close_image(img);
+  return 0;
+}
+
+RunExit rvm_run(RVM *rvm) {
+  return run_for(rvm, UINT64_MAX);
+}
+
+RunExit rvm_run_for(RVM *rvm, uint64_t budget) {
+  return run_for(rvm, budget);
+}
+
+uint8_t rvm_reg(RVM *rvm, uint8_t r) {
+  return rvm->reg[r & 0xF];
+}
+
+void rvm_set_reg(RVM *rvm, uint8_t r, uint8_t val) {
+  rvm->reg[r & 0xF] = val;
+}
+
+uint16_t rvm_pc(RVM *rvm) {
+  return rvm->pc;
+}
+
+void rvm_set_pc(RVM *rvm, uint16_t pc) {
+  rvm->pc = pc;
+}
+
+uint16_t rvm_sp(RVM *rvm) {
+  return rvm->sp;
+}
+
+void rvm_set_sp(RVM *rvm, uint16_t sp) {
+  rvm->sp = sp;
+}
+
+bool rvm_zero(RVM *rvm) {
+  return rvm->z_flag;
+}
+
+void rvm_set_zero(RVM *rvm, bool z) {
+  rvm->z_flag = z;
+}
+
+bool rvm_carry(RVM *rvm) {
+  return rvm->c_flag;
+}
+
+void rvm_set_carry(RVM *rvm, bool c) {
+  rvm->c_flag = c;
+}
+
+bool rvm_negative(RVM *rvm) {
+  return rvm->n_flag;
+}
+
+void rvm_set_negative(RVM *rvm, bool n) {
+  rvm->n_flag = n;
+}
+
+uint64_t rvm_icount(RVM *rvm) {
+  return rvm->icount;
+}
+
+uint8_t rvm_peek(RVM *rvm, uint16_t addr) {
+  return vm_load(rvm, addr);
+}
+
+void rvm_poke(RVM *rvm, uint16_t addr, uint8_t val) {
+  vm_store(rvm, addr, val);
+}
+
+void rvm_read(RVM *rvm, uint16_t addr, void *dst, uint32_t n) {
+  vm_read(rvm, addr, dst, n);
+}
+
+void rvm_write(RVM *rvm, uint16_t addr, const void *src, uint32_t n) {
+  vm_write(rvm, addr, src, n);
+}
+
+void rvm_push(RVM *rvm, uint8_t val) {
+  vm_store(rvm, rvm->sp--, val);
+}
+
+uint8_t rvm_pop(RVM *rvm) {
+  return vm_load(rvm, ++rvm->sp);
+}
+
+void rvm_set_user(RVM *rvm, void *user) {
+  rvm->user = user;
+}
+
+void *rvm_user(RVM *rvm) {
+  return rvm->user;
+}
+
+void rvm_set_sys(RVM *rvm, SysFn *table) {
+  rvm->sys = table;
+}
+
+void rvm_set_input(RVM *rvm, const void *data, size_t len) {
+  in_set_data(rvm->in, data, len);
+}
@@ -0,0 +1,112 @@
+/* anewkirk */
+
+#pragma once
+
+#include "bool.h"
+#include "reflect.h"
+#include "threaded.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The embedding API of librvm (make lib builds bin/librvm.a and
+ * bin/librvm.so).
+ *
+ * The library keeps no global state: every call works on the one VM
+ * it is given, so separate VMs can run on separate threads at once.
+ * A single VM must only be used by one thread at a time.
+ *
+ * Programs run on the threaded engine. Sys calls go to the host's
+ * handlers registered with rvm_set_sys(); numbers without a handler
+ * perform the built-in console calls on stdin and stdout (or on
+ * input given with rvm_set_input()).
+ */
+
+/*
+ * Creates a VM with all memory and registers zero.
+ */
+RVM *rvm_create(void);
+
+/*
+ * Frees a VM and everything it owns. Buffered console output of
+ * built-in sys calls is written first.
+ */
+void rvm_destroy(RVM *rvm);
+
+/*
+ * Loads a program from len bytes at image, an .rvm container or a
+ * legacy raw image (see image.h), which is not needed afterwards.
+ * Returns 0, or -1 with err (if not NULL) pointing at the reason
+ * when the image is not well-formed; the VM is then unchanged.
+ */
+int rvm_load(RVM *rvm, const void *image, size_t len, const char **err);
+
+/*
+ * Runs until the program halts or stops on an illegal opcode or a
+ * breakpoint, and returns which.
+ */
+RunExit rvm_run(RVM *rvm);
+
+/*
+ * Runs at most budget instructions; see run_for() in threaded.h.
+ */
+RunExit rvm_run_for(RVM *rvm, uint64_t budget);
+
+/*
+ * Registers. r is 0 to 15. Inside a sys call handler pc is the
+ * address after the sys instruction; setting it jumps.
+ */
+uint8_t rvm_reg(RVM *rvm, uint8_t r);
+void rvm_set_reg(RVM *rvm, uint8_t r, uint8_t val);
+uint16_t rvm_pc(RVM *rvm);
+void rvm_set_pc(RVM *rvm, uint16_t pc);
+uint16_t rvm_sp(RVM *rvm);
+void rvm_set_sp(RVM *rvm, uint16_t sp);
+bool rvm_zero(RVM *rvm);
+void rvm_set_zero(RVM *rvm, bool z);
+bool rvm_carry(RVM *rvm);
+void rvm_set_carry(RVM *rvm, bool c);
+bool rvm_negative(RVM *rvm);
+void rvm_set_negative(RVM *rvm, bool n);
+
+/*
+ * Instructions retired since the VM was created.
+ */
+uint64_t rvm_icount(RVM *rvm);
+
+/*
+ * Memory. Addresses wrap at $FFFF. Writes keep predecoded code
+ * coherent, so they may modify the program.
+ */
+uint8_t rvm_peek(RVM *rvm, uint16_t addr);
+void rvm_poke(RVM *rvm, uint16_t addr, uint8_t val);
+void rvm_read(RVM *rvm, uint16_t addr, void *dst, uint32_t n);
+void rvm_write(RVM *rvm, uint16_t addr, const void *src, uint32_t n);
+
+/*
+ * Pushes a byte onto, or pops one off, the VM's stack, the way the
+ * built-in sys calls do.
+ */
+void rvm_push(RVM *rvm, uint8_t val);
+uint8_t rvm_pop(RVM *rvm);
+
+/*
+ * A pointer for the host's use, NULL until set.
+ */
+void rvm_set_user(RVM *rvm, void *user);
+void *rvm_user(RVM *rvm);
+
+/*
+ * Sets the sys call handlers, a table of 0x100 entries indexed by
+ * sys call number, or NULL for the built-in calls only. The table
+ * is not copied and may be shared by any number of VMs. A handler
+ * is called with the VM between instructions and may use any of
+ * the functions above except the run functions.
+ */
+void rvm_set_sys(RVM *rvm, SysFn *table);
+
+/*
+ * Makes the built-in sys calls read len bytes at data instead of
+ * stdin. data is not copied and must outlive the VM.
+ */
+void rvm_set_input(RVM *rvm, const void *data, size_t len);
@@ -1,12 +1,423 @@
 /* anewkirk */
 
 #include "reflect.h"
+#include "batch.h"
+#include "icache.h"
+#include "image.h"
+#include "io.h"
+#include "iolog.h"
+#include "jit.h"
+#include "mem.h"
+#include "profile.h"
+#include "recorder.h"
+#include "sampler.h"
+#include "sched.h"
+#include "tcache.h"
+#include "threaded.h"
+#include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Lanes run together by -p
+#define SWEEP_LANES 256
+
+// Bytes of trace -r buffers ahead of the disk
+#define RECORD_RING (16 << 20)
+
+FILE *trace = NULL;
+
+// Counts of -P, and the file the report goes to
+Profile *profile = NULL;
+FILE *profile_out = NULL;
+
+// Binary trace recorded by -r
+Recorder *recorder = NULL;
+
+// Call stacks sampled by -S, and the file they go to
+Sampler *sampler = NULL;
+FILE *stacks_out = NULL;
+
+// The instrumented engine of -t, -r, -P or -S, if one was given
+void (*instrument)(RVM *) = NULL;
+
+void print_usage() {
+  printf("Usage: reflectvm [-e switch|threaded|jit|jit-lockstep] [-n] [-s]\n");
+  printf("                 [-b full|line|none] [-t trace.txt] [-c cachedir]\n");
+  printf("                 [-r trace.rtr] [-P profile.txt]\n");
+  printf("                 [-S stacks.txt [-i n | -T usec]]\n");
+  printf("                 [-l input.log | -L input.log] program.rvm\n");
+  printf("  -e  select the execution engine (default: threaded)\n");
+  printf("  -b  select output buffering (default: line on a terminal)\n");
+  printf("  -n  do not fuse instructions into superinstructions\n");
+  printf("  -s  print instruction counts to stderr on exit\n");
+  printf("  -t  write an execution trace for rmine\n");
+  printf("  -r  record a binary execution trace for rtrace\n");
+  printf("  -c  keep decoded and translated code in cachedir across runs\n");
+  printf("  -P  count executions and write a profile with the hot blocks\n");
+  printf("  -S  sample call stacks and write them folded for flamegraph.pl\n");
+  printf("  -i  instructions between samples (default: 10000)\n");
+  printf("  -T  sample every usec of CPU time instead\n");
+  printf("  -l  record the program's input to a log\n");
+  printf("  -L  replay the input of a log instead of reading stdin\n");
+  printf("  Only one of -t, -r, -P and -S may be given; they use the switch engine.\n");
+  printf("\n");
+  printf("       reflectvm -m manifest.txt [-w workers] [-q quantum]\n");
+  printf("  -m  run every job in the manifest and report on each\n");
+  printf("  -w  worker threads (default: one per CPU)\n");
+  printf("  -q  instructions per time slice (default: 100000)\n");
+  printf("\n");
+  printf("       reflectvm -p inputs.txt [-s] program.rvm\n");
+  printf("  -p  run the program once per line of input, in lockstep\n");
+}
+
+/*
+ * Runs the jobs of a manifest on the scheduler and prints the
+ * report to stderr.
+ */
+void run_manifest(const char *path, SchedConfig *config) {
+  uint32_t count;
+  Job *jobs = read_manifest(path, &count);
+  uint64_t wall = run_jobs(jobs, count, config);
+  print_report(stderr, jobs, count, wall);
+
+  for(uint32_t i = 0; i < count; i++) {
+    free(jobs[i].image);
+    free(jobs[i].input);
+    free(jobs[i].output);
+  }
+  free(jobs);
+}
+
+/*
+ * Runs image once for every line of the inputs file, each run seeing
+ * that line as its stdin, on the batch engine. Outputs are printed
+ * in the order of the lines.
+ */
+void run_sweep(const char *path, char *image, bool stats) {
+  FILE *f = fopen(path, "r");
+  if(!f) {
+    printf("Failed to open file: %s\n", path);
+    exit(1);
+  }
+
+  uint32_t count = 0;
+  uint32_t cap = 256;
+  char **lines = malloc(cap * sizeof(char *));
+  size_t *lens = malloc(cap * sizeof(size_t));
+  char *line = NULL;
+  size_t n = 0;
+  ssize_t len;
+  while((len = getline(&line, &n, f)) != -1) {
+    if(count == cap) {
+      cap *= 2;
+      lines = realloc(lines, cap * sizeof(char *));
+      lens = realloc(lens, cap * sizeof(size_t));
+    }
+    // Every lane sees a terminated line
+    if(!len || line[len - 1] != '\n') {
+      line = realloc(line, len + 2);
+      line[len++] = '\n';
+      line[len] = 0;
+    }
+    lines[count] = line;
+    lens[count++] = len;
+    line = NULL;
+    n = 0;
+  }
+  free(line);
+  fclose(f);
+
+  uint64_t icount = 0;
+  uint64_t vector = 0;
+  uint64_t steps = 0;
+  for(uint32_t first = 0; first < count; first += SWEEP_LANES) {
+    uint32_t lanes = count - first < SWEEP_LANES ? count - first : SWEEP_LANES;
+    Batch *b = new_batch((uint8_t *)image, lanes);
+    char *text[SWEEP_LANES];
+    size_t size[SWEEP_LANES];
+    for(uint32_t i = 0; i < lanes; i++) {
+      RVM *rvm = b->lanes[i];
+      in_set_data(rvm->in, (uint8_t *)lines[first + i], lens[first + i]);
+      rvm->out->mode = OUT_FULL;
+      rvm->out->capture = open_memstream(&text[i], &size[i]);
+    }
+
+    run_batch(b);
+
+    for(uint32_t i = 0; i < lanes; i++) {
+      RVM *rvm = b->lanes[i];
+      out_flush(rvm);
+      fclose(rvm->out->capture);
+      rvm->out->capture = NULL;
+      fwrite(text[i], 1, size[i], stdout);
+      free(text[i]);
+    }
+    icount += b->icount;
+    vector += b->vector;
+    steps += b->steps;
+    free_batch(b);
+  }
+
+  if(stats) {
+    fprintf(stderr, "lanes:        %u\n", count);
+    fprintf(stderr, "instructions: %" PRIu64 "\n", icount);
+    fprintf(stderr, "steps:        %" PRIu64 "\n", steps);
+    fprintf(stderr, "vector:       %" PRIu64 "\n", vector);
+    fprintf(stderr, "scalar:       %" PRIu64 "\n", icount - vector);
+  }
+
+  for(uint32_t i = 0; i < count; i++) {
+    free(lines[i]);
+  }
+  free(lines);
+  free(lens);
+}
+
+/*
+ * The switch engine, writing the pc, opcode and length of every
+ * instruction to the trace file before executing it.
+ */
+void run_traced(RVM *rvm) {
+  rvm->r_flag = true;
+  while(rvm->r_flag) {
+    uint8_t op = vm_load(rvm, rvm->pc);
+    fprintf(trace, "%04X %02X %d\n", rvm->pc, op, insn_length(op));
+    fetch(rvm);
+    decode(rvm);
+    execute(rvm);
+    rvm->icount++;
+  }
+}
+
+// The switch engine, recording a binary trace
+void run_record(RVM *rvm) {
+  run_recorded(rvm, recorder);
+}
+
+// The switch engine, counting into the profile
+void run_profile(RVM *rvm) {
+  run_profiled(rvm, profile);
+}
+
+// The switch engine, sampling call stacks
+void run_sample(RVM *rvm) {
+  run_sampled(rvm, sampler);
+}
+
+// Selects the engine of an instrumentation option; they do not mix
+void set_instrument(void (*engine)(RVM *)) {
+  if(instrument) {
+    printf("Only one of -t, -r, -P and -S can be given.\n");
+    print_usage();
+    exit(1);
+  }
+  instrument = engine;
+}
 
 int main(int argc, char *argv[]) {
+  void (*engine)(RVM *) = run_threaded;
+  char *engine_name = NULL;
+  bool fuse = true;
+  bool stats = false;
+  int out_mode = -1;
+  char *manifest = NULL;
+  char *sweep = NULL;
+  char *cache = NULL;
+  char *log = NULL;
+  bool replay = false;
+  uint64_t period = 10000;
+  uint32_t usec = 0;
+  SchedConfig config;
+  config.workers = sysconf(_SC_NPROCESSORS_ONLN);
+  config.quantum = 100000;
+  int opt;
+
+  while((opt = getopt(argc, argv, "e:b:nst:r:m:w:q:p:c:P:S:i:T:l:L:")) != -1) {
+    switch(opt) {
+    case 'e':
+      engine_name = optarg;
+      if(!strcmp(optarg, "switch")) {
+	engine = run;
+      } else if(!strcmp(optarg, "threaded")) {
+	engine = run_threaded;
+      } else if(!strcmp(optarg, "jit")) {
+	engine = run_jit;
+      } else if(!strcmp(optarg, "jit-lockstep")) {
+	engine = run_jit_lockstep;
+      } else {
+	printf("Unknown engine: %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'b':
+      if(!strcmp(optarg, "full")) {
+	out_mode = OUT_FULL;
+      } else if(!strcmp(optarg, "line")) {
+	out_mode = OUT_LINE;
+      } else if(!strcmp(optarg, "none")) {
+	out_mode = OUT_NONE;
+      } else {
+	printf("Unknown buffering mode: %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'n':
+      fuse = false;
+      break;
+    case 's':
+      stats = true;
+      break;
+    case 't':
+      set_instrument(run_traced);
+      trace = fopen(optarg, "w");
+      if(!trace) {
+	printf("Failed to open file: %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'r':
+      set_instrument(run_record);
+      recorder = open_recorder(optarg, RECORD_RING);
+      break;
+    case 'm':
+      manifest = optarg;
+      break;
+    case 'w':
+      config.workers = atoi(optarg);
+      break;
+    case 'q':
+      config.quantum = strtoull(optarg, NULL, 10);
+      break;
+    case 'p':
+      sweep = optarg;
+      break;
+    case 'c':
+      cache = optarg;
+      break;
+    case 'P':
+      set_instrument(run_profile);
+      profile_out = fopen(optarg, "w");
+      if(!profile_out) {
+	printf("Failed to open file: %s\n", optarg);
+	exit(1);
+      }
+      profile = new_profile();
+      break;
+    case 'S':
+      set_instrument(run_sample);
+      stacks_out = fopen(optarg, "w");
+      if(!stacks_out) {
+	printf("Failed to open file: %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'i':
+      period = strtoull(optarg, NULL, 10);
+      break;
+    case 'T':
+      usec = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+    case 'L':
+      log = optarg;
+      replay = opt == 'L';
+      break;
+    default:
+      print_usage();
+      exit(1);
+    }
+  }
+
+  // Instrumentation runs on the switch engine, so -e may only ask for it
+  if(instrument) {
+    if(engine_name && engine != run) {
+      printf("-t, -r, -P and -S cannot be used with -e %s.\n", engine_name);
+      print_usage();
+      exit(1);
+    }
+    engine = instrument;
+  }
+
+  if(manifest) {
+    if(config.workers < 1 || !config.quantum) {
+      print_usage();
+      exit(1);
+    }
+    config.max_live = 64 * config.workers;
+    run_manifest(manifest, &config);
+    return 0;
+  }
+
+  if(optind != argc - 1 || !period) {
+    print_usage();
+    exit(1);
+  }
+
+  if(sweep) {
+    run_sweep(sweep, argv[optind], stats);
+    return 0;
+  }
+
   RVM *r = new_rvm();
-  load_code(r, argv[1]);
-  run(r);
+  r->fuse = fuse;
+  if(out_mode >= 0) {
+    r->out->mode = out_mode;
+  }
+  // Kept open for the symbols profiles name code by
+  Image *img = open_image(argv[optind]);
+  image_load(img, r);
+  if(log) {
+    r->iolog = open_iolog(log, replay);
+  }
+  if(stacks_out) {
+    sampler = new_sampler(img, period);
+    if(usec) {
+      sampler_timer(sampler, usec);
+    }
+  }
+
+  // Only these engines decode or translate anything worth keeping
+  TCache *tc = NULL;
+  if(cache && (engine == run_threaded || engine == run_jit)) {
+    tc = tcache_open(cache, argv[optind], fuse);
+    tcache_load(tc, r, engine == run_jit);
+  }
+
+  engine(r);
+  fflush(stdout);
+
+  if(tc) {
+    tcache_save(tc, r);
+    tcache_close(tc);
+  }
+
+  if(stats) {
+    fprintf(stderr, "instructions: %" PRIu64 "\n", r->icount);
+    fprintf(stderr, "fused:        %" PRIu64 "\n", r->fused);
+    fprintf(stderr, "unfused:      %" PRIu64 "\n", r->icount - r->fused);
+  }
 
-  free(r);
+  if(trace) {
+    fclose(trace);
+  }
+  if(recorder) {
+    close_recorder(recorder);
+  }
+  if(profile) {
+    profile_report(profile_out, profile, r, img);
+    fclose(profile_out);
+    free_profile(profile);
+  }
+  if(sampler) {
+    sampler_report(stacks_out, sampler, img);
+    fclose(stacks_out);
+    free_sampler(sampler);
+  }
+  close_image(img);
+  if(r->iolog) {
+    close_iolog(r->iolog);
+  }
+  free_rvm(r);
 }
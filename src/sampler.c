@@ -0,0 +1,222 @@
+/*
+ * anewkirk
+ *
+ * The call-graph sampler behind reflectvm -S; see sampler.h.
+ *
+ * The guest keeps return addresses in its own memory, where nothing
+ * marks them as such, so the shadow stack follows the stack pointer
+ * instead: a call pushes a frame, and a ret drops every frame that
+ * was called with more of the stack in use than is left. Frames
+ * abandoned without a ret go at the next ret below them.
+ */
+
+#include "sampler.h"
+#include "bool.h"
+#include "image.h"
+#include "mem.h"
+#include "reflect.h"
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Set by the timer; the engine takes a sample when it sees it
+static volatile sig_atomic_t tick = 0;
+
+static void on_tick(int sig) {
+  (void)sig;
+  tick = 1;
+}
+
+Sampler *new_sampler(Image *img, uint64_t period) {
+  Sampler *s = calloc(1, sizeof(Sampler));
+  s->period = period;
+  s->cap = 1024;
+  s->table = calloc(s->cap, sizeof(StackCount));
+  s->pool_cap = 4096;
+  s->pool = malloc(s->pool_cap * sizeof(uint16_t));
+
+  for(uint32_t a = 0; a < 0x10000; a++) {
+    s->label[a] = -1;
+  }
+  const ImageHeader *h = img ? img->header : NULL;
+  if(h && h->symbols) {
+    const ImageSymbol *sym = (const ImageSymbol *)(img->data + h->symbols);
+    for(uint32_t i = 0; i < h->num_symbols; i++) {
+      s->label[sym[i].addr] = sym[i].addr;
+    }
+    int32_t last = -1;
+    for(uint32_t a = 0; a < 0x10000; a++) {
+      if(s->label[a] < 0) {
+	s->label[a] = last;
+      } else {
+	last = s->label[a];
+      }
+    }
+  }
+  return s;
+}
+
+void free_sampler(Sampler *s) {
+  free(s->table);
+  free(s->pool);
+  free(s);
+}
+
+void sampler_timer(Sampler *s, uint32_t usec) {
+  s->period = 0;
+  s->usec = usec;
+}
+
+static void set_timer(uint32_t usec) {
+  struct itimerval t;
+  t.it_interval.tv_sec = usec / 1000000;
+  t.it_interval.tv_usec = usec % 1000000;
+  t.it_value = t.it_interval;
+  setitimer(ITIMER_PROF, &t, NULL);
+}
+
+static void grow_table(Sampler *s) {
+  uint32_t old_cap = s->cap;
+  StackCount *old = s->table;
+  s->cap *= 2;
+  s->table = calloc(s->cap, sizeof(StackCount));
+  for(uint32_t i = 0; i < old_cap; i++) {
+    if(!old[i].count) {
+      continue;
+    }
+    uint32_t slot = old[i].hash & (s->cap - 1);
+    while(s->table[slot].count) {
+      slot = (slot + 1) & (s->cap - 1);
+    }
+    s->table[slot] = old[i];
+  }
+  free(old);
+}
+
+// Counts one more sample of the stack of len names
+static void count_stack(Sampler *s, uint16_t *names, uint32_t len) {
+  uint32_t bytes = len * sizeof(uint16_t);
+  uint32_t hash = image_hash(IMAGE_FNV_BASIS, (uint8_t *)names, bytes);
+  uint32_t slot = hash & (s->cap - 1);
+  while(s->table[slot].count) {
+    StackCount *c = &s->table[slot];
+    if(c->hash == hash && c->len == len &&
+       !memcmp(s->pool + c->offset, names, bytes)) {
+      c->count++;
+      return;
+    }
+    slot = (slot + 1) & (s->cap - 1);
+  }
+
+  while(s->pool_len + len > s->pool_cap) {
+    s->pool_cap *= 2;
+    s->pool = realloc(s->pool, s->pool_cap * sizeof(uint16_t));
+  }
+  memcpy(s->pool + s->pool_len, names, bytes);
+  s->table[slot] = (StackCount){ hash, s->pool_len, len, 1 };
+  s->pool_len += len;
+  if(++s->used * 2 > s->cap) {
+    grow_table(s);
+  }
+}
+
+static void sample(Sampler *s, uint16_t pc) {
+  uint16_t names[2 * SAMPLER_DEPTH];
+  uint32_t len = 0;
+  for(uint32_t i = 0; i < s->depth; i++) {
+    Frame *f = &s->stack[i];
+    int32_t label = s->label[i == s->depth - 1 ? pc : f->site];
+    names[len++] = f->entry;
+    if(label > f->entry) {
+      names[len++] = label;
+    }
+  }
+  count_stack(s, names, len);
+  s->samples++;
+}
+
+void run_sampled(RVM *rvm, Sampler *s) {
+  s->root_sp = rvm->sp;
+  s->stack[0] = (Frame){ rvm->pc, 0, rvm->pc };
+  s->depth = 1;
+  s->left = s->period;
+  if(s->usec) {
+    tick = 0;
+    signal(SIGPROF, on_tick);
+    set_timer(s->usec);
+  }
+
+  rvm->r_flag = true;
+  while(rvm->r_flag) {
+    uint16_t pc = rvm->pc;
+    uint8_t op = vm_load(rvm, pc);
+    fetch(rvm);
+    decode(rvm);
+    execute(rvm);
+    rvm->icount++;
+
+    if(op >= 0x16 && op <= 0x18) {
+      uint16_t used = s->root_sp - rvm->sp;
+      if(op == 0x18) {
+	while(s->depth > 1 && s->stack[s->depth - 1].used > used) {
+	  s->depth--;
+	}
+      } else if(s->depth < SAMPLER_DEPTH) {
+	s->stack[s->depth - 1].site = pc;
+	s->stack[s->depth++] = (Frame){ rvm->pc, used, rvm->pc };
+      }
+    }
+
+    // A period of 0 wraps left past zero, leaving it to the timer
+    if(tick || !--s->left) {
+      tick = 0;
+      sample(s, rvm->pc);
+      s->left = s->period;
+    }
+  }
+
+  if(s->usec) {
+    set_timer(0);
+    signal(SIGPROF, SIG_DFL);
+  }
+}
+
+static int by_count(const void *a, const void *b) {
+  const StackCount *x = a, *y = b;
+  if(x->count != y->count) {
+    return x->count < y->count ? 1 : -1;
+  }
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+void sampler_report(FILE *f, Sampler *s, Image *img) {
+  StackCount *stacks = malloc(s->used * sizeof(StackCount));
+  uint32_t n = 0;
+  for(uint32_t i = 0; i < s->cap; i++) {
+    if(s->table[i].count) {
+      stacks[n++] = s->table[i];
+    }
+  }
+  qsort(stacks, n, sizeof(StackCount), by_count);
+
+  for(uint32_t i = 0; i < n; i++) {
+    uint16_t *names = s->pool + stacks[i].offset;
+    for(uint32_t k = 0; k < stacks[i].len; k++) {
+      const char *name = img ? image_symbol(img, names[k]) : NULL;
+      if(k) {
+	fputc(';', f);
+      }
+      if(name) {
+	fputs(name, f);
+      } else {
+	fprintf(f, "$%04X", names[k]);
+      }
+    }
+    fprintf(f, " %" PRIu64 "\n", stacks[i].count);
+  }
+  free(stacks);
+}
@@ -0,0 +1,90 @@
+/* anewkirk */
+
+#pragma once
+
+#include "image.h"
+#include "reflect.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// Frames kept on the shadow call stack; deeper calls still run but
+// are sampled as their deepest kept caller
+#define SAMPLER_DEPTH 256
+
+/*
+ * A frame of the shadow call stack: the function's entry, how much
+ * of the guest stack was in use once it was called, and where in it
+ * execution was when it last made a call of its own.
+ */
+typedef struct _frame {
+  uint16_t entry;
+  uint16_t used;
+  uint16_t site;
+} Frame;
+
+// A distinct sampled stack, len names at offset in the pool
+typedef struct _stack_count {
+  uint32_t hash;
+  uint32_t offset;
+  uint32_t len;
+  uint64_t count;
+} StackCount;
+
+/*
+ * The call-graph sampler behind reflectvm -S. The switch engine keeps
+ * a shadow copy of the guest's call stack as call and ret run, and
+ * every period instructions (or every tick of a timer) the frames are
+ * named and the count of that stack is bumped.
+ *
+ * A frame is named by its entry, then by the nearest symbol at or
+ * before the place it is executing when that lies past the entry, so
+ * the loops of a function show up beneath it.
+ */
+typedef struct _sampler {
+  // Instructions between samples, and left until the next; period
+  // is 0 when sampling on a timer of usec instead
+  uint64_t period;
+  uint64_t left;
+  uint32_t usec;
+
+  uint32_t depth;
+  uint16_t root_sp;
+  Frame stack[SAMPLER_DEPTH];
+
+  // Address of the nearest symbol at or before each address, or -1
+  int32_t label[0x10000];
+
+  uint64_t samples;
+  StackCount *table;
+  uint32_t cap;
+  uint32_t used;
+  uint16_t *pool;
+  uint32_t pool_len;
+  uint32_t pool_cap;
+} Sampler;
+
+/*
+ * A sampler taking a sample every period instructions, naming
+ * frames by the symbols of img if it is not NULL.
+ */
+Sampler *new_sampler(Image *img, uint64_t period);
+void free_sampler(Sampler *s);
+
+/*
+ * Samples on a timer of usec microseconds of process CPU time
+ * instead of by instruction count. The timer is SIGPROF and runs
+ * only during run_sampled(), so only one sampler per process can be
+ * running on it.
+ */
+void sampler_timer(Sampler *s, uint32_t usec);
+
+/*
+ * The switch engine, keeping the shadow stack and sampling it.
+ */
+void run_sampled(RVM *rvm, Sampler *s);
+
+/*
+ * Writes the samples as folded stacks, one "outer;...;inner count"
+ * line per distinct stack, the input of flamegraph.pl.
+ */
+void sampler_report(FILE *f, Sampler *s, Image *img);
@@ -0,0 +1,418 @@
+/*
+ * anewkirk
+ *
+ * Runs many ReflectVM instances at once on a pool of worker threads.
+ *
+ * Every worker owns a deque of runnable jobs. It takes work from the
+ * head, runs it for one quantum with run_for() and puts it back at
+ * the tail, so the jobs on a worker share it round-robin. A worker
+ * whose deque is empty admits the next job from the manifest, then
+ * steals from the tail of another worker's deque. Jobs whose input
+ * has not arrived yet are parked on a shared list that idle workers
+ * poll.
+ *
+ * Only max_live jobs hold an RVM at a time, so a manifest of
+ * thousands of programs does not need thousands of VMs in memory.
+ */
+
+#include "bool.h"
+#include "mem.h"
+#include "io.h"
+#include "pool.h"
+#include "reflect.h"
+#include "sched.h"
+#include "threaded.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct _sched {
+  const SchedConfig *config;
+  Job *jobs;
+  uint32_t count;
+  Deque *deques;
+
+  // Protects next, live and remaining
+  pthread_mutex_t lock;
+  uint32_t next;
+  uint32_t live;
+  uint32_t remaining;
+
+  // Jobs blocked on input
+  pthread_mutex_t park_lock;
+  Job **parked;
+  uint32_t num_parked;
+
+  uint64_t start_ns;
+} Sched;
+
+typedef struct _worker {
+  Sched *s;
+  uint32_t id;
+} Worker;
+
+static uint64_t now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static char *copy_field(const char *field) {
+  if(!field || !strcmp(field, "-")) {
+    return NULL;
+  }
+  return strdup(field);
+}
+
+Job *read_manifest(const char *path, uint32_t *count) {
+  FILE *f = fopen(path, "r");
+  if(!f) {
+    printf("Failed to open file: %s\n", path);
+    exit(1);
+  }
+
+  uint32_t cap = 16;
+  Job *jobs = malloc(cap * sizeof(Job));
+  *count = 0;
+
+  char *line = NULL;
+  size_t n = 0;
+  while(getline(&line, &n, f) != -1) {
+    char *image = strtok(line, " \t\r\n");
+    if(!image || image[0] == '#') {
+      continue;
+    }
+    char *input = strtok(NULL, " \t\r\n");
+    char *output = input ? strtok(NULL, " \t\r\n") : NULL;
+
+    if(access(image, R_OK)) {
+      printf("Failed to open file: %s\n", image);
+      exit(1);
+    }
+    if(*count == cap) {
+      cap *= 2;
+      jobs = realloc(jobs, cap * sizeof(Job));
+    }
+    Job *j = &jobs[(*count)++];
+    memset(j, 0, sizeof(Job));
+    j->image = strdup(image);
+    j->input = copy_field(input);
+    j->output = copy_field(output);
+  }
+  free(line);
+  fclose(f);
+  return jobs;
+}
+
+static void deque_init(Deque *d, uint32_t cap) {
+  pthread_mutex_init(&d->lock, NULL);
+  d->slots = malloc(cap * sizeof(Job *));
+  d->cap = cap;
+  d->head = 0;
+  d->size = 0;
+}
+
+static void deque_push(Deque *d, Job *j) {
+  pthread_mutex_lock(&d->lock);
+  d->slots[(d->head + d->size++) % d->cap] = j;
+  pthread_mutex_unlock(&d->lock);
+}
+
+// Takes the job that has waited longest; used by the owner
+static Job *deque_pop(Deque *d) {
+  Job *j = NULL;
+  pthread_mutex_lock(&d->lock);
+  if(d->size) {
+    j = d->slots[d->head];
+    d->head = (d->head + 1) % d->cap;
+    d->size--;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return j;
+}
+
+// Takes the most recently queued job; used by thieves
+static Job *deque_steal(Deque *d) {
+  Job *j = NULL;
+  if(!__atomic_load_n(&d->size, __ATOMIC_RELAXED) ||
+     pthread_mutex_trylock(&d->lock)) {
+    return NULL;
+  }
+  if(d->size) {
+    j = d->slots[(d->head + --d->size) % d->cap];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return j;
+}
+
+static int open_or_die(const char *path, int flags) {
+  int fd = open(path, flags, 0644);
+  if(fd < 0) {
+    printf("Failed to open file: %s\n", path);
+    exit(1);
+  }
+  return fd;
+}
+
+// Gives the next job from the manifest an RVM, if there is room
+static Job *admit(Sched *s) {
+  Job *j = NULL;
+  pthread_mutex_lock(&s->lock);
+  if(s->next < s->count && s->live < s->config->max_live) {
+    j = &s->jobs[s->next++];
+    s->live++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  if(!j) {
+    return NULL;
+  }
+
+  RVM *rvm = pool_acquire(j->pool);
+  rvm->out->mode = OUT_FULL;
+  rvm->out->fd = open_or_die(j->output ? j->output : "/dev/null",
+			     O_WRONLY | O_CREAT | O_TRUNC);
+  rvm->in->fd = open_or_die(j->input ? j->input : "/dev/null", O_RDONLY);
+  rvm->in->nonblock = true;
+  j->rvm = rvm;
+  j->admitted_ns = now_ns() - s->start_ns;
+  return j;
+}
+
+static void finish(Sched *s, Job *j) {
+  RVM *rvm = j->rvm;
+  j->instructions = rvm->icount;
+  j->finished_ns = now_ns() - s->start_ns;
+  out_flush(rvm);
+  close(rvm->out->fd);
+  close(rvm->in->fd);
+  j->restored = pool_release(j->pool, rvm);
+  j->rvm = NULL;
+
+  pthread_mutex_lock(&s->lock);
+  s->live--;
+  s->remaining--;
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void park(Sched *s, Job *j) {
+  pthread_mutex_lock(&s->park_lock);
+  s->parked[s->num_parked++] = j;
+  pthread_mutex_unlock(&s->park_lock);
+}
+
+/*
+ * Polls the input of parked jobs for up to timeout ms. Jobs with
+ * input are queued on worker w, and one of them is returned.
+ */
+static Job *unpark(Sched *s, uint32_t w, int timeout) {
+  if(!__atomic_load_n(&s->num_parked, __ATOMIC_RELAXED) ||
+     pthread_mutex_trylock(&s->park_lock)) {
+    return NULL;
+  }
+
+  uint32_t n = s->num_parked;
+  struct pollfd *fds = malloc(n * sizeof(struct pollfd));
+  for(uint32_t i = 0; i < n; i++) {
+    fds[i].fd = s->parked[i]->rvm->in->fd;
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
+
+  Job *found = NULL;
+  if(poll(fds, n, timeout) > 0) {
+    uint32_t kept = 0;
+    for(uint32_t i = 0; i < n; i++) {
+      Job *j = s->parked[i];
+      if(!fds[i].revents) {
+	s->parked[kept++] = j;
+      } else if(!found) {
+	found = j;
+      } else {
+	deque_push(&s->deques[w], j);
+      }
+    }
+    s->num_parked = kept;
+  }
+
+  pthread_mutex_unlock(&s->park_lock);
+  free(fds);
+  return found;
+}
+
+static Job *find_work(Sched *s, uint32_t w) {
+  Job *j = deque_pop(&s->deques[w]);
+  if(!j) {
+    j = admit(s);
+  }
+  for(uint32_t k = 1; !j && k < s->config->workers; k++) {
+    j = deque_steal(&s->deques[(w + k) % s->config->workers]);
+  }
+  if(!j) {
+    j = unpark(s, w, 0);
+  }
+  return j;
+}
+
+static void *worker_main(void *arg) {
+  Worker *me = arg;
+  Sched *s = me->s;
+  uint32_t w = me->id;
+
+  for(;;) {
+    Job *j = find_work(s, w);
+    if(!j) {
+      if(!__atomic_load_n(&s->remaining, __ATOMIC_ACQUIRE)) {
+	break;
+      }
+      // Nothing runnable here; wait on parked input, or briefly
+      if(!(j = unpark(s, w, 1))) {
+	struct timespec t = { 0, 50000 };
+	nanosleep(&t, NULL);
+	continue;
+      }
+    }
+
+    uint64_t t0 = now_ns();
+    RunExit r = run_for(j->rvm, s->config->quantum);
+    j->run_ns += now_ns() - t0;
+    j->slices++;
+
+    switch(r) {
+    case RUN_HALT:
+      finish(s, j);
+      break;
+    case RUN_BLOCKED:
+      park(s, j);
+      break;
+    case RUN_ILLEGAL: {
+      // Report it in the job's output, then skip it like run_threaded()
+      RVM *rvm = j->rvm;
+      char msg[32];
+      int len = snprintf(msg, sizeof(msg), "Illegal opcode: 0x%x\n",
+			 vm_load(rvm, rvm->pc));
+      out_write(rvm, (uint8_t *)msg, len);
+      run_skip_illegal(rvm);
+      deque_push(&s->deques[w], j);
+      break;
+    }
+    default:
+      deque_push(&s->deques[w], j);
+      break;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Creates a pool for every distinct image and points each job at
+ * its pool. Returns the pools, and their number in loaded.
+ */
+static Pool **load_images(Job *jobs, uint32_t count, uint32_t *loaded) {
+  Pool **pools = malloc((count ? count : 1) * sizeof(Pool *));
+  Job **first = malloc((count ? count : 1) * sizeof(Job *));
+  *loaded = 0;
+  for(uint32_t i = 0; i < count; i++) {
+    Job *j = &jobs[i];
+    j->pool = NULL;
+    for(uint32_t k = 0; k < *loaded && !j->pool; k++) {
+      if(!strcmp(first[k]->image, j->image)) {
+	j->pool = pools[k];
+      }
+    }
+    if(!j->pool) {
+      j->pool = new_pool((uint8_t *)j->image);
+      first[*loaded] = j;
+      pools[(*loaded)++] = j->pool;
+    }
+  }
+  free(first);
+  return pools;
+}
+
+uint64_t run_jobs(Job *jobs, uint32_t count, const SchedConfig *config) {
+  uint32_t loaded;
+  Pool **pools = load_images(jobs, count, &loaded);
+
+  Sched s;
+  s.config = config;
+  s.jobs = jobs;
+  s.count = count;
+  s.next = 0;
+  s.live = 0;
+  s.remaining = count;
+  s.num_parked = 0;
+  s.parked = malloc((count ? count : 1) * sizeof(Job *));
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_mutex_init(&s.park_lock, NULL);
+
+  s.deques = malloc(config->workers * sizeof(Deque));
+  for(uint32_t i = 0; i < config->workers; i++) {
+    deque_init(&s.deques[i], config->max_live);
+  }
+
+  pthread_t *threads = malloc(config->workers * sizeof(pthread_t));
+  Worker *workers = malloc(config->workers * sizeof(Worker));
+  s.start_ns = now_ns();
+  for(uint32_t i = 0; i < config->workers; i++) {
+    workers[i].s = &s;
+    workers[i].id = i;
+    pthread_create(&threads[i], NULL, worker_main, &workers[i]);
+  }
+  for(uint32_t i = 0; i < config->workers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  uint64_t wall = now_ns() - s.start_ns;
+
+  for(uint32_t i = 0; i < config->workers; i++) {
+    free(s.deques[i].slots);
+  }
+  free(s.deques);
+  free(s.parked);
+  free(threads);
+  free(workers);
+  for(uint32_t i = 0; i < loaded; i++) {
+    free_pool(pools[i]);
+  }
+  free(pools);
+  return wall;
+}
+
+void print_report(FILE *f, Job *jobs, uint32_t count, uint64_t wall_ns) {
+  uint64_t total = 0;
+  uint64_t restored = 0;
+  uint64_t worst = 0;
+  double sum_latency = 0;
+
+  fprintf(f, "%6s %14s %8s %10s %10s %10s  %s\n", "job", "instructions",
+	  "slices", "run ms", "latency ms", "MIPS", "image");
+  for(uint32_t i = 0; i < count; i++) {
+    Job *j = &jobs[i];
+    double run_ms = j->run_ns / 1e6;
+    double latency_ms = (j->finished_ns - j->admitted_ns) / 1e6;
+    double mips = j->run_ns ? j->instructions * 1e3 / j->run_ns : 0;
+    fprintf(f, "%6u %14" PRIu64 " %8u %10.3f %10.3f %10.1f  %s\n", i,
+	    j->instructions, j->slices, run_ms, latency_ms, mips, j->image);
+    total += j->instructions;
+    restored += j->restored;
+    sum_latency += latency_ms;
+    if(j->finished_ns > worst) {
+      worst = j->finished_ns;
+    }
+  }
+
+  fprintf(f, "jobs:         %u\n", count);
+  fprintf(f, "instructions: %" PRIu64 "\n", total);
+  fprintf(f, "wall ms:      %.3f\n", wall_ns / 1e6);
+  fprintf(f, "MIPS:         %.1f\n", wall_ns ? total * 1e3 / wall_ns : 0);
+  fprintf(f, "mean latency: %.3f ms\n", count ? sum_latency / count : 0);
+  fprintf(f, "last halt:    %.3f ms\n", worst / 1e6);
+  fprintf(f, "reset pages:  %.1f per job\n",
+	  count ? (double)restored / count : 0);
+}
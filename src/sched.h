@@ -0,0 +1,86 @@
+/* anewkirk */
+
+#pragma once
+
+#include "reflect.h"
+#include "threaded.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// One program run from a manifest
+typedef struct _job {
+  // Image, and the files used as stdin and stdout (NULL for none)
+  char *image;
+  char *input;
+  char *output;
+
+  // VMs for the image, shared by every job running the same one
+  struct _pool *pool;
+
+  // The running instance, NULL before admission and after halting
+  RVM *rvm;
+
+  // Instructions retired
+  uint64_t instructions;
+
+  // Pages of memory restored when the job's VM went back to the pool
+  uint32_t restored;
+
+  // Quanta run, and the time spent running them
+  uint32_t slices;
+  uint64_t run_ns;
+
+  // Times since the start of the run when the job was admitted
+  // and when it halted
+  uint64_t admitted_ns;
+  uint64_t finished_ns;
+} Job;
+
+// Jobs waiting to run on one worker
+typedef struct _deque {
+  pthread_mutex_t lock;
+  Job **slots;
+  uint32_t cap;
+  uint32_t head;
+  uint32_t size;
+} Deque;
+
+// Settings for run_jobs()
+typedef struct _sched_config {
+  // Worker threads
+  uint32_t workers;
+
+  // Instructions a job runs before it is preempted
+  uint64_t quantum;
+
+  // Most jobs holding an RVM at any one time
+  uint32_t max_live;
+} SchedConfig;
+
+/*
+ * Reads a manifest: one job per line, as
+ *
+ *   image.rvm [input [output]]
+ *
+ * where "-" stands for no file. Jobs without input see end of
+ * file, and output of jobs without an output file is discarded.
+ * Blank lines and lines starting with # are skipped. Exits with
+ * an error if the manifest or an image cannot be opened.
+ */
+Job *read_manifest(const char *path, uint32_t *count);
+
+/*
+ * Runs every job to completion on a pool of worker threads. Each
+ * worker keeps a deque of runnable jobs and steals from the others
+ * when it runs dry. Each image is loaded once into a pool of VMs,
+ * which are reset and reused from one job to the next. Jobs are
+ * preempted after a quantum, and jobs waiting for input are parked
+ * until it arrives. Returns the wall time taken, in nanoseconds.
+ */
+uint64_t run_jobs(Job *jobs, uint32_t count, const SchedConfig *config);
+
+/*
+ * Prints the throughput and latency of each job, and totals.
+ */
+void print_report(FILE *f, Job *jobs, uint32_t count, uint64_t wall_ns);
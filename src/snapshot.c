@@ -0,0 +1,103 @@
+/*
+ * anewkirk
+ *
+ * Copy-on-write snapshots of VM state.
+ *
+ * A snapshot captures VM memory once as a MemImage (see mem.h) that
+ * clones are attached to, so creating one costs a mapping rather
+ * than a 64 KiB copy or a read of the image, and a page is copied
+ * only when a clone first writes to it. Pages a clone never writes
+ * stay shared by every clone of the snapshot.
+ *
+ * Stores also mark their 256-byte page in rvm->dirty, which lets
+ * rvm_reset() put a used VM back into the snapshot's state by
+ * restoring only the pages it wrote.
+ */
+
+#include "snapshot.h"
+#include "bool.h"
+#include "icache.h"
+#include "io.h"
+#include "mem.h"
+#include "reflect.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+Snapshot *rvm_snapshot(RVM *rvm) {
+  Snapshot *s = malloc(sizeof(Snapshot));
+  s->image = mem_capture(rvm);
+  memcpy(s->reg, rvm->reg, sizeof(s->reg));
+  s->sp = rvm->sp;
+  s->pc = rvm->pc;
+  s->z_flag = rvm->z_flag;
+  s->c_flag = rvm->c_flag;
+  s->n_flag = rvm->n_flag;
+  s->fuse = rvm->fuse;
+  return s;
+}
+
+RVM *rvm_clone(Snapshot *s) {
+  RVM *rvm = new_rvm();
+  mem_attach(rvm, s->image);
+  memcpy(rvm->reg, s->reg, sizeof(rvm->reg));
+  rvm->sp = s->sp;
+  rvm->pc = s->pc;
+  rvm->z_flag = s->z_flag;
+  rvm->c_flag = s->c_flag;
+  rvm->n_flag = s->n_flag;
+  rvm->fuse = s->fuse;
+  return rvm;
+}
+
+// Whether any byte of the page at a is covered by decoded code
+static bool page_has_code(RVM *rvm, uint32_t a) {
+  if(!rvm->code_map) {
+    return false;
+  }
+  for(uint32_t k = 0; k < MEM_PAGE / 8; k++) {
+    if(rvm->code_map[(a >> 3) + k]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t rvm_reset(RVM *rvm, Snapshot *s) {
+  uint32_t restored = 0;
+  for(uint32_t page = 0; page < 0x100; page++) {
+    if(!rvm->dirty[page]) {
+      continue;
+    }
+    uint32_t a = page * MEM_PAGE;
+    // Code decoded after a store saw the stored bytes, not these
+    if(page_has_code(rvm, a)) {
+      for(uint32_t k = 0; k < MEM_PAGE; k++) {
+	if(rvm->code_map[(a + k) >> 3] & 1 << ((a + k) & 7)) {
+	  icache_invalidate(rvm, a + k);
+	}
+      }
+    }
+    mem_restore_page(rvm, s->image, page);
+    rvm->dirty[page] = 0;
+    restored++;
+  }
+
+  memcpy(rvm->reg, s->reg, sizeof(rvm->reg));
+  rvm->sp = s->sp;
+  rvm->pc = s->pc;
+  rvm->z_flag = s->z_flag;
+  rvm->c_flag = s->c_flag;
+  rvm->n_flag = s->n_flag;
+  rvm->fuse = s->fuse;
+  rvm->r_flag = false;
+  rvm->icount = 0;
+  rvm->fused = 0;
+  io_reset(rvm);
+  return restored;
+}
+
+void free_snapshot(Snapshot *s) {
+  mem_release(s->image);
+  free(s);
+}
@@ -0,0 +1,53 @@
+/* anewkirk */
+
+#pragma once
+
+#include "bool.h"
+#include "mem.h"
+#include "reflect.h"
+#include <stdint.h>
+
+/*
+ * The architectural state of an RVM at one point in time. Every
+ * clone shares the snapshot's memory pages until it writes to one,
+ * and then gets a copy of just the page written.
+ */
+typedef struct _snapshot {
+  struct _mem_image *image;
+
+  uint8_t reg[0x10];
+  uint16_t sp;
+  uint16_t pc;
+  bool z_flag;
+  bool c_flag;
+  bool n_flag;
+  bool fuse;
+} Snapshot;
+
+/*
+ * Takes a snapshot of rvm. Pages of memory that are all zero are
+ * not stored. rvm's own memory is put on the snapshot, so it shares
+ * pages with its clones as well.
+ */
+Snapshot *rvm_snapshot(RVM *rvm);
+
+/*
+ * Creates an RVM in the state the snapshot was taken in. Console
+ * input and output start afresh on stdin and stdout, and engines
+ * decode and translate the code again as it runs.
+ */
+RVM *rvm_clone(Snapshot *s);
+
+/*
+ * Returns rvm, which must be a clone of s or the VM s was taken of,
+ * to the state of s. Only the pages marked dirty since then are
+ * copied back, and predecoded code on them is dropped. Console I/O
+ * goes back to stdin and stdout. Returns the number of 256-byte
+ * pages restored.
+ */
+uint32_t rvm_reset(RVM *rvm, Snapshot *s);
+
+/*
+ * Frees a snapshot. Clones made from it keep their memory.
+ */
+void free_snapshot(Snapshot *s);
@@ -0,0 +1,480 @@
+/*
+ * anewkirk
+ *
+ * The persistent translation cache; see tcache.h.
+ *
+ * An entry is laid out as
+ *
+ *   TCacheHeader
+ *   boundary bitmap, one bit per address with a cached instruction
+ *   Insn[num_insns], in address order
+ *   and, when there is native code:
+ *   covered bitmap, one bit per guest byte translated
+ *   TCacheBlock[num_blocks]
+ *   code[code_len], to be copied to stubs_end of a fresh JIT buffer
+ */
+
+#include "tcache.h"
+#include "bool.h"
+#include "icache.h"
+#include "image.h"
+#include "jit.h"
+#include "mem.h"
+#include "reflect.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TCACHE_MAGIC "RVMC"
+#define BITMAP (0x10000 / 8)
+
+typedef struct _tcache_header {
+  uint8_t magic[4];
+  uint32_t version;
+  uint64_t key;
+
+  // sizeof(Insn) and Jit.stubs_end of the build that wrote the entry
+  uint32_t insn_size;
+  uint32_t stubs_end;
+
+  uint32_t num_insns;
+  uint32_t num_blocks;
+  uint32_t code_len;
+
+  // image_hash() of everything after the header
+  uint32_t checksum;
+} TCacheHeader;
+
+// A translated block starting at guest addr, offset bytes into the buffer
+typedef struct _tcache_block {
+  uint16_t addr;
+  uint16_t pad;
+  uint32_t offset;
+} TCacheBlock;
+
+static uint64_t hash64(uint64_t hash, const void *p, size_t n) {
+  const uint8_t *b = p;
+  for(size_t i = 0; i < n; i++) {
+    hash = (hash ^ b[i]) * 0x100000001B3ull;
+  }
+  return hash;
+}
+
+static void set_bit(uint8_t *map, uint32_t a) {
+  map[a >> 3] |= 1 << (a & 7);
+}
+
+/*
+ * The first address from a on whose bit is set in map, or 0x10000.
+ * Maps are mostly empty, so whole zero words are skipped.
+ */
+static uint32_t next_bit(const uint8_t *map, uint32_t a) {
+  while(a < 0x10000) {
+    uint64_t word;
+    memcpy(&word, map + (a >> 6) * 8, 8);
+    word &= ~0ull << (a & 63);
+    if(word) {
+      return (a & ~63u) + __builtin_ctzll(word);
+    }
+    a = (a | 63) + 1;
+  }
+  return 0x10000;
+}
+
+#define FOR_BITS(a, map) \
+  for(uint32_t a = next_bit(map, 0); a < 0x10000; a = next_bit(map, a + 1))
+
+// Opcodes of each superinstruction, in handler order, after its length
+static const uint8_t fusions[][MAX_FUSE + 1] = {
+#define FUSE2(h, a, b) { 2, a, b },
+#define FUSE3(h, a, b, c) { 3, a, b, c },
+#define FUSE4(h, a, b, c, d) { 4, a, b, c, d },
+#include "fusion.def"
+#undef FUSE2
+#undef FUSE3
+#undef FUSE4
+};
+
+/*
+ * Continues hash with what entries depend on besides the image: the
+ * handler numbering, which follows fusion.def, the layout of Insn,
+ * and the parts of RVM native code addresses directly.
+ */
+static uint64_t build_hash(uint64_t hash) {
+  const uint32_t layout[] = {
+    H_BREAK,
+    H_COUNT,
+    sizeof(Insn),
+    offsetof(Insn, handler),
+    offsetof(Insn, len),
+    offsetof(Insn, span),
+    offsetof(Insn, reg_d),
+    offsetof(Insn, reg_s),
+    offsetof(Insn, imm8),
+    offsetof(Insn, imm16),
+    sizeof(RVM),
+    offsetof(RVM, reg),
+    offsetof(RVM, pc),
+    offsetof(RVM, sp),
+    offsetof(RVM, z_flag),
+    offsetof(RVM, c_flag),
+    offsetof(RVM, n_flag),
+    offsetof(RVM, icount),
+    offsetof(RVM, dirty),
+#ifdef RVM_PAGED_MEM
+    offsetof(RVM, pages),
+#else
+    offsetof(RVM, mem),
+#endif
+  };
+  hash = hash64(hash, layout, sizeof(layout));
+  return hash64(hash, fusions, sizeof(fusions));
+}
+
+TCache *tcache_open(const char *dir, const char *filename, bool fuse) {
+  if(mkdir(dir, 0700) && errno != EEXIST) {
+    printf("Failed to create cache directory: %s\n", dir);
+    exit(1);
+  }
+
+  TCache *tc = calloc(1, sizeof(TCache));
+  tc->img = open_image(filename);
+  uint32_t version = RVM_VERSION;
+  uint64_t key = hash64(0xCBF29CE484222325ull, tc->img->data, tc->img->size);
+  key = hash64(key, &version, sizeof(version));
+  key = hash64(key, &fuse, sizeof(fuse));
+  key = build_hash(key);
+  tc->key = key;
+
+  tc->path = malloc(strlen(dir) + 32);
+  sprintf(tc->path, "%s/%016" PRIx64 ".rtc", dir, key);
+  return tc;
+}
+
+/*
+ * Whether e is what decoding the code at addr in rvm gives, so that
+ * a damaged or foreign entry cannot send an engine off the end of
+ * its dispatch table or past the instructions it covers.
+ */
+static bool consistent(RVM *rvm, uint16_t addr, const Insn *e) {
+  uint8_t b[MAX_INSN_LEN];
+  for(uint8_t i = 0; i < MAX_INSN_LEN; i++) {
+    b[i] = vm_load(rvm, (uint16_t)(addr + i));
+  }
+  if(e->handler >= H_COUNT || e->handler == H_DECODE
+     || e->handler == H_BREAK || e->len != insn_length(b[0])
+     || e->reg_d != b[1] >> 4 || e->reg_s != (b[1] & 0xF)
+     || e->imm8 != b[2] || e->imm16 != (b[2] << 8 | b[3])) {
+    return false;
+  }
+  if(e->handler < H_BREAK) {
+    return e->handler == plain_handler(b[0]) && e->span == e->len;
+  }
+
+  // A superinstruction must cover the opcodes fusion.def gives it
+  const uint8_t *f = fusions[e->handler - H_BREAK - 1];
+  uint32_t span = 0;
+  for(uint8_t k = 0; k < f[0]; k++) {
+    uint8_t op = vm_load(rvm, (uint16_t)(addr + span));
+    if(op != f[k + 1]) {
+      return false;
+    }
+    span += insn_length(op);
+  }
+  return e->span == span;
+}
+
+// Whether the header describes an entry this build can use for rvm
+static bool valid(TCache *tc, RVM *rvm, const TCacheHeader *h,
+		  const uint8_t *data, size_t size) {
+  if(size < sizeof(TCacheHeader) || memcmp(h->magic, TCACHE_MAGIC, 4)
+     || h->version != RVM_VERSION || h->key != tc->key
+     || h->insn_size != sizeof(Insn) || h->num_insns > 0x10000
+     || h->num_blocks > 0x10000) {
+    return false;
+  }
+  uint64_t expect = sizeof(TCacheHeader) + BITMAP
+    + (uint64_t)h->num_insns * sizeof(Insn);
+  if(h->code_len) {
+    expect += BITMAP + (uint64_t)h->num_blocks * sizeof(TCacheBlock)
+      + h->code_len;
+  }
+  if(expect != size) {
+    return false;
+  }
+  uint32_t hash = image_hash(IMAGE_FNV_BASIS, data + sizeof(TCacheHeader),
+			     size - sizeof(TCacheHeader));
+  if(hash != h->checksum) {
+    return false;
+  }
+
+  uint32_t n = 0;
+  const uint8_t *bounds = data + sizeof(TCacheHeader);
+  for(uint32_t i = 0; i < BITMAP; i += 8) {
+    uint64_t word;
+    memcpy(&word, bounds + i, 8);
+    n += __builtin_popcountll(word);
+  }
+  if(n != h->num_insns) {
+    return false;
+  }
+
+  const Insn *e = (const Insn *)(bounds + BITMAP);
+  FOR_BITS(a, bounds) {
+    if(!consistent(rvm, a, e++)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void load_insns(RVM *rvm, const uint8_t *bounds, const Insn *insns) {
+  icache_init(rvm);
+  FOR_BITS(a, bounds) {
+    Insn *e = &rvm->icache[a];
+    memcpy(e, insns++, sizeof(Insn));
+    for(uint8_t i = 0; i < e->span; i++) {
+      set_bit(rvm->code_map, (uint16_t)(a + i));
+    }
+  }
+}
+
+#ifdef HAVE_JIT
+static void load_native(RVM *rvm, const TCacheHeader *h, const uint8_t *p) {
+  Jit *j = jit_init(rvm, false);
+  if(j->used != j->stubs_end || h->stubs_end != j->stubs_end
+     || h->code_len > j->size / 2) {
+    return;
+  }
+  const uint8_t *covered = p;
+  const TCacheBlock *blocks = (const TCacheBlock *)(p + BITMAP);
+  const uint8_t *code = (const uint8_t *)(blocks + h->num_blocks);
+  for(uint32_t i = 0; i < h->num_blocks; i++) {
+    if(blocks[i].offset < j->stubs_end
+       || blocks[i].offset >= j->stubs_end + h->code_len) {
+      return;
+    }
+  }
+
+  memcpy(j->buf + j->stubs_end, code, h->code_len);
+  j->used = j->stubs_end + h->code_len;
+  for(uint32_t i = 0; i < h->num_blocks; i++) {
+    j->blocks[blocks[i].addr] = j->buf + blocks[i].offset;
+  }
+  FOR_BITS(a, covered) {
+    j->covered[a] = 1;
+    set_bit(rvm->code_map, a);
+  }
+}
+#endif
+
+void tcache_load(TCache *tc, RVM *rvm, bool jit) {
+  int fd = open(tc->path, O_RDONLY);
+  if(fd < 0) {
+    return;
+  }
+  struct stat st;
+  if(fstat(fd, &st) || !st.st_size) {
+    close(fd);
+    return;
+  }
+  uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) {
+    return;
+  }
+
+  // Stale or damaged entries are ignored, and replaced on save
+  const TCacheHeader *h = (const TCacheHeader *)data;
+  if(valid(tc, rvm, h, data, st.st_size)) {
+    const uint8_t *bounds = data + sizeof(TCacheHeader);
+    const Insn *insns = (const Insn *)(bounds + BITMAP);
+    load_insns(rvm, bounds, insns);
+    tc->num_insns = h->num_insns;
+    const uint8_t *native = (const uint8_t *)(insns + h->num_insns);
+    if(h->code_len) {
+      tc->code_len = h->code_len;
+#ifdef HAVE_JIT
+      if(jit) {
+	load_native(rvm, h, native);
+      }
+#endif
+    }
+    // Kept so that saving without the JIT does not drop it
+    if(h->code_len && !jit) {
+      tc->native_len = st.st_size - (native - data);
+      tc->native = malloc(tc->native_len);
+      memcpy(tc->native, native, tc->native_len);
+      tc->stubs_end = h->stubs_end;
+      tc->num_blocks = h->num_blocks;
+    }
+  }
+  munmap(data, st.st_size);
+}
+
+// Whether the n bytes at addr still hold what the image loaded there
+static bool unchanged(RVM *rvm, RVM *fresh, uint16_t addr, uint32_t n) {
+  for(uint32_t i = 0; i < n; i++) {
+    uint16_t a = addr + i;
+    if(vm_load(rvm, a) != vm_load(fresh, a)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Appends n bytes to the entry being built
+static uint8_t *append(uint8_t *out, const void *p, size_t n) {
+  memcpy(out, p, n);
+  return out + n;
+}
+
+// Instructions rvm has decoded and native code bytes it has translated
+static void count(RVM *rvm, uint32_t *insns, uint32_t *code) {
+  *insns = 0;
+  *code = 0;
+  // Decoded entries all start on code
+  if(rvm->icache) {
+    FOR_BITS(a, rvm->code_map) {
+      *insns += rvm->icache[a].len != 0;
+    }
+  }
+#ifdef HAVE_JIT
+  if(rvm->jit && !rvm->jit->lockstep) {
+    *code = rvm->jit->used - rvm->jit->stubs_end;
+  }
+#endif
+}
+
+void tcache_save(TCache *tc, RVM *rvm) {
+  // Most warm runs have nothing to add
+  uint32_t insns, code;
+  count(rvm, &insns, &code);
+  if(insns <= tc->num_insns && code <= tc->code_len) {
+    return;
+  }
+
+  RVM *fresh = new_rvm();
+  image_load(tc->img, fresh);
+
+  TCacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TCACHE_MAGIC, 4);
+  h.version = RVM_VERSION;
+  h.key = tc->key;
+  h.insn_size = sizeof(Insn);
+
+  uint8_t *bounds = calloc(BITMAP, 1);
+  if(rvm->icache) {
+    FOR_BITS(a, rvm->code_map) {
+      Insn *e = &rvm->icache[a];
+      if(e->len && e->handler != H_BREAK && unchanged(rvm, fresh, a, e->span)) {
+	set_bit(bounds, a);
+	h.num_insns++;
+      }
+    }
+  }
+
+  uint8_t *covered = NULL;
+#ifdef HAVE_JIT
+  Jit *j = rvm->jit;
+  if(j && !j->lockstep && j->used > j->stubs_end) {
+    covered = calloc(BITMAP, 1);
+    FOR_BITS(a, rvm->code_map) {
+      if(!j->covered[a]) {
+	continue;
+      }
+      set_bit(covered, a);
+      h.num_blocks += j->blocks[a] != NULL;
+      // Translations of rewritten code are all or nothing
+      if(!unchanged(rvm, fresh, a, 1)) {
+	free(covered);
+	covered = NULL;
+	break;
+      }
+    }
+    if(covered) {
+      h.stubs_end = j->stubs_end;
+      h.code_len = j->used - j->stubs_end;
+    } else {
+      h.num_blocks = 0;
+    }
+  }
+#endif
+  free_rvm(fresh);
+
+  if(!covered && tc->native) {
+    h.stubs_end = tc->stubs_end;
+    h.num_blocks = tc->num_blocks;
+    h.code_len = tc->code_len;
+  }
+  if(h.num_insns <= tc->num_insns && h.code_len <= tc->code_len) {
+    free(bounds);
+    free(covered);
+    return;
+  }
+
+  size_t size = sizeof(h) + BITMAP + h.num_insns * sizeof(Insn);
+  if(covered) {
+    size += BITMAP + h.num_blocks * sizeof(TCacheBlock) + h.code_len;
+  } else if(tc->native) {
+    size += tc->native_len;
+  }
+  uint8_t *entry = malloc(size);
+  uint8_t *out = entry + sizeof(h);
+  out = append(out, bounds, BITMAP);
+  FOR_BITS(a, bounds) {
+    out = append(out, &rvm->icache[a], sizeof(Insn));
+  }
+#ifdef HAVE_JIT
+  if(covered) {
+    out = append(out, covered, BITMAP);
+    FOR_BITS(a, covered) {
+      if(j->blocks[a]) {
+	TCacheBlock b = { a, 0, (uint8_t *)j->blocks[a] - j->buf };
+	out = append(out, &b, sizeof(b));
+      }
+    }
+    out = append(out, j->buf + j->stubs_end, h.code_len);
+  }
+#endif
+  if(!covered && tc->native) {
+    out = append(out, tc->native, tc->native_len);
+  }
+  h.checksum = image_hash(IMAGE_FNV_BASIS, entry + sizeof(h),
+			  size - sizeof(h));
+  append(entry, &h, sizeof(h));
+
+  // Write then rename, so readers never see part of an entry
+  char *tmp = malloc(strlen(tc->path) + 8);
+  sprintf(tmp, "%s.XXXXXX", tc->path);
+  int fd = mkstemp(tmp);
+  bool ok = fd >= 0 && !fchmod(fd, 0644) && write(fd, entry, size) == (ssize_t)size;
+  if(fd >= 0) {
+    ok = !close(fd) && ok;
+  }
+  if(!ok || rename(tmp, tc->path)) {
+    fprintf(stderr, "Failed to write cache entry: %s\n", tc->path);
+    unlink(tmp);
+  }
+
+  free(tmp);
+  free(entry);
+  free(bounds);
+  free(covered);
+}
+
+void tcache_close(TCache *tc) {
+  close_image(tc->img);
+  free(tc->native);
+  free(tc->path);
+  free(tc);
+}
@@ -0,0 +1,65 @@
+/* anewkirk */
+
+#pragma once
+
+#include "bool.h"
+#include "image.h"
+#include "reflect.h"
+#include <stdint.h>
+
+/*
+ * A persistent cache of the work engines do on a program: its
+ * instruction boundaries and predecoded (and fused) instructions,
+ * and the JIT's basic-block table and native code. Entries live in
+ * a directory shared by every launcher, one file per image, named
+ * by a hash of the image's contents, RVM_VERSION, the fuse setting,
+ * the superinstruction table and the layout of Insn and RVM. A later
+ * start maps the entry and begins warm; entries that do not decode
+ * the image as this build would are ignored.
+ *
+ * Entries are written to a temporary file and renamed into place,
+ * so a reader sees either a whole entry or none, and launchers may
+ * share the directory. Code the program rewrote before it ran is
+ * never saved.
+ */
+
+typedef struct _tcache {
+  // Entry file for the image, and the image itself
+  char *path;
+  Image *img;
+
+  uint64_t key;
+
+  // Instructions and native code bytes the entry held when loaded
+  uint32_t num_insns;
+  uint32_t code_len;
+
+  // The entry's native code, covered map and block table, when it
+  // was loaded without the JIT
+  uint8_t *native;
+  uint32_t native_len;
+  uint32_t stubs_end;
+  uint32_t num_blocks;
+} TCache;
+
+/*
+ * Opens the cache in dir for the image at filename, creating dir,
+ * private to the user, if needed. fuse is the rvm->fuse the image
+ * will be run with.
+ */
+TCache *tcache_open(const char *dir, const char *filename, bool fuse);
+
+/*
+ * Installs the cached entry, if there is a valid one, into rvm,
+ * which has just loaded the image. Native code is only installed
+ * when jit is set.
+ */
+void tcache_load(TCache *tc, RVM *rvm, bool jit);
+
+/*
+ * Writes what rvm's engines decoded and translated back to the
+ * cache, if that is more than the entry held.
+ */
+void tcache_save(TCache *tc, RVM *rvm);
+
+void tcache_close(TCache *tc);
@@ -0,0 +1,333 @@
+/*
+ * anewkirk
+ *
+ * A direct-threaded interpreter engine for ReflectVM. Instructions are
+ * executed from the predecode cache: every handler ends by looking up
+ * the entry at the new pc and jumping straight to its handler, so there
+ * is no central switch, no decoding in the hot loop and no write-back
+ * of decoder state into the RVM struct.
+ *
+ * The semantics of each opcode are written once, in OP() (op.h). Plain
+ * handlers and the superinstructions from fusion.def are both built
+ * from it; with a constant opcode the switch folds away.
+ *
+ * Instruction budgets cost one compare per dispatch: while at least
+ * MAX_FUSE instructions are left, no handler can overrun the budget,
+ * so only the last few dispatches take the careful path.
+ */
+
+#include "bool.h"
+#include "icache.h"
+#include "mem.h"
+#include "io.h"
+#include "op.h"
+#include "reflect.h"
+#include "threaded.h"
+#include <stdio.h>
+#include <stdint.h>
+
+// Jump to the handler of the predecoded instruction at pc
+#define DISPATCH() do {					\
+    e = &icache[pc];					\
+    if(__builtin_expect(icount >= soft_end, 0)) {	\
+      goto near_end;					\
+    }							\
+    goto *dispatch[e->handler];				\
+  } while(0)
+
+// Leave run_for() with the VM state written back
+#define LEAVE(REASON) do {				\
+    rvm->pc = pc;					\
+    rvm->sp = sp;					\
+    rvm->z_flag = z;					\
+    rvm->c_flag = carry;				\
+    rvm->n_flag = neg;					\
+    rvm->icount = icount;				\
+    rvm->fused = fused;					\
+    return (REASON);					\
+  } while(0)
+
+#define REG(r) reg[r]
+
+// Store to VM memory, dropping any predecoded entries it overwrites
+#define STORE(addr, val) do {					\
+    uint16_t _a = (addr);					\
+    mem_store(rvm, mem, _a, (val));				\
+    if(code_map[_a >> 3] & 1 << (_a & 7)) {			\
+      icache_invalidate(rvm, _a);				\
+    }								\
+  } while(0)
+
+// Handler for a single instruction
+#define PLAIN(OPC) do {					\
+    icount++;						\
+    OP(OPC, e, (uint16_t)(pc + e->len));		\
+    DISPATCH();						\
+  } while(0)
+
+// Before a sys call ending a superinstruction, as in h_sys
+#define TAIL_SYNC(OPC) do {				\
+    if((OPC) == 0x20) {					\
+      rvm->icount = icount - 1;				\
+    }							\
+  } while(0)
+
+/*
+ * Superinstruction handlers. The entries of the instructions after
+ * the first are located before anything runs, because only the last
+ * instruction may store, and a store may invalidate them.
+ */
+#define FUSED2(h, a, b) h##_l: {					\
+    Insn *_e1 = &icache[(uint16_t)(pc + e->len)];		\
+    uint16_t _p2 = (uint16_t)(pc + e->span);			\
+    icount += 2;						\
+    fused += 2;							\
+    OP(a, e, pc);						\
+    TAIL_SYNC(b);						\
+    OP(b, _e1, _p2);						\
+    DISPATCH();							\
+  }
+#define FUSED3(h, a, b, c) h##_l: {				\
+    uint16_t _p1 = (uint16_t)(pc + e->len);			\
+    Insn *_e1 = &icache[_p1];					\
+    Insn *_e2 = &icache[(uint16_t)(_p1 + _e1->len)];		\
+    uint16_t _p3 = (uint16_t)(pc + e->span);			\
+    icount += 3;						\
+    fused += 3;							\
+    OP(a, e, pc);						\
+    OP(b, _e1, pc);						\
+    TAIL_SYNC(c);						\
+    OP(c, _e2, _p3);						\
+    DISPATCH();							\
+  }
+#define FUSED4(h, a, b, c, d) h##_l: {				\
+    uint16_t _p1 = (uint16_t)(pc + e->len);			\
+    Insn *_e1 = &icache[_p1];					\
+    uint16_t _p2 = (uint16_t)(_p1 + _e1->len);			\
+    Insn *_e2 = &icache[_p2];					\
+    Insn *_e3 = &icache[(uint16_t)(_p2 + _e2->len)];		\
+    uint16_t _p4 = (uint16_t)(pc + e->span);			\
+    icount += 4;						\
+    fused += 4;							\
+    OP(a, e, pc);						\
+    OP(b, _e1, pc);						\
+    OP(c, _e2, pc);						\
+    TAIL_SYNC(d);						\
+    OP(d, _e3, _p4);						\
+    DISPATCH();							\
+  }
+
+RunExit run_for(RVM *rvm, uint64_t budget) {
+  static void *dispatch[H_COUNT] = {
+    [H_DECODE] = &&h_decode,
+    [H_NOP] = &&h_nop,
+    [H_MOV_RR] = &&h_mov_rr,
+    [H_MOV_RI] = &&h_mov_ri,
+    [H_MOV_AR] = &&h_mov_ar,
+    [H_MOV_RA] = &&h_mov_ra,
+    [H_MOV_PI] = &&h_mov_pi,
+    [H_MOV_MI] = &&h_mov_mi,
+    [H_MOV_MR] = &&h_mov_mr,
+    [H_MOV_RM] = &&h_mov_rm,
+    [H_HLT] = &&h_hlt,
+    [H_ADD] = &&h_add,
+    [H_SUB] = &&h_sub,
+    [H_INC] = &&h_inc,
+    [H_DEC] = &&h_dec,
+    [H_CMP_RR] = &&h_cmp_rr,
+    [H_CMP_RI] = &&h_cmp_ri,
+    [H_JMP_I] = &&h_jmp_i,
+    [H_JZ_I] = &&h_jz_i,
+    [H_JNZ_I] = &&h_jnz_i,
+    [H_JMP_P] = &&h_jmp_p,
+    [H_JZ_P] = &&h_jz_p,
+    [H_JNZ_P] = &&h_jnz_p,
+    [H_CALL_I] = &&h_call_i,
+    [H_CALL_P] = &&h_call_p,
+    [H_RET] = &&h_ret,
+    [H_PUSH_R] = &&h_push_r,
+    [H_POP] = &&h_pop,
+    [H_PUSH_I] = &&h_push_i,
+    [H_AND] = &&h_and,
+    [H_OR] = &&h_or,
+    [H_XOR] = &&h_xor,
+    [H_MUL_RR] = &&h_mul_rr,
+    [H_SYS] = &&h_sys,
+    [H_DIV_RR] = &&h_div_rr,
+    [H_MUL_RI] = &&h_mul_ri,
+    [H_DIV_RI] = &&h_div_ri,
+    [H_MOD_RR] = &&h_mod_rr,
+    [H_MOD_RI] = &&h_mod_ri,
+    [H_ADD_P] = &&h_add_p,
+    [H_SUB_P] = &&h_sub_p,
+    [H_INC_P] = &&h_inc_p,
+    [H_DEC_P] = &&h_dec_p,
+    [H_CMP_P] = &&h_cmp_p,
+    [H_MOV_RO] = &&h_mov_ro,
+    [H_MOV_RMI] = &&h_mov_rmi,
+    [H_MOV_MRI] = &&h_mov_mri,
+    [H_DJNZ] = &&h_djnz,
+    [H_JC_I] = &&h_jc_i,
+    [H_JN_I] = &&h_jn_i,
+    [H_ILLEGAL] = &&h_illegal,
+    [H_BREAK] = &&h_break,
+#define FUSE2(h, a, b) [h] = &&h##_l,
+#define FUSE3(h, a, b, c) [h] = &&h##_l,
+#define FUSE4(h, a, b, c, d) [h] = &&h##_l,
+#include "fusion.def"
+#undef FUSE2
+#undef FUSE3
+#undef FUSE4
+  };
+
+  if(!rvm->icache) {
+    icache_init(rvm);
+    icache_prepare(rvm, rvm->pc);
+  }
+
+  Insn *icache = rvm->icache;
+  uint8_t *code_map = rvm->code_map;
+  MemBase mem = MEM_BASE(rvm);
+  uint8_t *reg = rvm->reg;
+  uint16_t pc = rvm->pc;
+  uint16_t sp = rvm->sp;
+  bool z = rvm->z_flag;
+  bool carry = rvm->c_flag;
+  bool neg = rvm->n_flag;
+  uint64_t icount = rvm->icount;
+  uint64_t fused = rvm->fused;
+  uint64_t start = icount;
+  uint64_t end = budget > UINT64_MAX - icount ? UINT64_MAX : icount + budget;
+  uint64_t soft_end = end < MAX_FUSE ? 0 : end - MAX_FUSE + 1;
+  Insn *e;
+
+  rvm->r_flag = true;
+  DISPATCH();
+
+ near_end:
+  // Fewer than MAX_FUSE instructions left: split superinstructions
+  if(icount >= end) {
+    LEAVE(RUN_BUDGET);
+  }
+  if(e->handler > H_BREAK && icount + handler_width(e->handler) > end) {
+    goto *dispatch[plain_handler(mem_load(mem, pc))];
+  }
+  goto *dispatch[e->handler];
+
+ h_decode:
+  icache_decode(rvm, pc);
+  DISPATCH();
+
+ h_nop: PLAIN(0x00);
+ h_mov_rr: PLAIN(0x01);
+ h_mov_ri: PLAIN(0x02);
+ h_mov_ar: PLAIN(0x03);
+ h_mov_ra: PLAIN(0x04);
+ h_mov_pi: PLAIN(0x05);
+ h_mov_mi: PLAIN(0x06);
+ h_mov_mr: PLAIN(0x07);
+ h_mov_rm: PLAIN(0x08);
+ h_add: PLAIN(0x0A);
+ h_sub: PLAIN(0x0B);
+ h_inc: PLAIN(0x0C);
+ h_dec: PLAIN(0x0D);
+ h_cmp_rr: PLAIN(0x0E);
+ h_cmp_ri: PLAIN(0x0F);
+ h_jmp_i: PLAIN(0x10);
+ h_jz_i: PLAIN(0x11);
+ h_jnz_i: PLAIN(0x12);
+ h_jmp_p: PLAIN(0x13);
+ h_jz_p: PLAIN(0x14);
+ h_jnz_p: PLAIN(0x15);
+ h_call_i: PLAIN(0x16);
+ h_call_p: PLAIN(0x17);
+ h_ret: PLAIN(0x18);
+ h_push_r: PLAIN(0x19);
+ h_pop: PLAIN(0x1A);
+ h_push_i: PLAIN(0x1B);
+ h_and: PLAIN(0x1C);
+ h_or: PLAIN(0x1D);
+ h_xor: PLAIN(0x1E);
+ h_mul_rr: PLAIN(0x1F);
+ h_sys:
+  if(!in_ready(rvm, e->imm8, mem_load(mem, sp + 1))) {
+    LEAVE(RUN_BLOCKED);
+  }
+  // Input logs (iolog.h) note the count before the call
+  rvm->icount = icount;
+  PLAIN(0x20);
+ h_div_rr: PLAIN(0x21);
+ h_mul_ri: PLAIN(0x22);
+ h_div_ri: PLAIN(0x23);
+ h_mod_rr: PLAIN(0x24);
+ h_mod_ri: PLAIN(0x25);
+ h_add_p: PLAIN(0x26);
+ h_sub_p: PLAIN(0x27);
+ h_inc_p: PLAIN(0x28);
+ h_dec_p: PLAIN(0x29);
+ h_cmp_p: PLAIN(0x2A);
+ h_mov_ro: PLAIN(0x2B);
+ h_mov_rmi: PLAIN(0x2C);
+ h_mov_mri: PLAIN(0x2D);
+ h_djnz: PLAIN(0x2E);
+ h_jc_i: PLAIN(0x2F);
+ h_jn_i: PLAIN(0x30);
+
+#define FUSE2 FUSED2
+#define FUSE3 FUSED3
+#define FUSE4 FUSED4
+#include "fusion.def"
+#undef FUSE2
+#undef FUSE3
+#undef FUSE4
+
+ h_illegal:
+  LEAVE(RUN_ILLEGAL);
+
+ h_break:
+  // A run starting on a breakpoint steps over it
+  if(icount != start) {
+    LEAVE(RUN_BREAK);
+  }
+  goto *dispatch[plain_handler(mem_load(mem, pc))];
+
+ h_hlt:
+  // Leave the VM in the same state the switch engine would
+  icount++;
+  rvm->opcode = 0x09;
+  rvm->reg_d = e->reg_d;
+  rvm->reg_s = e->reg_s;
+  rvm->fetched = 0x09 << 8 | e->reg_d << 4 | e->reg_s;
+  rvm->r_flag = false;
+  out_flush(rvm);
+  pc += e->len;
+  LEAVE(RUN_HALT);
+}
+
+void run_report_illegal(RVM *rvm) {
+  out_flush(rvm);
+  printf("Illegal opcode: 0x%x\n", vm_load(rvm, rvm->pc));
+}
+
+void run_skip_illegal(RVM *rvm) {
+  rvm->pc += insn_length(vm_load(rvm, rvm->pc));
+  rvm->icount++;
+}
+
+void run_threaded(RVM *rvm) {
+  for(;;) {
+    switch(run_for(rvm, UINT64_MAX)) {
+    case RUN_HALT:
+      return;
+    case RUN_ILLEGAL:
+      run_report_illegal(rvm);
+      run_skip_illegal(rvm);
+      break;
+    case RUN_BLOCKED:
+      in_wait(rvm);
+      break;
+    default:
+      break;
+    }
+  }
+}
@@ -0,0 +1,45 @@
+/* anewkirk */
+
+#pragma once
+
+#include "reflect.h"
+#include <stdint.h>
+
+// Why run_for() returned
+typedef enum {
+  // The instruction budget ran out
+  RUN_BUDGET,
+  // A hlt instruction was executed
+  RUN_HALT,
+  // pc is on a breakpoint (see icache_set_break())
+  RUN_BREAK,
+  // pc is on an illegal opcode, which has not been executed
+  RUN_ILLEGAL,
+  // pc is on a sys call waiting for input that has not arrived;
+  // only with rvm->in->nonblock set
+  RUN_BLOCKED
+} RunExit;
+
+/*
+ * Runs at most budget instructions with the direct-threaded engine
+ * and returns why it stopped. The VM can be resumed with another
+ * call; a run starting on a breakpoint executes that instruction.
+ * Pass UINT64_MAX to run without a budget.
+ */
+RunExit run_for(RVM *rvm, uint64_t budget);
+
+/*
+ * After run_for() returns RUN_ILLEGAL: reports the illegal opcode
+ * at pc on stdout, and skips it, counting it as retired, as the
+ * switch engine does.
+ */
+void run_report_illegal(RVM *rvm);
+void run_skip_illegal(RVM *rvm);
+
+/*
+ * Sets r_flag to true and runs the program with the
+ * direct-threaded engine. Behaves exactly like run(),
+ * but dispatches with computed gotos and keeps pc, sp
+ * and the zero flag in locals until the VM halts.
+ */
+void run_threaded(RVM *rvm);
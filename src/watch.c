@@ -0,0 +1,361 @@
+/*
+ * anewkirk
+ *
+ * Watchpoints and breakpoint conditions for rdbg; see watch.h.
+ */
+
+#include "watch.h"
+#include "access.h"
+#include "bool.h"
+#include "mem.h"
+#include "reflect.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+Watches *new_watches() {
+  return calloc(1, sizeof(Watches));
+}
+
+void free_watches(Watches *w) {
+  free(w->mem);
+  free(w->conds);
+  free(w);
+}
+
+// Marks the pages the watchpoint m covers
+static void mark_pages(Watches *w, MemWatch *m) {
+  uint32_t first = m->addr >> 8;
+  uint32_t last = (m->addr + m->len - 1) >> 8;
+  for(uint32_t p = first; p <= last && p < first + WATCH_PAGES; p++) {
+    for(uint8_t k = 0; k < 2; k++) {
+      if(m->kinds & 1 << k) {
+	w->pages[k][(p & 0xFF) >> 3] |= 1 << (p & 7);
+      }
+    }
+  }
+}
+
+void watch_mem(Watches *w, uint16_t addr, uint32_t len, uint8_t kinds) {
+  if(!len || !kinds) {
+    return;
+  }
+  w->mem = realloc(w->mem, (w->num_mem + 1) * sizeof(MemWatch));
+  MemWatch *m = &w->mem[w->num_mem++];
+  m->addr = addr;
+  m->len = len > 0x10000 ? 0x10000 : len;
+  m->kinds = kinds;
+  mark_pages(w, m);
+}
+
+void unwatch_mem(Watches *w, uint32_t i) {
+  if(i >= w->num_mem) {
+    return;
+  }
+  memmove(&w->mem[i], &w->mem[i + 1], (w->num_mem - i - 1) * sizeof(MemWatch));
+  w->num_mem--;
+  memset(w->pages, 0, sizeof(w->pages));
+  for(uint32_t j = 0; j < w->num_mem; j++) {
+    mark_pages(w, &w->mem[j]);
+  }
+}
+
+bool watches_active(Watches *w) {
+  return w->num_mem || w->regs;
+}
+
+static const char *skip(const char *p) {
+  while(isspace((unsigned char)*p)) {
+    p++;
+  }
+  return p;
+}
+
+// Parses a register name at *p into *r and moves past it
+static bool parse_reg(const char **p, uint8_t *r) {
+  const char *s = *p;
+  if(tolower((unsigned char)s[0]) != 'r' || !isxdigit((unsigned char)s[1])) {
+    return false;
+  }
+  char digit[2] = { s[1], 0 };
+  *r = strtoul(digit, NULL, 16);
+  *p = s + 2;
+  return true;
+}
+
+// Parses a pair rX:rY at *p into *xy, or a lone register into *x
+static bool parse_regs(const char **p, uint8_t *x, uint8_t *xy, bool *pair) {
+  if(!parse_reg(p, x)) {
+    return false;
+  }
+  *pair = **p == ':';
+  if(*pair) {
+    (*p)++;
+    uint8_t y;
+    if(!parse_reg(p, &y)) {
+      return false;
+    }
+    *xy = *x << 4 | y;
+  }
+  return true;
+}
+
+static bool parse_hex(const char **p, uint16_t *val) {
+  if(**p != '$' || !isxdigit((unsigned char)(*p)[1])) {
+    return false;
+  }
+  char *end;
+  unsigned long v = strtoul(*p + 1, &end, 16);
+  if(v > 0xFFFF) {
+    return false;
+  }
+  *val = v;
+  *p = end;
+  return true;
+}
+
+static bool parse_operand(const char **p, Operand *o) {
+  const char *s = skip(*p);
+  uint8_t x, xy;
+  bool pair;
+
+  if(*s == '[') {
+    s = skip(s + 1);
+    if(parse_hex(&s, &o->val)) {
+      o->kind = OPND_MEM;
+    } else if(parse_regs(&s, &x, &xy, &pair) && pair) {
+      o->kind = OPND_MEM_PAIR;
+      o->val = xy;
+    } else {
+      return false;
+    }
+    s = skip(s);
+    if(*s != ']') {
+      return false;
+    }
+    *p = s + 1;
+    return true;
+  }
+  if(parse_hex(&s, &o->val)) {
+    o->kind = OPND_IMM;
+  } else if(parse_regs(&s, &x, &xy, &pair)) {
+    o->kind = pair ? OPND_PAIR : OPND_REG;
+    o->val = pair ? xy : x;
+  } else if(!strncmp(s, "sp", 2)) {
+    o->kind = OPND_SP;
+    s += 2;
+  } else if(*s && strchr("zcn", *s) && !isalnum((unsigned char)s[1])) {
+    o->kind = OPND_FLAG;
+    o->val = strchr("zcn", *s) - "zcn";
+    s++;
+  } else {
+    return false;
+  }
+  *p = s;
+  return true;
+}
+
+bool parse_cond(const char *text, Cond *c) {
+  static const char *ops[] = { "==", "!=", "<=", ">=", "<", ">" };
+  static const CondOp codes[] = { COND_EQ, COND_NE, COND_LE, COND_GE, COND_LT,
+				  COND_GT };
+  const char *p = text;
+  if(!parse_operand(&p, &c->lhs)) {
+    return false;
+  }
+  p = skip(p);
+  uint32_t i = 0;
+  while(i < 6 && strncmp(p, ops[i], strlen(ops[i]))) {
+    i++;
+  }
+  if(i == 6) {
+    return false;
+  }
+  c->op = codes[i];
+  p += strlen(ops[i]);
+  if(!parse_operand(&p, &c->rhs) || *skip(p)) {
+    return false;
+  }
+  snprintf(c->text, COND_TEXT, "%.*s", (int)strcspn(text, "\r\n"), text);
+  return true;
+}
+
+void add_cond(Watches *w, Cond *c) {
+  w->conds = realloc(w->conds, (w->num_conds + 1) * sizeof(Cond));
+  w->conds[w->num_conds++] = *c;
+}
+
+void clear_conds(Watches *w, uint16_t addr) {
+  uint32_t kept = 0;
+  for(uint32_t i = 0; i < w->num_conds; i++) {
+    if(w->conds[i].addr != addr) {
+      w->conds[kept++] = w->conds[i];
+    }
+  }
+  w->num_conds = kept;
+}
+
+static uint16_t value(RVM *rvm, Operand *o) {
+  switch(o->kind) {
+  case OPND_IMM:
+    return o->val;
+  case OPND_REG:
+    return rvm->reg[o->val];
+  case OPND_PAIR:
+    return rvm->reg[o->val >> 4] << 8 | rvm->reg[o->val & 0xF];
+  case OPND_MEM:
+    return vm_load(rvm, o->val);
+  case OPND_MEM_PAIR:
+    return vm_load(rvm, rvm->reg[o->val >> 4] << 8 | rvm->reg[o->val & 0xF]);
+  case OPND_SP:
+    return rvm->sp;
+  case OPND_FLAG:
+    return o->val == 0 ? rvm->z_flag : o->val == 1 ? rvm->c_flag : rvm->n_flag;
+  }
+  return 0;
+}
+
+static bool holds(RVM *rvm, Cond *c) {
+  uint16_t a = value(rvm, &c->lhs);
+  uint16_t b = value(rvm, &c->rhs);
+  switch(c->op) {
+  case COND_EQ:
+    return a == b;
+  case COND_NE:
+    return a != b;
+  case COND_LT:
+    return a < b;
+  case COND_LE:
+    return a <= b;
+  case COND_GT:
+    return a > b;
+  case COND_GE:
+    return a >= b;
+  }
+  return false;
+}
+
+bool cond_holds(Watches *w, RVM *rvm, uint16_t addr) {
+  bool any = false;
+  for(uint32_t i = 0; i < w->num_conds; i++) {
+    if(w->conds[i].addr == addr) {
+      if(holds(rvm, &w->conds[i])) {
+	return true;
+      }
+      any = true;
+    }
+  }
+  return !any;
+}
+
+// Whether any of the pages n bytes from addr cover is marked
+static bool on_pages(uint8_t *pages, uint16_t addr, uint32_t n) {
+  uint32_t first = addr >> 8;
+  uint32_t last = (addr + n - 1) >> 8;
+  for(uint32_t p = first; p <= last && p < first + WATCH_PAGES; p++) {
+    if(pages[(p & 0xFF) >> 3] & 1 << (p & 7)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Whether the ranges at[i], len[i] accessed for kind touch a byte
+ * watched for it, which is then noted as the hit.
+ */
+static bool hits(Watches *w, uint8_t kind, uint16_t *at, uint32_t *len,
+		 uint32_t ranges) {
+  for(uint32_t i = 0; i < ranges; i++) {
+    if(!on_pages(w->pages[kind - 1], at[i], len[i])) {
+      continue;
+    }
+    for(uint32_t j = 0; j < w->num_mem; j++) {
+      MemWatch *m = &w->mem[j];
+      if(!(m->kinds & kind)) {
+	continue;
+      }
+      // The ranges overlap if either starts inside the other
+      if((uint16_t)(at[i] - m->addr) < m->len) {
+	w->hit_addr = at[i];
+      } else if((uint16_t)(m->addr - at[i]) < len[i]) {
+	w->hit_addr = m->addr;
+      } else {
+	continue;
+      }
+      w->hit = j;
+      w->hit_kind = kind;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Opcodes that may access memory other than to be fetched
+static const bool accesses[0x100] = {
+  [0x03] = true,
+  [0x04] = true,
+  [0x06] = true,
+  [0x07] = true,
+  [0x08] = true,
+  [0x16] = true,
+  [0x17] = true,
+  [0x18] = true,
+  [0x19] = true,
+  [0x1A] = true,
+  [0x1B] = true,
+  [0x20] = true,
+  [0x2B] = true,
+  [0x2C] = true,
+  [0x2D] = true,
+};
+
+static inline bool is_break(RVM *rvm, uint16_t addr) {
+  return rvm->breaks && rvm->breaks[addr >> 3] & 1 << (addr & 7);
+}
+
+WatchExit run_watched(RVM *rvm, Watches *w) {
+  uint64_t start = rvm->icount;
+  rvm->r_flag = true;
+  while(rvm->r_flag) {
+    uint16_t pc = rvm->pc;
+    if(rvm->icount != start && is_break(rvm, pc) && cond_holds(w, rvm, pc)) {
+      return WATCH_BREAK;
+    }
+
+    bool hit = false;
+    uint8_t b[4];
+    if(w->num_mem && accesses[b[0] = vm_load(rvm, pc)]) {
+      for(uint8_t i = 1; i < 4; i++) {
+	b[i] = vm_load(rvm, pc + i);
+      }
+      uint16_t at[ACCESS_MAX];
+      uint32_t len[ACCESS_MAX];
+      hit = hits(w, WATCH_READ, at, len, insn_reads(rvm, b, at, len)) ||
+	hits(w, WATCH_WRITE, at, len, insn_writes(rvm, b, at, len));
+    }
+    uint8_t was[0x10];
+    if(w->regs) {
+      memcpy(was, rvm->reg, 0x10);
+    }
+
+    fetch(rvm);
+    decode(rvm);
+    execute(rvm);
+    rvm->icount++;
+
+    if(hit) {
+      return WATCH_MEM;
+    }
+    for(uint8_t r = 0; w->regs && r < 0x10; r++) {
+      if(w->regs & 1 << r && rvm->reg[r] != was[r]) {
+	w->hit_reg = r;
+	w->hit_was = was[r];
+	return WATCH_REG;
+      }
+    }
+  }
+  return WATCH_HALT;
+}
@@ -0,0 +1,147 @@
+/* anewkirk */
+
+#pragma once
+
+#include "bool.h"
+#include "reflect.h"
+#include <stdint.h>
+
+/*
+ * Data watchpoints, register watchpoints and breakpoint conditions,
+ * for rdbg. Only run_watched() checks watchpoints, so the other
+ * engines pay nothing for them; rdbg switches to it while any are
+ * set. Conditions are only evaluated once a breakpoint is reached.
+ *
+ * Memory is split into 256-byte pages, with a bit per page and kind
+ * of access for the pages a watchpoint covers, so the watchpoints
+ * themselves are only looked at for accesses that touch one.
+ */
+
+#define WATCH_READ 1
+#define WATCH_WRITE 2
+
+#define WATCH_PAGES 0x100
+
+// The longest condition kept, as typed
+#define COND_TEXT 64
+
+// A watchpoint on len bytes from addr, which wrap at $FFFF
+typedef struct _mem_watch {
+  uint16_t addr;
+  uint32_t len;
+  uint8_t kinds;
+} MemWatch;
+
+typedef enum {
+  OPND_IMM,
+  OPND_REG,
+  OPND_PAIR,
+  OPND_MEM,
+  OPND_MEM_PAIR,
+  OPND_SP,
+  OPND_FLAG
+} OperandKind;
+
+/*
+ * $imm, rX, rX:rY, [$addr], [rX:rY], sp or a flag, z, c or n. val
+ * holds the immediate, address, register, pair as xy, or flag as 0
+ * to 2.
+ */
+typedef struct _operand {
+  OperandKind kind;
+  uint16_t val;
+} Operand;
+
+typedef enum {
+  COND_EQ,
+  COND_NE,
+  COND_LT,
+  COND_LE,
+  COND_GT,
+  COND_GE
+} CondOp;
+
+// Stops the breakpoint at addr only when lhs op rhs, unsigned
+typedef struct _cond {
+  uint16_t addr;
+  Operand lhs;
+  CondOp op;
+  Operand rhs;
+  char text[COND_TEXT];
+} Cond;
+
+// Why run_watched() returned
+typedef enum {
+  WATCH_HALT,
+  // pc is on a breakpoint whose condition, if any, holds
+  WATCH_BREAK,
+  // The instruction just executed accessed a watched byte
+  WATCH_MEM,
+  // The instruction just executed changed a watched register
+  WATCH_REG
+} WatchExit;
+
+typedef struct _watches {
+  MemWatch *mem;
+  uint32_t num_mem;
+
+  // The pages watched for reads and for writes, a bit each
+  uint8_t pages[2][WATCH_PAGES / 8];
+
+  // Registers watched for changes, a bit each
+  uint16_t regs;
+
+  Cond *conds;
+  uint32_t num_conds;
+
+  // What the last run_watched() stopped on: the watchpoint, kind of
+  // access and first address of it watched, or the register and its
+  // value before
+  uint32_t hit;
+  uint8_t hit_kind;
+  uint16_t hit_addr;
+  uint8_t hit_reg;
+  uint8_t hit_was;
+} Watches;
+
+Watches *new_watches();
+
+void free_watches(Watches *w);
+
+/*
+ * Adds a watchpoint on len bytes from addr for the WATCH_* kinds
+ * given, or removes the one numbered i.
+ */
+void watch_mem(Watches *w, uint16_t addr, uint32_t len, uint8_t kinds);
+void unwatch_mem(Watches *w, uint32_t i);
+
+/*
+ * Whether any watchpoint is set, so continuing needs run_watched().
+ */
+bool watches_active(Watches *w);
+
+/*
+ * Parses text such as "r2 == $01" into c, other than its addr.
+ * Returns false if it is not a condition.
+ */
+bool parse_cond(const char *text, Cond *c);
+
+/*
+ * Adds a condition to the breakpoint at c->addr, which stops if any
+ * of its conditions holds, or drops all of those at addr.
+ */
+void add_cond(Watches *w, Cond *c);
+void clear_conds(Watches *w, uint16_t addr);
+
+/*
+ * Whether the breakpoint at addr should stop rvm as it is now: it
+ * has no conditions, or one of them holds.
+ */
+bool cond_holds(Watches *w, RVM *rvm, uint16_t addr);
+
+/*
+ * The switch engine, stopping on breakpoints (see icache_set_break())
+ * and the watchpoints of w. A run starting on a breakpoint executes
+ * that instruction, as with run_for().
+ */
+WatchExit run_watched(RVM *rvm, Watches *w);